@@ -0,0 +1,651 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <cola.h>
+#include <cola-format.h>
+#include <search.h>
+
+/* Benchmark inserts, lookups and scans through the public API. Each insert
+ * workload starts from a new file, the read workloads share one which is bulk
+ * loaded with the same keys as the uniform inserts, every other key so that
+ * the odd ones are sure to miss. Every op is timed for the percentiles and
+ * the I/O and page fault counts are the process's, before and after.
+*/
+
+const char *cmd = "cola-bench";
+
+#define BENCH_ITEMS		(1U << 20)
+#define BENCH_SCAN		100U
+#define BENCH_READPCT		50U
+#define ZIPF_THETA		0.99
+
+struct bench {
+	const char *fn;
+	cola_key_t n;
+	cola_key_t nops;
+	uint64_t seed;
+	size_t memtable;
+	size_t map; /* see cola_map_budget() */
+	size_t rss;
+	size_t cache; /* see cola_cache() */
+	unsigned int scanlen;
+	unsigned int readpct;
+	cola_key_t fed;
+	int loaded;
+};
+
+/* what the kernel counts for us, see proc(5) */
+struct counters {
+	double t;
+	uint64_t rchar;
+	uint64_t wchar;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t minflt;
+	uint64_t majflt;
+};
+
+struct result {
+	const char *name;
+	cola_key_t ops;
+	cola_key_t items; /* found, or scanned */
+	uint64_t *lat;
+	struct counters io;
+};
+
+struct zipf {
+	cola_key_t n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void counters_get(struct counters *s)
+{
+	struct rusage ru;
+	char line[128];
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+
+	f = fopen("/proc/self/io", "r");
+	if ( f ) {
+		while ( fgets(line, sizeof(line), f) ) {
+			sscanf(line, "rchar: %"SCNu64, &s->rchar);
+			sscanf(line, "wchar: %"SCNu64, &s->wchar);
+			sscanf(line, "read_bytes: %"SCNu64, &s->read_bytes);
+			sscanf(line, "write_bytes: %"SCNu64, &s->write_bytes);
+		}
+		fclose(f);
+	}
+
+	if ( !getrusage(RUSAGE_SELF, &ru) ) {
+		s->minflt = ru.ru_minflt;
+		s->majflt = ru.ru_majflt;
+	}
+
+	s->t = now();
+}
+
+static void counters_sub(struct counters *s, const struct counters *from)
+{
+	s->t -= from->t;
+	s->rchar -= from->rchar;
+	s->wchar -= from->wchar;
+	s->read_bytes -= from->read_bytes;
+	s->write_bytes -= from->write_bytes;
+	s->minflt -= from->minflt;
+	s->majflt -= from->majflt;
+}
+
+/* splitmix64, so that the i'th key can be had without the ones before it */
+static uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static cola_key_t nth_key(const struct bench *b, cola_key_t i)
+{
+	return mix(b->seed + i) & ~1ULL;
+}
+
+static uint64_t rnd(uint64_t *state)
+{
+	return mix((*state)++);
+}
+
+static double rnd_unit(uint64_t *state)
+{
+	return (rnd(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Gray et al, "Quickly generating billion-record synthetic databases" */
+static void zipf_init(struct zipf *z, cola_key_t n, double theta)
+{
+	double zeta2;
+	cola_key_t i;
+
+	z->n = n;
+	z->theta = theta;
+	z->alpha = 1.0 / (1.0 - theta);
+	for(z->zetan = 0, i = 1; i <= n; i++)
+		z->zetan += 1.0 / pow(i, theta);
+	zeta2 = 1.0 + pow(0.5, theta);
+	z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static cola_key_t zipf_next(const struct zipf *z, uint64_t *state)
+{
+	double u = rnd_unit(state);
+	double uz = u * z->zetan;
+	cola_key_t ret;
+
+	if ( uz < 1.0 )
+		return 0;
+	if ( uz < 1.0 + pow(0.5, z->theta) )
+		return 1;
+
+	ret = z->n * pow(z->eta * u - z->eta + 1.0, z->alpha);
+	return (ret < z->n) ? ret : z->n - 1;
+}
+
+static int load_feed(void *priv, cola_key_t *key, cola_val_t *val)
+{
+	struct bench *b = priv;
+
+	if ( b->fed == b->n )
+		return 0;
+
+	*key = nth_key(b, b->fed);
+	*val = b->fed++;
+	return 1;
+}
+
+static cola_t bench_open(const struct bench *b, int creat)
+{
+	cola_t c;
+
+	c = (creat) ? cola_creat(b->fn, 1) : cola_open(b->fn, 1);
+	if ( NULL == c )
+		return NULL;
+
+	if ( (b->memtable && !cola_memtable(c, b->memtable)) ||
+			((b->map || b->rss) &&
+			 !cola_map_budget(c, b->map, b->rss)) ||
+			(b->cache && !cola_cache(c, b->cache)) ) {
+		cola_close(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/* the read workloads' file, loaded before they're timed */
+static int bench_load(struct bench *b)
+{
+	char *dir, *sep;
+	cola_t c;
+	int ret;
+
+	c = bench_open(b, 1);
+	if ( NULL == c )
+		return 0;
+
+	dir = strdup(b->fn);
+	if ( NULL == dir ) {
+		cola_close(c);
+		return 0;
+	}
+	sep = strrchr(dir, '/');
+	if ( sep )
+		*sep = '\0';
+
+	b->fed = 0;
+	ret = cola_bulk_load(c, load_feed, b, 0, (sep) ? dir : ".");
+	free(dir);
+	if ( !cola_close(c) || !ret )
+		return 0;
+
+	b->loaded = 1;
+	return 1;
+}
+
+enum {
+	KEYS_SEQ,
+	KEYS_UNIFORM,
+	KEYS_ZIPF,
+};
+
+static int bench_insert(struct bench *b, struct result *r, int keys)
+{
+	uint64_t state = b->seed;
+	struct zipf z;
+	cola_key_t i;
+	cola_t c;
+
+	memset(&z, 0, sizeof(z));
+	if ( keys == KEYS_ZIPF )
+		zipf_init(&z, b->n, ZIPF_THETA);
+
+	/* the read workloads' file gets overwritten */
+	b->loaded = 0;
+	c = bench_open(b, 1);
+	if ( NULL == c )
+		return 0;
+
+	for(i = 0; i < b->n; i++) {
+		cola_key_t key;
+		uint64_t t;
+
+		switch(keys) {
+		case KEYS_SEQ:
+			key = i;
+			break;
+		case KEYS_UNIFORM:
+			key = nth_key(b, i);
+			break;
+		default:
+			key = nth_key(b, zipf_next(&z, &state));
+			break;
+		}
+
+		t = now_ns();
+		if ( !cola_put(c, key, i) ) {
+			cola_close(c);
+			return 0;
+		}
+		r->lat[i] = now_ns() - t;
+	}
+
+	r->ops = b->n;
+	return cola_close(c);
+}
+
+static int bench_seq(struct bench *b, struct result *r)
+{
+	return bench_insert(b, r, KEYS_SEQ);
+}
+
+static int bench_uniform(struct bench *b, struct result *r)
+{
+	return bench_insert(b, r, KEYS_UNIFORM);
+}
+
+static int bench_zipf(struct bench *b, struct result *r)
+{
+	return bench_insert(b, r, KEYS_ZIPF);
+}
+
+static int bench_query(struct bench *b, struct result *r, cola_key_t miss)
+{
+	uint64_t state = b->seed;
+	cola_key_t i;
+	cola_t c;
+
+	c = bench_open(b, 0);
+	if ( NULL == c )
+		return 0;
+
+	for(i = 0; i < b->nops; i++) {
+		cola_key_t key = nth_key(b, rnd(&state) % b->n) | miss;
+		cola_val_t val;
+		int result;
+		uint64_t t;
+
+		t = now_ns();
+		if ( !cola_get(c, key, &val, &result) ) {
+			cola_close(c);
+			return 0;
+		}
+		r->lat[i] = now_ns() - t;
+		r->items += !!result;
+	}
+
+	r->ops = b->nops;
+	return cola_close(c);
+}
+
+static int bench_hit(struct bench *b, struct result *r)
+{
+	return bench_query(b, r, 0);
+}
+
+static int bench_miss(struct bench *b, struct result *r)
+{
+	return bench_query(b, r, 1);
+}
+
+static int bench_scan(struct bench *b, struct result *r)
+{
+	uint64_t state = b->seed;
+	cola_key_t i;
+	cola_t c;
+
+	c = bench_open(b, 0);
+	if ( NULL == c )
+		return 0;
+
+	for(i = 0; i < b->nops; i++) {
+		cola_key_t key, lo = nth_key(b, rnd(&state) % b->n);
+		cola_iter_t it;
+		unsigned int j;
+		cola_val_t val;
+		int result = 1;
+		uint64_t t;
+
+		t = now_ns();
+		it = cola_iter_open(c, lo, ~0ULL);
+		if ( NULL == it ) {
+			cola_close(c);
+			return 0;
+		}
+		for(j = 0; result && j < b->scanlen; j++) {
+			if ( !cola_iter_next(it, &key, &val, &result) ) {
+				cola_iter_close(it);
+				cola_close(c);
+				return 0;
+			}
+			r->items += !!result;
+		}
+		cola_iter_close(it);
+		r->lat[i] = now_ns() - t;
+	}
+
+	r->ops = b->nops;
+	return cola_close(c);
+}
+
+/* lookups of loaded keys, and inserts of new ones */
+static int bench_mixed(struct bench *b, struct result *r)
+{
+	uint64_t state = b->seed;
+	cola_key_t i, nput = 0;
+	cola_t c;
+
+	c = bench_open(b, 0);
+	if ( NULL == c )
+		return 0;
+
+	for(i = 0; i < b->nops; i++) {
+		uint64_t t, x = rnd(&state);
+		cola_val_t val;
+		int ret, result = 0;
+
+		t = now_ns();
+		if ( x % 100 < b->readpct ) {
+			ret = cola_get(c, nth_key(b, (x / 100) % b->n),
+					&val, &result);
+		}else{
+			ret = cola_put(c, nth_key(b, b->n + nput), nput);
+			nput++;
+		}
+		if ( !ret ) {
+			cola_close(c);
+			return 0;
+		}
+		r->lat[i] = now_ns() - t;
+		r->items += !!result;
+	}
+
+	/* the next read workload has to start again */
+	b->loaded = 0;
+	r->ops = b->nops;
+	return cola_close(c);
+}
+
+static const struct workload {
+	const char *name;
+	int (*fn)(struct bench *b, struct result *r);
+	int load;
+} workloads[] = {
+	{"seq", bench_seq, 0},
+	{"uniform", bench_uniform, 0},
+	{"zipf", bench_zipf, 0},
+	{"hit", bench_hit, 1},
+	{"miss", bench_miss, 1},
+	{"scan", bench_scan, 1},
+	{"mixed", bench_mixed, 1},
+};
+#define NR_WORKLOADS (sizeof(workloads)/sizeof(*workloads))
+
+static int lat_cmp(const void *A, const void *B)
+{
+	const uint64_t *a = A, *b = B;
+	return (*a > *b) - (*a < *b);
+}
+
+static uint64_t pct(const struct result *r, double p)
+{
+	cola_key_t i;
+
+	if ( !r->ops )
+		return 0;
+
+	i = p * r->ops;
+	return r->lat[(i < r->ops) ? i : r->ops - 1];
+}
+
+static double rate(const struct result *r)
+{
+	return (r->io.t > 0) ? r->ops / r->io.t : 0;
+}
+
+static void print_text(const struct result *r)
+{
+	printf("%-8s %9"PRIu64" ops %8.3fs %11.0f ops/s "
+		"p50 %.2fus p99 %.2fus p99.9 %.2fus max %.2fus\n",
+		r->name, r->ops, r->io.t, rate(r),
+		pct(r, 0.5) / 1e3, pct(r, 0.99) / 1e3,
+		pct(r, 0.999) / 1e3, pct(r, 1.0) / 1e3);
+	printf("%-8s %9"PRIu64" items, read %.1fMB (%.1fMB disk), "
+		"wrote %.1fMB (%.1fMB disk), faults %"PRIu64
+		" minor %"PRIu64" major\n",
+		"", r->items,
+		r->io.rchar / 1048576.0, r->io.read_bytes / 1048576.0,
+		r->io.wchar / 1048576.0, r->io.write_bytes / 1048576.0,
+		r->io.minflt, r->io.majflt);
+}
+
+static void print_json(const struct bench *b, const struct result *res,
+			unsigned int nr)
+{
+	unsigned int i;
+
+	printf("{\"items\": %"PRIu64", \"ops\": %"PRIu64
+		", \"seed\": %"PRIu64", \"search\": \"%s\", \"results\": [",
+		b->n, b->nops, b->seed, search_kernel());
+	for(i = 0; i < nr; i++) {
+		const struct result *r = res + i;
+
+		printf("%s\n  {\"workload\": \"%s\", \"ops\": %"PRIu64
+			", \"items\": %"PRIu64", \"secs\": %.6f"
+			", \"ops_per_sec\": %.1f,\n"
+			"   \"p50_ns\": %"PRIu64", \"p90_ns\": %"PRIu64
+			", \"p99_ns\": %"PRIu64", \"p999_ns\": %"PRIu64
+			", \"max_ns\": %"PRIu64",\n"
+			"   \"rchar\": %"PRIu64", \"wchar\": %"PRIu64
+			", \"read_bytes\": %"PRIu64
+			", \"write_bytes\": %"PRIu64
+			", \"minflt\": %"PRIu64", \"majflt\": %"PRIu64"}",
+			(i) ? "," : "", r->name, r->ops, r->items, r->io.t,
+			rate(r), pct(r, 0.5), pct(r, 0.9), pct(r, 0.99),
+			pct(r, 0.999), pct(r, 1.0),
+			r->io.rchar, r->io.wchar, r->io.read_bytes,
+			r->io.write_bytes, r->io.minflt, r->io.majflt);
+	}
+	printf("\n]}\n");
+}
+
+static int usage(int code)
+{
+	FILE *f = (code) ? stderr : stdout;
+	unsigned int i;
+
+	fprintf(f, "%s: Usage\n", cmd);
+	fprintf(f, "\t$ %s [-j] [-n items] [-q ops] [-f fn] [-s seed] "
+		"[-m memtable] [-M map] [-R rss] [-C cache] [-l scanlen] "
+		"[-r readpct] [workload...]\n", cmd);
+	fprintf(f, "\nworkloads:");
+	for(i = 0; i < NR_WORKLOADS; i++)
+		fprintf(f, " %s", workloads[i].name);
+	fprintf(f, "\n\n");
+
+	return code;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = {
+		.fn = "cola-bench.cola",
+		.n = BENCH_ITEMS,
+		.nops = BENCH_ITEMS,
+		.seed = 1,
+		.scanlen = BENCH_SCAN,
+		.readpct = BENCH_READPCT,
+	};
+	const struct workload *run[NR_WORKLOADS];
+	struct result res[NR_WORKLOADS];
+	unsigned int i, j, nr = 0;
+	cola_key_t max;
+	int json = 0, opt, ret = EXIT_FAILURE;
+	char *wal;
+
+	if ( argc > 0 )
+		cmd = argv[0];
+
+	while ( (opt = getopt(argc, argv, "jn:q:f:s:m:M:R:C:l:r:h")) != -1 ) {
+		cola_key_t v = 0;
+
+		if ( optarg && !cola_parse_key(optarg, &v) && opt != 'f' )
+			return usage(EXIT_FAILURE);
+
+		switch(opt) {
+		case 'j':
+			json = 1;
+			break;
+		case 'n':
+			b.n = v;
+			break;
+		case 'q':
+			b.nops = v;
+			break;
+		case 'f':
+			b.fn = optarg;
+			break;
+		case 's':
+			b.seed = v;
+			break;
+		case 'm':
+			b.memtable = v;
+			break;
+		case 'M':
+			b.map = v;
+			break;
+		case 'R':
+			b.rss = v;
+			break;
+		case 'C':
+			b.cache = v;
+			break;
+		case 'l':
+			b.scanlen = v;
+			break;
+		case 'r':
+			b.readpct = (v < 100) ? v : 100;
+			break;
+		case 'h':
+			return usage(EXIT_SUCCESS);
+		default:
+			return usage(EXIT_FAILURE);
+		}
+	}
+
+	if ( !b.n )
+		return usage(EXIT_FAILURE);
+
+	for(i = optind; i < (unsigned int)argc; i++) {
+		for(j = 0; j < NR_WORKLOADS; j++) {
+			if ( !strcmp(workloads[j].name, argv[i]) )
+				break;
+		}
+		if ( j == NR_WORKLOADS || nr == NR_WORKLOADS )
+			return usage(EXIT_FAILURE);
+		run[nr++] = workloads + j;
+	}
+	if ( !nr ) {
+		for(nr = 0; nr < NR_WORKLOADS; nr++)
+			run[nr] = workloads + nr;
+	}
+
+	max = (b.n > b.nops) ? b.n : b.nops;
+	memset(res, 0, sizeof(res));
+	for(i = 0; i < nr; i++) {
+		struct counters start;
+
+		res[i].name = run[i]->name;
+		res[i].lat = malloc(max * sizeof(*res[i].lat));
+		if ( NULL == res[i].lat ) {
+			fprintf(stderr, "%s: malloc: out of memory\n", cmd);
+			goto out;
+		}
+
+		if ( run[i]->load && !b.loaded && !bench_load(&b) ) {
+			fprintf(stderr, "%s: load failed\n", cmd);
+			goto out;
+		}
+
+		counters_get(&start);
+		if ( !(*run[i]->fn)(&b, res + i) ) {
+			fprintf(stderr, "%s: %s failed\n", cmd, run[i]->name);
+			goto out;
+		}
+		counters_get(&res[i].io);
+		counters_sub(&res[i].io, &start);
+
+		qsort(res[i].lat, res[i].ops, sizeof(*res[i].lat), lat_cmp);
+		if ( !json )
+			print_text(res + i);
+	}
+
+	if ( json )
+		print_json(&b, res, nr);
+	ret = EXIT_SUCCESS;
+out:
+	for(i = 0; i < nr; i++)
+		free(res[i].lat);
+	unlink(b.fn);
+	if ( asprintf(&wal, "%s.wal", b.fn) >= 0 ) {
+		unlink(wal);
+		free(wal);
+	}
+	return ret;
+}
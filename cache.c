@@ -0,0 +1,392 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <cola.h>
+#include <cache.h>
+#include <cmath.h>
+
+/* Resident blocks are either in A1in, the FIFO, or Am, the LRU. Blocks which
+ * fall out of A1in are remembered, without their data, in A1out and go
+ * straight in to Am if they're read again while they're there. A1in holds at
+ * most a quarter of the blocks and A1out remembers half as many again, as in
+ * Johnson and Shasha's paper. Entries are found through a hash table,
+ * chained, and listed in their queue newest first.
+*/
+#define NONE		(~0U)
+
+enum {
+	A1IN,
+	AM,
+	A1OUT,
+	NR_QUEUES,
+};
+
+struct centry {
+	uint64_t blk;
+	uint32_t prev;
+	uint32_t next; /* in its queue, or the free list */
+	uint32_t chain;
+	uint32_t data; /* NONE if it's in A1out */
+	unsigned int q;
+};
+
+struct queue {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t cnt;
+};
+
+struct cache {
+	pthread_mutex_t lock;
+	int fd;
+	uint8_t *data;
+	struct centry *e;
+	uint32_t nent;
+	uint32_t free;
+	uint32_t *slot; /* free data slots */
+	uint32_t nslot;
+	uint32_t *hash;
+	unsigned int shift;
+	uint32_t kin;
+	uint32_t kout;
+	struct queue q[NR_QUEUES];
+	uint64_t gen; /* bumped by every invalidation */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static uint32_t hash(const struct cache *m, uint64_t blk)
+{
+	return (blk * 0x9e3779b97f4a7c15ULL) >> m->shift;
+}
+
+static uint32_t find(const struct cache *m, uint64_t blk)
+{
+	uint32_t i;
+
+	for(i = m->hash[hash(m, blk)]; i != NONE; i = m->e[i].chain) {
+		if ( m->e[i].blk == blk )
+			return i;
+	}
+
+	return NONE;
+}
+
+static void unhash(struct cache *m, uint32_t i)
+{
+	uint32_t *p;
+
+	for(p = &m->hash[hash(m, m->e[i].blk)]; *p != i; p = &m->e[*p].chain)
+		;
+	*p = m->e[i].chain;
+}
+
+static void q_del(struct cache *m, uint32_t i)
+{
+	struct centry *e = m->e + i;
+	struct queue *q = m->q + e->q;
+
+	if ( e->prev != NONE )
+		m->e[e->prev].next = e->next;
+	else
+		q->head = e->next;
+	if ( e->next != NONE )
+		m->e[e->next].prev = e->prev;
+	else
+		q->tail = e->prev;
+	q->cnt--;
+}
+
+static void q_add(struct cache *m, uint32_t i, unsigned int qno)
+{
+	struct centry *e = m->e + i;
+	struct queue *q = m->q + qno;
+
+	e->q = qno;
+	e->prev = NONE;
+	e->next = q->head;
+	if ( q->head != NONE )
+		m->e[q->head].prev = i;
+	else
+		q->tail = i;
+	q->head = i;
+	q->cnt++;
+}
+
+/* forget an entry altogether */
+static void drop(struct cache *m, uint32_t i)
+{
+	q_del(m, i);
+	unhash(m, i);
+	if ( m->e[i].data != NONE )
+		m->slot[m->nslot++] = m->e[i].data;
+	m->e[i].next = m->free;
+	m->free = i;
+}
+
+/* a data slot for a new block, evicting one if need be */
+static uint32_t reclaim(struct cache *m)
+{
+	uint32_t i, d;
+
+	if ( m->nslot )
+		return m->slot[--m->nslot];
+
+	if ( m->q[A1IN].cnt > m->kin || !m->q[AM].cnt ) {
+		i = m->q[A1IN].tail;
+		d = m->e[i].data;
+		q_del(m, i);
+		m->e[i].data = NONE;
+		q_add(m, i, A1OUT);
+		if ( m->q[A1OUT].cnt > m->kout )
+			drop(m, m->q[A1OUT].tail);
+		return d;
+	}
+
+	i = m->q[AM].tail;
+	d = m->e[i].data;
+	m->e[i].data = NONE;
+	drop(m, i);
+	return d;
+}
+
+static void admit(struct cache *m, uint64_t blk, const uint8_t *src)
+{
+	unsigned int qno = A1IN;
+	uint32_t i;
+
+	i = find(m, blk);
+	if ( i != NONE ) {
+		if ( m->e[i].data != NONE )
+			return;
+
+		/* remembered, so it's been wanted twice */
+		q_del(m, i);
+		qno = AM;
+	}else{
+		i = m->free;
+		m->free = m->e[i].next;
+		m->e[i].blk = blk;
+		m->e[i].chain = m->hash[hash(m, blk)];
+		m->hash[hash(m, blk)] = i;
+	}
+
+	m->e[i].data = reclaim(m);
+	memcpy(m->data + (size_t)m->e[i].data * CACHE_BLOCK, src, CACHE_BLOCK);
+	q_add(m, i, qno);
+}
+
+struct cache *cache_new(int fd, size_t size)
+{
+	struct cache *m;
+	uint32_t i, n, nhash;
+
+	n = size / CACHE_BLOCK;
+	if ( n < 4 || size / CACHE_BLOCK >= (NONE >> 2) ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if ( NULL == m )
+		return NULL;
+
+	m->fd = fd;
+	m->kin = n / 4;
+	m->kout = n / 2;
+	m->nent = n + m->kout + 2;
+	nhash = 1U << (log2_floor64(m->nent) + 1);
+	m->shift = 64 - (log2_floor64(nhash));
+
+	m->e = calloc(m->nent, sizeof(*m->e));
+	m->slot = calloc(n, sizeof(*m->slot));
+	m->hash = malloc(nhash * sizeof(*m->hash));
+	if ( NULL == m->e || NULL == m->slot || NULL == m->hash ||
+			posix_memalign((void **)&m->data, CACHE_BLOCK,
+					(size_t)n * CACHE_BLOCK) ) {
+		m->data = NULL;
+		cache_free(m);
+		return NULL;
+	}
+
+	for(i = 0; i < n; i++)
+		m->slot[i] = n - 1 - i;
+	m->nslot = n;
+	for(i = 0; i < m->nent; i++)
+		m->e[i].next = (i + 1 < m->nent) ? i + 1 : NONE;
+	m->free = 0;
+	memset(m->hash, 0xff, nhash * sizeof(*m->hash));
+	for(i = 0; i < NR_QUEUES; i++) {
+		m->q[i].head = NONE;
+		m->q[i].tail = NONE;
+	}
+
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void cache_free(struct cache *m)
+{
+	if ( m ) {
+		if ( m->hash )
+			pthread_mutex_destroy(&m->lock);
+		free(m->data);
+		free(m->hash);
+		free(m->slot);
+		free(m->e);
+		free(m);
+	}
+}
+
+/* Like fd_pread() but O_DIRECT won't have a read resume part way through a
+ * block, so one which ends short of a block boundary is taken to be the end.
+*/
+static int read_blocks(int fd, uint64_t ofs, uint8_t *buf, size_t *sz)
+{
+	size_t len = *sz;
+	ssize_t ret;
+
+	*sz = 0;
+	while ( *sz < len ) {
+		ret = pread(fd, buf + *sz, len - *sz, (off_t)(ofs + *sz));
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return 0;
+		}
+
+		*sz += (size_t)ret;
+		if ( !ret || (size_t)ret % CACHE_BLOCK )
+			break;
+	}
+
+	return 1;
+}
+
+/* Either every block is there, or the lot is read, in one go and without
+ * the lock, and whatever was read in full is cached unless it may since have
+ * been overwritten.
+*/
+int cache_read(struct cache *m, uint64_t ofs, void *buf, size_t len)
+{
+	uint64_t first, last, blk, gen;
+	uint8_t *out = buf, *tmp;
+	size_t sz, want;
+
+	if ( !len )
+		return 1;
+
+	first = ofs / CACHE_BLOCK;
+	last = (ofs + len - 1) / CACHE_BLOCK;
+
+	pthread_mutex_lock(&m->lock);
+	for(blk = first; blk <= last; blk++) {
+		uint32_t i = find(m, blk);
+		if ( i == NONE || m->e[i].data == NONE )
+			break;
+	}
+
+	if ( blk > last ) {
+		for(blk = first; blk <= last; blk++) {
+			uint32_t i = find(m, blk);
+			uint64_t from = (blk == first) ? ofs % CACHE_BLOCK : 0;
+			uint64_t to = (blk == last) ?
+				(ofs + len - 1) % CACHE_BLOCK + 1 : CACHE_BLOCK;
+
+			if ( m->e[i].q == AM ) {
+				q_del(m, i);
+				q_add(m, i, AM);
+			}
+			memcpy(out, m->data + (size_t)m->e[i].data *
+					CACHE_BLOCK + from, to - from);
+			out += to - from;
+		}
+		m->hits++;
+		pthread_mutex_unlock(&m->lock);
+		return 1;
+	}
+
+	gen = m->gen;
+	m->misses++;
+	pthread_mutex_unlock(&m->lock);
+
+	sz = (last - first + 1) * CACHE_BLOCK;
+	if ( posix_memalign((void **)&tmp, CACHE_BLOCK, sz) )
+		return 0;
+
+	want = ofs + len - first * CACHE_BLOCK;
+	if ( !read_blocks(m->fd, first * CACHE_BLOCK, tmp, &sz) ) {
+		free(tmp);
+		return 0;
+	}
+	if ( sz < want ) {
+		free(tmp);
+		errno = 0;
+		return 0;
+	}
+	memcpy(buf, tmp + (ofs - first * CACHE_BLOCK), len);
+
+	pthread_mutex_lock(&m->lock);
+	for(blk = first; m->gen == gen && blk <= last; blk++) {
+		if ( (blk - first + 1) * CACHE_BLOCK > sz )
+			break;
+		admit(m, blk, tmp + (blk - first) * CACHE_BLOCK);
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	free(tmp);
+	return 1;
+}
+
+void cache_invalidate(struct cache *m, uint64_t ofs, uint64_t len)
+{
+	uint64_t first, last, blk;
+	unsigned int qno;
+	uint32_t i, next;
+
+	if ( !len )
+		return;
+
+	first = ofs / CACHE_BLOCK;
+	last = (len > ~0ULL - ofs) ? ~0ULL / CACHE_BLOCK :
+					(ofs + len - 1) / CACHE_BLOCK;
+
+	pthread_mutex_lock(&m->lock);
+	m->gen++;
+
+	if ( last - first < m->nent ) {
+		for(blk = first; blk <= last; blk++) {
+			i = find(m, blk);
+			if ( i != NONE )
+				drop(m, i);
+		}
+	}else{
+		for(qno = 0; qno < NR_QUEUES; qno++) {
+			for(i = m->q[qno].head; i != NONE; i = next) {
+				blk = m->e[i].blk;
+				next = m->e[i].next;
+				if ( blk >= first && blk <= last )
+					drop(m, i);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&m->lock);
+}
+
+void cache_stats(struct cache *m, uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&m->lock);
+	*hits = m->hits;
+	*misses = m->misses;
+	pthread_mutex_unlock(&m->lock);
+}
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <libgen.h>
 
 #include <cola.h>
 
@@ -19,7 +20,20 @@ static int usage(int code)
 	fprintf(f, "\t$ %s create [-f] <fn>\n", cmd);
 	fprintf(f, "\t$ %s query <fn> <key>\n", cmd);
 	fprintf(f, "\t$ %s insert <fn> <key>\n", cmd);
+	fprintf(f, "\t$ %s put <fn> <key> <val>\n", cmd);
+	fprintf(f, "\t$ %s get <fn> <key>\n", cmd);
+	fprintf(f, "\t$ %s delete <fn> <key>\n", cmd);
+	fprintf(f, "\t$ %s scan <fn> <lo> <hi>\n", cmd);
 	fprintf(f, "\t$ %s dump <fn>\n", cmd);
+	fprintf(f, "\t$ %s pack <fn> <lvl>\n", cmd);
+	fprintf(f, "\t$ %s columns <fn> <lvl>\n", cmd);
+	fprintf(f, "\t$ %s load <fn> [mem] < <key [val] lines>\n", cmd);
+	fprintf(f, "\t$ %s stats <fn> [key...]\n", cmd);
+	fprintf(f, "\t$ %s kvcreate [-f] <fn>\n", cmd);
+	fprintf(f, "\t$ %s kvput <fn> <key> <val>\n", cmd);
+	fprintf(f, "\t$ %s kvget <fn> <key>\n", cmd);
+	fprintf(f, "\t$ %s kvdelete <fn> <key>\n", cmd);
+	fprintf(f, "\t$ %s kvscan <fn> <lo> [hi]\n", cmd);
 	fprintf(f, "\t$ %s help\n", cmd);
 	fprintf(f, "\n");
 
@@ -119,6 +133,94 @@ static int do_insert(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int do_put(int argc, char **argv)
+{
+	const char *fn;
+	cola_key_t key;
+	cola_val_t val;
+	cola_t c;
+
+	if ( argc < 4 )
+		return usage(EXIT_FAILURE);
+
+	fn = argv[1];
+	if ( !cola_parse_key(argv[2], &key) )
+		return usage(EXIT_FAILURE);
+	if ( !cola_parse_key(argv[3], &val) )
+		return usage(EXIT_FAILURE);
+
+	c = cola_open(fn, 1);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_put(c, key, val) ) {
+		cola_close(c);
+		return EXIT_FAILURE;
+	}
+
+	cola_close(c);
+	return EXIT_SUCCESS;
+}
+
+static int do_get(int argc, char **argv)
+{
+	const char *fn;
+	cola_key_t key;
+	cola_val_t val;
+	int result;
+	cola_t c;
+
+	if ( argc < 3 )
+		return usage(EXIT_FAILURE);
+
+	fn = argv[1];
+	if ( !cola_parse_key(argv[2], &key) )
+		return usage(EXIT_FAILURE);
+
+	c = cola_open(fn, 0);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_get(c, key, &val, &result) ) {
+		cola_close(c);
+		return EXIT_FAILURE;
+	}
+
+	if ( result )
+		printf("key %"PRId64" = %"PRId64"\n", key, val);
+	else
+		printf("key %"PRId64" not found\n", key);
+
+	cola_close(c);
+	return EXIT_SUCCESS;
+}
+
+static int do_delete(int argc, char **argv)
+{
+	const char *fn;
+	cola_key_t key;
+	cola_t c;
+
+	if ( argc < 3 )
+		return usage(EXIT_FAILURE);
+
+	fn = argv[1];
+	if ( !cola_parse_key(argv[2], &key) )
+		return usage(EXIT_FAILURE);
+
+	c = cola_open(fn, 1);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_delete(c, key) ) {
+		cola_close(c);
+		return EXIT_FAILURE;
+	}
+
+	cola_close(c);
+	return EXIT_SUCCESS;
+}
+
 static int do_query(int argc, char **argv)
 {
 	const char *fn;
@@ -149,6 +251,50 @@ static int do_query(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int do_scan(int argc, char **argv)
+{
+	const char *fn;
+	cola_key_t lo, hi, key;
+	cola_val_t val;
+	cola_iter_t it;
+	int result;
+	cola_t c;
+
+	if ( argc < 4 )
+		return usage(EXIT_FAILURE);
+
+	fn = argv[1];
+	if ( !cola_parse_key(argv[2], &lo) )
+		return usage(EXIT_FAILURE);
+	if ( !cola_parse_key(argv[3], &hi) )
+		return usage(EXIT_FAILURE);
+
+	c = cola_open(fn, 0);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	it = cola_iter_open(c, lo, hi);
+	if ( NULL == it ) {
+		cola_close(c);
+		return EXIT_FAILURE;
+	}
+
+	for(;;) {
+		if ( !cola_iter_next(it, &key, &val, &result) ) {
+			cola_iter_close(it);
+			cola_close(c);
+			return EXIT_FAILURE;
+		}
+		if ( !result )
+			break;
+		printf("%"PRId64" %"PRId64"\n", key, val);
+	}
+
+	cola_iter_close(it);
+	cola_close(c);
+	return EXIT_SUCCESS;
+}
+
 static int do_dump(int argc, char **argv)
 {
 	const char *fn;
@@ -171,6 +317,291 @@ static int do_dump(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int set_layout(int argc, char **argv,
+			int (*set)(cola_t c, unsigned int lvl))
+{
+	const char *fn;
+	cola_key_t lvl;
+	cola_t c;
+
+	if ( argc < 3 )
+		return usage(EXIT_FAILURE);
+
+	fn = argv[1];
+	if ( !cola_parse_key(argv[2], &lvl) )
+		return usage(EXIT_FAILURE);
+
+	c = cola_open(fn, 1);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !(*set)(c, lvl) ) {
+		cola_close(c);
+		return EXIT_FAILURE;
+	}
+
+	cola_close(c);
+	return EXIT_SUCCESS;
+}
+
+static int do_pack(int argc, char **argv)
+{
+	return set_layout(argc, argv, cola_pack);
+}
+
+static int do_columns(int argc, char **argv)
+{
+	return set_layout(argc, argv, cola_columns);
+}
+
+/* one "key [val]" a line, val defaults to 0 like insert */
+static int load_feed(void *priv, cola_key_t *key, cola_val_t *val)
+{
+	char buf[128], *k, *v, *save;
+	FILE *f = priv;
+
+	do {
+		if ( NULL == fgets(buf, sizeof(buf), f) )
+			return (ferror(f)) ? -1 : 0;
+		k = strtok_r(buf, " \t\r\n", &save);
+	} while ( NULL == k );
+
+	v = strtok_r(NULL, " \t\r\n", &save);
+	*val = 0;
+	if ( !cola_parse_key(k, key) || (v && !cola_parse_key(v, val)) ) {
+		fprintf(stderr, "%s: load: bad item: %s\n", cmd, k);
+		return -1;
+	}
+
+	return 1;
+}
+
+static int do_load(int argc, char **argv)
+{
+	char *fn, *dir;
+	cola_key_t mem = 0;
+	cola_t c;
+	int ret;
+
+	if ( argc < 2 )
+		return usage(EXIT_FAILURE);
+
+	fn = argv[1];
+	if ( argc > 2 && !cola_parse_key(argv[2], &mem) )
+		return usage(EXIT_FAILURE);
+
+	c = cola_open(fn, 1);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	dir = strdup(fn);
+	if ( NULL == dir ) {
+		cola_close(c);
+		return EXIT_FAILURE;
+	}
+
+	ret = cola_bulk_load(c, load_feed, stdin, mem, dirname(dir));
+	free(dir);
+	if ( !cola_close(c) || !ret )
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+/* the levels, and what it took to look up any keys given */
+static int do_stats(int argc, char **argv)
+{
+	struct cola_stats st;
+	cola_key_t key;
+	unsigned int i;
+	int result;
+	cola_t c;
+
+	if ( argc < 2 )
+		return usage(EXIT_FAILURE);
+
+	c = cola_open(argv[1], 0);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_stats_enable(c) ) {
+		cola_close(c);
+		return EXIT_FAILURE;
+	}
+
+	for(i = 2; i < (unsigned int)argc; i++) {
+		if ( !cola_parse_key(argv[i], &key) ||
+				!cola_query(c, key, &result) ) {
+			cola_close(c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	cola_stats(c, &st);
+	printf("%5s %12s %7s %12s %7s %12s %14s %10s %9s\n",
+		"level", "entries", "merges", "merged", "spills", "spilled",
+		"bytes", "ms", "probes");
+	for(i = 0; i < st.nlevels; i++) {
+		const struct cola_level_stats *l = st.level + i;
+
+		printf("%5u %12"PRIu64" %7"PRIu64" %12"PRIu64" %7"PRIu64
+			" %12"PRIu64" %14"PRIu64" %10.3f %9"PRIu64"\n",
+			i, l->nelem, l->merges, l->merged, l->spills,
+			l->spilled, l->bytes, l->nsec / 1e6, l->probes);
+	}
+
+	printf("lookups %"PRIu64", flushes %"PRIu64", remaps %"PRIu64"\n",
+		st.lookups, st.flushes, st.remaps);
+	for(i = 0; i <= COLA_STATS_LEVELS; i++) {
+		if ( st.depth[i] )
+			printf(" %u levels searched: %"PRIu64"\n",
+				i, st.depth[i]);
+	}
+
+	cola_close(c);
+	return EXIT_SUCCESS;
+}
+
+static int do_kvcreate(int argc, char **argv)
+{
+	cola_kv_t c;
+	int force = 0;
+
+	if ( argc == 3 && !strcmp(argv[1], "-f") ) {
+		force = 1;
+		argv++;
+	}else if ( argc != 2 ) {
+		return usage(EXIT_FAILURE);
+	}
+
+	c = cola_kv_creat(argv[1], force, NULL);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_kv_close(c) )
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+static int do_kvput(int argc, char **argv)
+{
+	cola_kv_t c;
+
+	if ( argc < 4 )
+		return usage(EXIT_FAILURE);
+
+	c = cola_kv_open(argv[1], 1, NULL);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_kv_put(c, argv[2], strlen(argv[2]),
+				argv[3], strlen(argv[3])) ) {
+		cola_kv_close(c);
+		return EXIT_FAILURE;
+	}
+
+	if ( !cola_kv_close(c) )
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+static int do_kvget(int argc, char **argv)
+{
+	const void *val;
+	size_t vlen;
+	int result;
+	cola_kv_t c;
+
+	if ( argc < 3 )
+		return usage(EXIT_FAILURE);
+
+	c = cola_kv_open(argv[1], 0, NULL);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_kv_get(c, argv[2], strlen(argv[2]),
+				&val, &vlen, &result) ) {
+		cola_kv_close(c);
+		return EXIT_FAILURE;
+	}
+
+	if ( result )
+		printf("key %s = %.*s\n", argv[2],
+			(int)vlen, (const char *)val);
+	else
+		printf("key %s not found\n", argv[2]);
+
+	cola_kv_close(c);
+	return EXIT_SUCCESS;
+}
+
+static int do_kvdelete(int argc, char **argv)
+{
+	cola_kv_t c;
+
+	if ( argc < 3 )
+		return usage(EXIT_FAILURE);
+
+	c = cola_kv_open(argv[1], 1, NULL);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	if ( !cola_kv_delete(c, argv[2], strlen(argv[2])) ) {
+		cola_kv_close(c);
+		return EXIT_FAILURE;
+	}
+
+	if ( !cola_kv_close(c) )
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+static int do_kvscan(int argc, char **argv)
+{
+	const void *key, *val;
+	size_t klen, vlen;
+	cola_kv_iter_t it;
+	const char *hi;
+	int result;
+	cola_kv_t c;
+
+	if ( argc < 3 )
+		return usage(EXIT_FAILURE);
+
+	hi = (argc > 3) ? argv[3] : NULL;
+
+	c = cola_kv_open(argv[1], 0, NULL);
+	if ( NULL == c )
+		return EXIT_FAILURE;
+
+	it = cola_kv_iter_open(c, argv[2], strlen(argv[2]),
+				hi, (hi) ? strlen(hi) : 0);
+	if ( NULL == it ) {
+		cola_kv_close(c);
+		return EXIT_FAILURE;
+	}
+
+	for(;;) {
+		if ( !cola_kv_iter_next(it, &key, &klen, &val, &vlen,
+					&result) ) {
+			cola_kv_iter_close(it);
+			cola_kv_close(c);
+			return EXIT_FAILURE;
+		}
+		if ( !result )
+			break;
+		printf("%.*s %.*s\n", (int)klen, (const char *)key,
+			(int)vlen, (const char *)val);
+	}
+
+	cola_kv_iter_close(it);
+	cola_kv_close(c);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
 	unsigned int i;
@@ -181,8 +612,21 @@ int main(int argc, char **argv)
 		{"create", do_create},
 		{"query", do_query},
 		{"insert", do_insert},
+		{"put", do_put},
+		{"get", do_get},
+		{"delete", do_delete},
+		{"scan", do_scan},
 		{"insertrandom", do_insertrandom},
 		{"dump", do_dump},
+		{"pack", do_pack},
+		{"columns", do_columns},
+		{"load", do_load},
+		{"stats", do_stats},
+		{"kvcreate", do_kvcreate},
+		{"kvput", do_kvput},
+		{"kvget", do_kvget},
+		{"kvdelete", do_kvdelete},
+		{"kvscan", do_kvscan},
 	};
 
 	if ( argc > 0 )
@@ -7,17 +7,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include <bits/wordsize.h>
 
 #include <cola.h>
 #include <cola-format.h>
 #include <minheap.h>
+#include <losertree.h>
+#include <cmath.h>
+#include <wal.h>
+#include <memtable.h>
+#include <epoch.h>
+#include <search.h>
+#include <cache.h>
 #include <os.h>
 
 #define NUM_LEVELS		64U
@@ -31,14 +41,86 @@
 # define MAP_LEVELS		23 /* 8M */
 #endif
 
-#define RDBUF_SIZE		(4 << 20) /* 4MB read buffers */
+/* Merges stream through each of their levels once, where lookups touch a
+ * few pages of each. Levels from ADVISE_MIN_LEVEL up are told which, see
+ * advise(), and merges ask for the first ADVISE_AHEAD bytes of each input.
+*/
+#define ADVISE_MIN_LEVEL	12U
+#define ADVISE_AHEAD		(BLOCK_SIZE * 16U)
+
+/* Every level is followed by its lookahead array: every LA_STRIDE'th entry
+ * of the next level up merged with that level's own lookahead array. The
+ * lookahead entries which bracket a key bound its position in the next
+ * level, and in the next lookahead array, to a window of LA_STRIDE entries
+ * so a query costs O(1) block transfers per level.
+*/
+#define LA_SHIFT		4U
+#define LA_STRIDE		(1U << LA_SHIFT)
+#define WIN_ELEM		(LA_STRIDE + 2)
+
+/* Each level also has a blocked bloom filter of its keys: 8 bits per key but
+ * at least one block. A key sets BLOOM_PROBES bits all within one 64 byte
+ * block so that a negative lookup costs one cache line, or one small read.
+*/
+#define BLOOM_BLOCK		64U
+#define BLOOM_MIN_LEVEL		6U /* 2^6 keys fill one block */
+#define BLOOM_PROBES		6U
+#define BLOOM_BITS		9U /* log2 bits per block */
+
+/* Levels from c_packlvl up may be packed, see struct cola_pidx. They're never
+ * mapped, each block is decoded whole as it's read. Anything smaller than
+ * PACK_MIN_LEVEL isn't worth it.
+*/
+#define PACK_SHIFT		8U /* log2 COLA_PACK_ELEM */
+#define PACK_BLOCK		(COLA_PACK_ELEM * sizeof(struct cola_elem))
+#define PACK_PAD		16U /* unpacking reads a word past the last bit */
+#define PACK_IDX		16U /* index entries read at a time by queries */
+#define PACK_MIN_LEVEL		12U
+
+/* Levels from c_collvl up, short of the packed ones, are split in to two
+ * columns: all of the keys then all of the values. Searches only touch keys
+ * and values are only read for the entries wanted. Merges go through a buffer
+ * which the columns are spread in to, and gathered back out of, even if the
+ * level's mapped.
+*/
+#define COLS_MIN_LEVEL		8U
+#define COLS_WIN		512U /* keys which queries read at once, 4KB */
+
+/* merges use a loser tree, set this to fall back to the binary min-heap */
+//#define MERGE_HEAP 1
+
+/* merges in to this level or above are split between c_nthreads threads */
+#define PAR_MERGE_LEVEL		24
+
+#define RDBUF_SIZE		(16 << 20) /* 16MB read buffers, 4 blocks per input */
 #define WRBUF_SIZE		(4 << 20) /* 4MB write buffers */
+#define LABUF_SIZE		(2 << 20) /* 2MB lookahead write buffer */
 #define RDBUF_ELEM		(RDBUF_SIZE / sizeof(struct cola_elem))
 #define WRBUF_ELEM		(WRBUF_SIZE / sizeof(struct cola_elem))
-#define TOTAL_BUFFER_SIZE	(RDBUF_SIZE + WRBUF_SIZE)
+#define LABUF_ELEM		(LABUF_SIZE / sizeof(struct cola_elem))
+#define TOTAL_BUFFER_SIZE	(RDBUF_SIZE + WRBUF_SIZE + LABUF_SIZE)
+#define INBUF_BLOCKS		4U /* blocks of read-ahead per input with a ring */
+#define RING_MIN_LEVEL		16U /* smaller merges don't pay for ring setup */
+#define PART_WRBUF_SIZE	(1 << 20) /* per-thread write buffers */
+#define PART_LABUF_SIZE		(256 << 10)
 #define MAX_RDBUF		(RDBUF_SIZE >> NUM_LEVELS)
 #define MAX_RDBUF_ELEM		(MAX_RDBUF / sizeof(struct cola_elem)
 
+/* Levels below this are never made durable by a commit, whatever is in them
+ * is replayed from the log after a crash.
+*/
+#define WAL_LEVEL		16U
+#define HDR_SLOT		(COLA_HDR_SIZE / 2)
+
+/* default write buffer, 1MB fills level WAL_LEVEL, see cola_memtable() */
+#define MEMTABLE_SIZE		(1U << 20)
+
+/* memory for a bulk load's sorted runs unless told otherwise, and at least
+ * how much of it each run gets to be merged
+*/
+#define LOAD_MEM		(256U << 20)
+#define LOAD_RDBUF		BLOCK_SIZE
+
 //#define DEBUG_PIO 1
 #if DEBUG_PIO
 #undef MAP_LEVELS
@@ -54,27 +136,168 @@
 #define dprintf(x...) do {} while(0)
 #endif
 
+/* the log sequence numbers of the items in a level are within [first, end) */
+struct lsn_range {
+	uint64_t first;
+	uint64_t end;
+};
+
 struct _cola {
 	cola_key_t c_nelem;
 	uint8_t *c_map;
 	uint8_t *c_buf;
 	uint8_t *c_bufptr;
 	uint8_t *c_wrbuf;
+	uint8_t *c_labuf;
 	size_t c_mapsz;
 	unsigned int c_maplvls;
+	unsigned int c_mapmax; /* see cola_map_budget() */
+	size_t c_rss;
+	struct cache *c_cache; /* see cola_cache() */
+	int c_cachefd;
+	unsigned int c_packlvl; /* see cola_pack() */
+	unsigned int c_collvl; /* see cola_columns() */
 	unsigned int c_nxtlvl;
 	int c_fd;
 	int c_rw;
+	cola_key_t c_lalen[NUM_LEVELS];
+	struct bg_merge *c_bg;
+	struct _cola *c_shadow;
+	unsigned int c_bglvl;
+	unsigned int c_nthreads;
+	int c_nogc;
+	cola_merge_fn c_merge;
+	struct wal *c_wal;
+	uint64_t c_lsn; /* log sequence number of the next item to flush */
+	struct memtable *c_mem;
+	uint64_t c_memrec; /* items logged since c_lsn, all in c_mem */
+	int c_memoff; /* c_mem is being flushed, see mem_flush() */
+	struct cola_elem *c_replay; /* see replay() */
+	size_t c_nreplay;
+	struct lsn_range c_range[NUM_LEVELS];
+	cola_key_t c_short; /* see commit() */
+	unsigned int c_shortlvl;
+	unsigned int c_trim; /* level + 1 to give back to the filesystem */
+	struct cola_hdr c_commit;
+	struct cola_hdr c_seen[2]; /* both header slots as read, see stale() */
+	struct views *c_views; /* see cola_threadsafe() */
+	struct cola_stats *c_stats; /* see cola_stats_enable() */
+	const struct frozen *c_frozen; /* these two are for views only */
+	int c_isview;
+};
+
+/* the counters are only touched through here, NULL when they're off */
+#define stat_add(c, field, n) do { \
+		if ( unlikely((c)->c_stats) ) \
+			__atomic_fetch_add(&(c)->c_stats->field, (n), \
+						__ATOMIC_RELAXED); \
+	} while(0)
+
+static uint64_t stat_clock(struct _cola *c)
+{
+	struct timespec ts;
+
+	if ( likely(NULL == c->c_stats) )
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A carry in progress, as a view sees it: the run being merged, then the
+ * levels below outlvl in full. Once the merge is done but before it's spilled,
+ * instead the first kept entries of outlvl. Either way the cascade picks up
+ * from outlvl, whose lookahead array is untouched.
+*/
+struct frozen {
+	const struct cola_elem *run;
+	cola_key_t nrun;
+	cola_key_t kept;
+	unsigned int outlvl;
+	int spilling;
+};
+
+/* In thread-safe mode the readers search views: immutable copies of the
+ * handle which the writer publishes as it goes, each with everything needed
+ * to search the levels as they were at that point. Levels may be searched
+ * through an old view until epoch_sync() has been called after it's
+ * replaced, which is what settle() does before anything a reader might still
+ * see is overwritten, unmapped or freed.
+*/
+struct view {
+	struct _cola c;
+	struct frozen f;
+	struct view *next;
+};
+
+/* mappings which the views published up to pub still refer to */
+struct old_map {
+	uint8_t *map;
+	size_t sz;
+	uint64_t pub;
+	struct old_map *next;
+};
+
+struct views {
+	pthread_mutex_t wlock; /* writers */
+	pthread_rwlock_t memlock; /* c_mem and c_memoff */
+	struct epoch *epoch;
+	struct view *cur;
+	struct view *retired;
+	struct old_map *unmaps;
+	uint64_t npub;
+};
+
+/* A merge in to a level at or above c_bglvl runs in the background on a copy
+ * of the handle, with the count as it will be once the merge is done. The
+ * handle itself keeps the count from before, its input levels are frozen and
+ * still searchable, and new items go in to the shadow: an in-memory cola.
+ * Once the merge is done the lower levels are all empty so the shadow levels
+ * are copied straight in to them.
+*/
+struct bg_merge {
+	pthread_t thread;
+	struct _cola c;
+	struct cola_elem *run;
+	cola_key_t nrun;
+	cola_key_t lvlmask;
+	unsigned int outlvl;
+	int done;
+	int ret;
 };
 
 struct buf {
 	struct cola_elem *ptr;
 	cola_key_t nelem;
 	int heap;
+	struct cola_elem win[WIN_ELEM];
+};
+
+/* Reads the blocks of a packed level, see pack_load(). Index entries and
+ * packed bytes are read a chunk at a time in to the buffers given.
+*/
+struct pack_rd {
+	unsigned int lvlno;
+	struct cola_pidx *idx; /* entries [ifirst, ifirst + icnt) */
+	cola_key_t ifirst;
+	cola_key_t icnt;
+	cola_key_t imax;
+	uint8_t *raw; /* bytes [rpos, rpos + rlen) of the level */
+	cola_key_t rpos;
+	size_t rlen;
+	size_t rmax; /* not counting PACK_PAD */
+	int cached; /* through the block cache, see read_at() */
 };
 
+/* Streams over a region of the file: a level or a lookahead array. Either
+ * straight out of the map or through a buffer with pread/pwrite, which for
+ * packed levels is decoded a block at a time and for columns is filled from
+ * both of them.
+*/
 struct inbuf {
 	int mapped;
+	int packed;
+	int cols;
 	union {
 		struct {
 			struct cola_elem *buf;
@@ -83,8 +306,24 @@ struct inbuf {
 		struct {
 			struct cola_elem *buf;
 			struct cola_elem *cur;
+			struct cola_elem *lim;
 			struct cola_elem *end;
 			cola_key_t off;
+			cola_key_t nelem;
+			off_t ofs;
+			/* read-ahead in to nblk consecutive blocks */
+			struct ioring *ring;
+			struct ioreq req[INBUF_BLOCKS];
+			cola_key_t issued;
+			unsigned int nblk;
+			unsigned int head;
+			/* packed, entries from skip on in block blk are next */
+			struct pack_rd pk;
+			cola_key_t blk;
+			unsigned int skip;
+			/* columns from entry from of level lvlno */
+			cola_val_t *stage;
+			cola_key_t from;
 			unsigned int lvlno;
 		}buf;
 	}u;
@@ -97,653 +336,5215 @@ struct outbuf {
 			struct cola_elem *end;
 		}mapped;
 		struct {
+			struct cola_elem *buf;
 			struct cola_elem *cur;
 			struct cola_elem *end;
-			cola_key_t done;
-			unsigned int lvlno;
+			off_t ofs;
+			/* double buffered, one half fills while the other is
+			 * written out
+			*/
+			struct ioring *ring;
+			struct cola_elem *base;
+			struct ioreq req[2];
+			off_t wofs[2];
+			unsigned int half;
 		}buf;
+		struct {
+			unsigned int lvlno;
+			struct cola_elem *blk; /* the block being filled */
+			unsigned int nblk;
+			uint8_t *buf; /* packed blocks from level offset pos */
+			uint8_t *cur;
+			uint8_t *end;
+			cola_key_t pos;
+			struct cola_pidx *idx; /* index entries from iofs */
+			struct cola_pidx *icur;
+			struct cola_pidx *iend;
+			off_t iofs;
+		}packed;
+		struct {
+			unsigned int lvlno;
+			struct cola_elem *buf;
+			struct cola_elem *cur;
+			struct cola_elem *end;
+			cola_val_t *stage;
+			cola_key_t pos;
+		}cols;
 	}u;
 	int mapped;
+	int packed;
+	int cols;
+};
+
+/* One slice of a merge. Input 0 is the run and the rest are levels, input i
+ * contributes its entries [from[i], to[i]) and the output level's lookahead
+ * array [la_from, la_to). Slices of a parallel merge cover disjoint key
+ * ranges so each one writes its own part of the output.
+*/
+struct merge_part {
+	struct _cola *c;
+	const struct cola_elem *run;
+	unsigned int outlvl;
+	unsigned int k;
+	unsigned int lvl[NUM_LEVELS + 1];
+	cola_key_t from[NUM_LEVELS + 1];
+	cola_key_t to[NUM_LEVELS + 1];
+	cola_key_t la_from;
+	cola_key_t la_to;
+	uint8_t *rdbuf;
+	uint8_t *wrbuf;
+	uint8_t *labuf;
+	uint8_t *bloom;
+	size_t wrelem;
+	size_t laelem;
+	int bloom_atomic;
+	int dedup;
+	int gc;
+	cola_key_t kept;
+	pthread_t thread;
+	int ret;
+};
+
+/* lookahead array generator, see la_push() */
+struct la_gen {
+	struct outbuf out;
+	cola_key_t pos;
+	cola_key_t real;
 };
 
+/* offset of level lvlno, it sits after all of the lower levels each of which
+ * reserves (2^i / 4 + 1) entries for its lookahead array followed by
+ * bloom_size(i) bytes for its bloom filter
+*/
 static cola_key_t level_ofs(unsigned int lvlno)
 {
 	cola_key_t ofs;
 
-	ofs = (1U << lvlno) - 1;
+	ofs = (1ULL << lvlno) - 1;
+	ofs += lvlno;
+	if ( lvlno >= 2 )
+		ofs += (1ULL << (lvlno - 2)) - 1;
 	ofs *= sizeof(struct cola_elem);
-	ofs += sizeof(struct cola_hdr);
+	ofs += COLA_HDR_SIZE;
+
+	if ( lvlno > BLOOM_MIN_LEVEL ) {
+		ofs += BLOOM_BLOCK * BLOOM_MIN_LEVEL;
+		ofs += (1ULL << lvlno) - (1ULL << BLOOM_MIN_LEVEL);
+	}else{
+		ofs += BLOOM_BLOCK * lvlno;
+	}
 
 	return ofs;
 }
 
-static void outbuf_init(struct _cola *c, struct outbuf *out, unsigned int lvlno)
+static cola_key_t la_ofs(unsigned int lvlno)
 {
-	if ( lvlno < c->c_maplvls ) {
-		//printf("out lvl %u/%u mapped\n", lvlno, c->c_maplvls);
-		out->u.buf.lvlno = lvlno; /* what the fuck? */
-		out->u.mapped.ptr = (struct cola_elem *)(c->c_map +
-							level_ofs(lvlno));
-		out->u.mapped.end = out->u.mapped.ptr + (1U << lvlno);
-		out->mapped = 1;
-	}else{
-		size_t cnt;
+	return level_ofs(lvlno) + (1ULL << lvlno) * sizeof(struct cola_elem);
+}
 
-		if ( (1U << lvlno) < WRBUF_ELEM )
-			cnt = (1U << lvlno);
-		else
-			cnt = WRBUF_ELEM;
+static cola_key_t bloom_ofs(unsigned int lvlno)
+{
+	cola_key_t nla = 1;
 
-		//printf("out lvl %u/%u buffered\n", lvlno, c->c_maplvls);
-		out->u.buf.cur = (struct cola_elem *)c->c_wrbuf;
-		out->u.buf.end = out->u.buf.cur + cnt;
-		out->u.buf.lvlno = lvlno;
-		out->u.buf.done = 0;
-		out->mapped = 0;
-	}
+	if ( lvlno >= 2 )
+		nla += 1ULL << (lvlno - 2);
+	return la_ofs(lvlno) + nla * sizeof(struct cola_la);
 }
 
-static int outbuf_push(struct outbuf *out, struct _cola *c, struct cola_elem *e)
+static cola_key_t bloom_size(unsigned int lvlno)
 {
-	if ( out->mapped ) {
-		assert(out->u.mapped.ptr < out->u.mapped.end);
-		out->u.mapped.ptr[0] = *e;
-		out->u.mapped.ptr++;
-		return 1;
-	}else{
-		off_t off;
-		size_t sz;
+	if ( lvlno < BLOOM_MIN_LEVEL )
+		return BLOOM_BLOCK;
+	return 1ULL << lvlno;
+}
 
-		assert(out->u.buf.cur < out->u.buf.end);
-		out->u.buf.cur[0] = *e;
-		out->u.buf.cur++;
+/* 64bit finaliser from murmurhash3 */
+static uint64_t bloom_hash(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
 
-		if ( out->u.buf.cur < out->u.buf.end )
-			return 1;
+/* the first hash picks the block, the second the bits within it */
+static cola_key_t bloom_block(unsigned int lvlno, uint64_t h)
+{
+	cola_key_t nblk = bloom_size(lvlno) / BLOOM_BLOCK;
+	return (h & (nblk - 1)) * BLOOM_BLOCK;
+}
 
-		sz = (uint8_t *)out->u.buf.end - c->c_wrbuf;
-		off = level_ofs(out->u.buf.lvlno);
-		off += WRBUF_ELEM * sizeof(struct cola_elem) * out->u.buf.done;
-		if ( !fd_pwrite(c->c_fd, off, c->c_wrbuf, sz) )
-			return 0;
+/* bits may be set by several merge threads at once if atomic is set */
+static void bloom_add(uint8_t *f, unsigned int lvlno, cola_key_t key,
+			int atomic)
+{
+	uint64_t h = bloom_hash(key);
+	uint64_t *blk = (uint64_t *)(f + bloom_block(lvlno, h));
+	unsigned int i;
 
-		out->u.buf.cur = (struct cola_elem *)c->c_wrbuf;
-		out->u.buf.done++;
-		return 1;
+	for(h = bloom_hash(h), i = 0; i < BLOOM_PROBES; i++, h >>= BLOOM_BITS) {
+		unsigned int bit = h & ((1U << BLOOM_BITS) - 1);
+
+		if ( atomic ) {
+			__atomic_fetch_or(&blk[bit / 64], 1ULL << (bit % 64),
+					__ATOMIC_RELAXED);
+		}else{
+			blk[bit / 64] |= 1ULL << (bit % 64);
+		}
 	}
 }
 
-static void init_bufs(struct _cola *c)
+static int level_live(struct _cola *c, unsigned int lvlno)
 {
-	c->c_bufptr = c->c_buf;
+	return !!(c->c_nelem & (1ULL << lvlno));
 }
 
-static void inbuf_one_item(struct _cola *c, struct inbuf *in,
-				struct cola_elem *one)
+static cola_key_t level_nelem(struct _cola *c, unsigned int lvlno)
 {
-	in->mapped = 1;
-	in->u.mapped.buf = one;
-	in->u.mapped.end = one + 1;
+	return (level_live(c, lvlno)) ? (1ULL << lvlno) : 0;
 }
 
-static int inbuf_refill(struct _cola *c, struct inbuf *in)
+/* the entries in a level, which to a reader may be the short output of a
+ * merge that the writer has yet to spill, see commit()
+*/
+static cola_key_t level_len(struct _cola *c, unsigned int lvlno)
 {
-	size_t buf_sz, ret_sz;
-	off_t off;
+	const struct cola_hdr *h = &c->c_commit;
 
-	assert(in->u.buf.cur == in->u.buf.buf);
-	if(in->u.buf.off >= (1U << in->u.buf.lvlno))
-		return 0;
+	if ( !c->c_rw && h->h_short && h->h_shortlvl == lvlno )
+		return h->h_short;
+	return 1ULL << lvlno;
+}
 
-	buf_sz = in->u.buf.end - in->u.buf.cur;
-	buf_sz *= sizeof(struct cola_elem);
-	ret_sz = buf_sz;
+/* The lookahead array of each level is a function of all of the levels above
+ * it so lengths can always be worked out from the count.
+*/
+static void calc_lalen(struct _cola *c)
+{
+	cola_key_t len = 0;
+	unsigned int i;
 
-	off = level_ofs(in->u.buf.lvlno);
-	off += in->u.buf.off * sizeof(struct cola_elem);
+	for(i = NUM_LEVELS; i--; ) {
+		c->c_lalen[i] = len;
+		len = (len + level_nelem(c, i) + LA_STRIDE - 1) >> LA_SHIFT;
+	}
+}
 
-	//printf("fd_pread level %u, off %"PRIu64"\n",
-	//		in->u.buf.lvlno, in->u.buf.off);
-	if ( !fd_pread(c->c_fd, off, in->u.buf.buf, &ret_sz, NULL) )
-		return 0;
-	if ( ret_sz != buf_sz )
-		return 0;
+static int level_packed(struct _cola *c, unsigned int lvlno)
+{
+	return c->c_packlvl && lvlno >= c->c_packlvl;
+}
 
-	in->u.buf.off += in->u.buf.end - in->u.buf.cur;
-	return 1;
+static int level_cols(struct _cola *c, unsigned int lvlno)
+{
+	return c->c_collvl && lvlno >= c->c_collvl && !level_packed(c, lvlno);
 }
 
-static void inbuf_init(struct _cola *c, struct inbuf *in, unsigned int lvlno)
+/* whether a level's entries are in the map as they are, packed ones and
+ * columns never are
+*/
+static int level_mapped(struct _cola *c, unsigned int lvlno)
 {
-	if ( lvlno < c->c_maplvls ) {
-		//printf("in merge map %u/%u\n", lvlno, c->c_maplvls);
-		in->mapped = 1;
-		in->u.mapped.buf = (struct cola_elem *)(c->c_map +
-							level_ofs(lvlno));
-		in->u.mapped.end = in->u.mapped.buf + (1U << lvlno);
-	}else{
-		cola_key_t nelem;
+	return lvlno < c->c_maplvls && !level_packed(c, lvlno) &&
+		!level_cols(c, lvlno);
+}
 
-		if ( 1U << lvlno < (BLOCK_SIZE / sizeof(struct cola_elem)) ) {
-			nelem = 1U << lvlno;
-		}else{
-			nelem = BLOCK_SIZE / sizeof(struct cola_elem);
-		}
+/* the key and the value of entry pos of a level split in to columns */
+static cola_key_t key_ofs(unsigned int lvlno, cola_key_t pos)
+{
+	return level_ofs(lvlno) + pos * sizeof(cola_key_t);
+}
 
-		//printf("in merge buf %u/%u %"PRIu64" items\n",
-		//	lvlno, c->c_maplvls, nelem);
+static cola_key_t val_ofs(unsigned int lvlno, cola_key_t pos)
+{
+	return level_ofs(lvlno) + ((1ULL << lvlno) + pos) * sizeof(cola_key_t);
+}
 
-		in->mapped = 0;
-		in->u.buf.buf = (struct cola_elem *)(c->c_bufptr);
-		in->u.buf.cur = in->u.mapped.buf;
-		in->u.buf.end = in->u.mapped.buf + nelem;
-		in->u.buf.off = 0;
-		in->u.buf.lvlno = lvlno;
+/* Entry blk of a packed level's block index. It's at the end of the space
+ * reserved for the lookahead array, which never gets beyond a seventh or so
+ * of the level against the quarter reserved, see calc_lalen().
+*/
+static cola_key_t pidx_ofs(unsigned int lvlno, cola_key_t blk)
+{
+	cola_key_t nidx = (1ULL << (lvlno - PACK_SHIFT)) + 1;
 
-		c->c_bufptr += (nelem * sizeof(struct cola_elem));
-	}
+	return bloom_ofs(lvlno) - (nidx - blk) * sizeof(struct cola_pidx);
 }
 
-static int inbuf_pop(struct _cola *c, struct inbuf *in, cola_key_t *ret)
+static unsigned int bit_width(uint64_t v)
 {
-	if ( in->mapped ) {
-		if ( in->u.mapped.buf >= in->u.mapped.end )
-			return 0;
-		*ret = in->u.mapped.buf[0].key;
-		in->u.mapped.buf++;
-	}else{
-		if ( in->u.buf.cur == in->u.buf.buf && !inbuf_refill(c, in) )
-			return 0;
-		*ret = in->u.buf.cur[0].key;
-		in->u.buf.cur++;
-		if ( in->u.buf.cur >= in->u.buf.end )
-			in->u.buf.cur = in->u.buf.buf;
-	}
-	return 1;
+	return (v) ? log2_floor64(v) + 1 : 0;
 }
 
-static unsigned int cfls(cola_key_t k)
+/* p must be zeroed, with a word to spare past the last bit */
+static void put_bits(uint8_t *p, uint64_t bit, unsigned int w, uint64_t v)
 {
-	unsigned int i, ret;
-	for(i = ret = 0; i < sizeof(k)*8; i++) {
-		cola_key_t tmp;
+	unsigned int sh = bit & 7;
+	uint64_t word;
 
-		tmp = 1U << i;
-		if ( tmp > k )
-			break;
+	if ( !w )
+		return;
 
-		if ( k & tmp )
-			ret = i;
-	}
-	return ret;
+	p += bit >> 3;
+	memcpy(&word, p, sizeof(word));
+	word |= v << sh;
+	memcpy(p, &word, sizeof(word));
+	if ( sh + w > 64 )
+		p[8] |= v >> (64 - sh);
 }
 
-/* do everything possible to try to get hugepages here */
-static int alloc_buffers(struct _cola *c)
+static uint64_t get_bits(const uint8_t *p, uint64_t bit, unsigned int w)
 {
-	int flags;
-	uint8_t *map;
-	int retries = 0;
+	unsigned int sh = bit & 7;
+	uint64_t word;
 
-	if ( c->c_buf )
-		return 1;
+	if ( !w )
+		return 0;
 
-again:
-	flags = MAP_PRIVATE | MAP_ANONYMOUS;
-#ifdef MAP_HUGETLB
-	if ( !retries )
-		flags |= MAP_HUGETLB;
-#endif
+	p += bit >> 3;
+	memcpy(&word, p, sizeof(word));
+	word >>= sh;
+	if ( sh + w > 64 )
+		word |= (uint64_t)p[8] << (64 - sh);
+	return (w < 64) ? word & ((1ULL << w) - 1) : word;
+}
 
-	map = mmap(NULL, TOTAL_BUFFER_SIZE, PROT_READ|PROT_WRITE, flags, -1, 0);
-	if ( MAP_FAILED == map ) {
-		if ( retries < 1 ) {
-			retries++;
-			goto again;
-		}
-		return 0;
+/* Pack n sorted entries in to p, which has room for them as they are plus
+ * PACK_PAD. They're left as they are if that's no bigger, *raw says which.
+*/
+static size_t pack_block(const struct cola_elem *e, unsigned int n,
+				uint8_t *p, int *raw)
+{
+	cola_val_t vmin = e[0].val, vmax = e[0].val;
+	uint64_t dmax = 0, bit;
+	struct cola_pblk b;
+	unsigned int i;
+	size_t len;
+
+	for(i = 1; i < n; i++) {
+		if ( e[i].key - e[i - 1].key > dmax )
+			dmax = e[i].key - e[i - 1].key;
+		if ( e[i].val < vmin )
+			vmin = e[i].val;
+		if ( e[i].val > vmax )
+			vmax = e[i].val;
 	}
 
-#ifdef MADV_HUGEPAGE
-	madvise(map, TOTAL_BUFFER_SIZE, MADV_HUGEPAGE);
-#endif
+	b.b_nelem = n;
+	b.b_kbits = bit_width(dmax);
+	b.b_vbits = bit_width(vmax - vmin);
+	b.b_vbase = vmin;
+	len = sizeof(b) + ((n - 1) * b.b_kbits + n * b.b_vbits + 7) / 8;
+	if ( len >= n * sizeof(*e) ) {
+		memcpy(p, e, n * sizeof(*e));
+		*raw = 1;
+		return n * sizeof(*e);
+	}
 
-	c->c_buf = map;
-	c->c_wrbuf = map + WRBUF_SIZE;
-	return 1;
+	memcpy(p, &b, sizeof(b));
+	p += sizeof(b);
+	memset(p, 0, len - sizeof(b) + PACK_PAD);
+	for(i = 1, bit = 0; i < n; i++, bit += b.b_kbits)
+		put_bits(p, bit, b.b_kbits, e[i].key - e[i - 1].key);
+	for(i = 0; i < n; i++, bit += b.b_vbits)
+		put_bits(p, bit, b.b_vbits, e[i].val - vmin);
+
+	*raw = 0;
+	return len;
 }
 
-static int remap(struct _cola *c, unsigned int num_levels)
+static int unpack_block(cola_key_t key, const uint8_t *p, size_t len,
+				struct cola_elem *e, unsigned int *n)
 {
-	size_t sz;
-	uint8_t *map;
-
-	dprintf(" - remap %u levels\n", num_levels);
-
-	sz = (1U << (num_levels)) - 1;
-	sz *= sizeof(struct cola_elem);
-	sz += sizeof(struct cola_hdr);
+	struct cola_pblk b;
+	unsigned int i;
+	uint64_t bit;
 
-	if ( c->c_map ) {
-		map = mremap(c->c_map, c->c_mapsz, sz, MREMAP_MAYMOVE);
-	}else{
-		int f = (c->c_rw) ? (PROT_READ|PROT_WRITE) : (PROT_READ);
-		map = mmap(NULL, sz, f, MAP_SHARED, c->c_fd, 0);
-	}
-	if ( map == MAP_FAILED ) {
-		fprintf(stderr, "%s: mremap: %s\n", cmd, os_err());
+	if ( len < sizeof(b) )
+		return 0;
+	memcpy(&b, p, sizeof(b));
+	if ( !b.b_nelem || b.b_nelem > COLA_PACK_ELEM ||
+			b.b_kbits > 64 || b.b_vbits > 64 ||
+			len < sizeof(b) + ((b.b_nelem - 1) * b.b_kbits +
+				b.b_nelem * b.b_vbits + 7) / 8 )
 		return 0;
-	}
 
-	madvise(map, c->c_mapsz, MADV_RANDOM);
-	c->c_maplvls = num_levels;
-	c->c_mapsz = sz;
-	c->c_map = map;
+	p += sizeof(b);
+	e[0].key = key;
+	for(i = 1, bit = 0; i < b.b_nelem; i++, bit += b.b_kbits)
+		e[i].key = e[i - 1].key + get_bits(p, bit, b.b_kbits);
+	for(i = 0; i < b.b_nelem; i++, bit += b.b_vbits)
+		e[i].val = b.b_vbase + get_bits(p, bit, b.b_vbits);
+
+	*n = b.b_nelem;
 	return 1;
 }
 
-static int map(struct _cola *c)
+static void pack_rd_init(struct pack_rd *r, unsigned int lvlno,
+				struct cola_pidx *idx, cola_key_t imax,
+				uint8_t *raw, size_t rmax, int cached)
 {
-	int f;
-	size_t sz;
-	uint8_t *map;
-
-	if ( !INITIAL_LEVELS )
-		return 1;
+	r->lvlno = lvlno;
+	r->cached = cached;
+	r->idx = idx;
+	r->ifirst = 0;
+	r->icnt = 0;
+	r->imax = imax;
+	r->raw = raw;
+	r->rpos = 0;
+	r->rlen = 0;
+	r->rmax = rmax;
+}
 
-	dprintf("mapping in %u levels\n", INITIAL_LEVELS);
-	f = (c->c_rw) ? (PROT_READ|PROT_WRITE) : (PROT_READ);
-	sz = (1U << (INITIAL_LEVELS + 1)) - 1;
-	sz *= sizeof(struct cola_elem);
-	sz += sizeof(struct cola_hdr);
+static int pread_full(struct _cola *c, off_t ofs, void *buf, size_t len)
+{
+	size_t sz = len;
+	int eof;
 
-	map = mmap(NULL, sz, f, MAP_SHARED, c->c_fd, 0);
-	if ( map == MAP_FAILED ) {
-		fprintf(stderr, "%s: mmap: %s\n", cmd, os_err());
+	if ( !fd_pread(c->c_fd, ofs, buf, &sz, &eof) || sz != len ) {
+		fprintf(stderr, "%s: read: %s\n",
+			cmd, os_err2("File truncated"));
 		return 0;
 	}
 
-	madvise(map, sz, MADV_RANDOM);
-
-	c->c_maplvls = INITIAL_LEVELS;
-	c->c_mapsz = sz;
-	c->c_map = map;
 	return 1;
 }
 
-static struct _cola *do_open(const char *fn, int rw, int create, int overwrite)
+/* Lookups' small reads of levels which aren't mapped go through the block
+ * cache if there is one, see cola_cache(), anything else doesn't.
+*/
+static int read_at(struct _cola *c, int cached, off_t ofs, void *buf,
+			size_t len)
 {
-	struct _cola *c = NULL;
-	struct cola_hdr hdr;
-	size_t sz;
-	int eof, oflags;
-
-	c = calloc(1, sizeof(*c));
-	if ( NULL == c )
-		goto out;
+	if ( !cached || NULL == c->c_cache )
+		return pread_full(c, ofs, buf, len);
 
-	if ( create ) {
-		oflags = O_RDWR | O_CREAT | ((overwrite) ? O_TRUNC : O_EXCL);
-	}else{
-		oflags = (rw) ? O_RDWR : O_RDONLY;
+	if ( !cache_read(c->c_cache, ofs, buf, len) ) {
+		fprintf(stderr, "%s: read: %s\n",
+			cmd, os_err2("File truncated"));
+		return 0;
 	}
 
-	c->c_fd = open(fn, oflags, 0644);
-	if ( c->c_fd < 0 ) {
-		fprintf(stderr, "%s: open: %s: %s\n", cmd, fn, os_err());
-		goto out_free;
-	}
+	return 1;
+}
 
-	if ( create ) {
-		off_t initial;
+/* once a write is done, so that no read which began before it is cached */
+static void cache_drop(struct _cola *c, cola_key_t ofs, cola_key_t len)
+{
+	if ( c->c_cache )
+		cache_invalidate(c->c_cache, ofs, len);
+}
 
-		hdr.h_nelem = 0;
-		hdr.h_magic = COLA_MAGIC;
-		hdr.h_vers = COLA_CURRENT_VER;
-		if ( !fd_write(c->c_fd, &hdr, sizeof(hdr)) ) {
-			fprintf(stderr, "%s: write: %s: %s\n",
+static int write_at(struct _cola *c, off_t ofs, const void *buf, size_t len)
+{
+	int ret;
+
+	ret = fd_pwrite(c->c_fd, ofs, buf, len);
+	cache_drop(c, ofs, len);
+	return ret;
+}
+
+/* Decode block blk of a packed level in to e, *n gets the number of entries.
+ * Index entries and packed bytes are read as far ahead as the buffers go.
+*/
+static int pack_load(struct _cola *c, struct pack_rd *r, cola_key_t blk,
+			struct cola_elem *e, unsigned int *n)
+{
+	cola_key_t nidx = (1ULL << (r->lvlno - PACK_SHIFT)) + 1;
+	cola_key_t lvlsz = (1ULL << r->lvlno) * sizeof(*e);
+	const struct cola_pidx *x;
+	cola_key_t pos, end;
+	const uint8_t *p;
+
+	if ( blk + 1 >= nidx )
+		goto bad;
+
+	if ( blk < r->ifirst || blk + 2 > r->ifirst + r->icnt ) {
+		cola_key_t cnt = nidx - blk;
+
+		if ( cnt > r->imax )
+			cnt = r->imax;
+		if ( !read_at(c, r->cached, pidx_ofs(r->lvlno, blk), r->idx,
+					cnt * sizeof(*r->idx)) )
+			return 0;
+		r->ifirst = blk;
+		r->icnt = cnt;
+	}
+
+	x = r->idx + (blk - r->ifirst);
+	pos = x[0].p_pos & ~COLA_PACK_RAW;
+	end = x[1].p_pos & ~COLA_PACK_RAW;
+	if ( end <= pos || end - pos > PACK_BLOCK || end > lvlsz )
+		goto bad;
+
+	if ( pos < r->rpos || end > r->rpos + r->rlen ) {
+		cola_key_t sz = lvlsz - pos;
+
+		if ( sz > r->rmax )
+			sz = r->rmax;
+		if ( !read_at(c, r->cached, level_ofs(r->lvlno) + pos,
+					r->raw, sz) )
+			return 0;
+		r->rpos = pos;
+		r->rlen = sz;
+	}
+
+	p = r->raw + (pos - r->rpos);
+	if ( x[0].p_pos & COLA_PACK_RAW ) {
+		if ( (end - pos) % sizeof(*e) )
+			goto bad;
+		memcpy(e, p, end - pos);
+		*n = (end - pos) / sizeof(*e);
+		return 1;
+	}
+
+	if ( unpack_block(x[0].p_key, p, end - pos, e, n) )
+		return 1;
+bad:
+	fprintf(stderr, "%s: level %u: bad packed block\n", cmd, r->lvlno);
+	return 0;
+}
+
+/* Packed levels go out a block at a time with the index alongside, a
+ * sixteenth of the buffer, see pack_finish().
+*/
+static void outbuf_packed(struct _cola *c, struct outbuf *out,
+				unsigned int lvlno, uint8_t *buf, size_t bufsz)
+{
+	size_t sz = bufsz * sizeof(struct cola_elem);
+	size_t isz = sz / 16;
+
+	assert(sz >= 4 * PACK_BLOCK);
+	out->u.packed.lvlno = lvlno;
+	out->u.packed.blk = (struct cola_elem *)buf;
+	out->u.packed.nblk = 0;
+	out->u.packed.idx = (struct cola_pidx *)(buf + PACK_BLOCK);
+	out->u.packed.icur = out->u.packed.idx;
+	out->u.packed.iend = out->u.packed.idx +
+				isz / sizeof(struct cola_pidx);
+	out->u.packed.iofs = pidx_ofs(lvlno, 0);
+	out->u.packed.buf = buf + PACK_BLOCK + isz;
+	out->u.packed.cur = out->u.packed.buf;
+	out->u.packed.end = buf + sz - PACK_PAD;
+	out->u.packed.pos = 0;
+	out->mapped = 0;
+	out->packed = 1;
+	out->cols = 0;
+}
+
+static int pack_flush(struct outbuf *out, struct _cola *c)
+{
+	size_t sz = out->u.packed.cur - out->u.packed.buf;
+	size_t isz = (uint8_t *)out->u.packed.icur -
+			(uint8_t *)out->u.packed.idx;
+
+	if ( sz && !write_at(c, level_ofs(out->u.packed.lvlno) +
+				out->u.packed.pos, out->u.packed.buf, sz) )
+		return 0;
+	out->u.packed.pos += sz;
+	out->u.packed.cur = out->u.packed.buf;
+
+	if ( isz && !write_at(c, out->u.packed.iofs,
+				out->u.packed.idx, isz) )
+		return 0;
+	out->u.packed.iofs += isz;
+	out->u.packed.icur = out->u.packed.idx;
+	return 1;
+}
+
+/* add an index entry for the packed bytes written so far */
+static int pack_idx_push(struct outbuf *out, struct _cola *c,
+				cola_key_t key, uint64_t flags)
+{
+	struct cola_pidx *x;
+
+	if ( out->u.packed.icur == out->u.packed.iend &&
+			!pack_flush(out, c) )
+		return 0;
+
+	x = out->u.packed.icur++;
+	x->p_key = key;
+	x->p_pos = (out->u.packed.pos +
+			(out->u.packed.cur - out->u.packed.buf)) | flags;
+	return 1;
+}
+
+static int pack_emit(struct outbuf *out, struct _cola *c)
+{
+	const struct cola_elem *e = out->u.packed.blk;
+	size_t len;
+	int raw;
+
+	/* so that the index entry doesn't flush the block away */
+	if ( (out->u.packed.cur + PACK_BLOCK > out->u.packed.end ||
+			out->u.packed.icur == out->u.packed.iend) &&
+			!pack_flush(out, c) )
+		return 0;
+
+	len = pack_block(e, out->u.packed.nblk, out->u.packed.cur, &raw);
+	if ( !pack_idx_push(out, c, e->key, (raw) ? COLA_PACK_RAW : 0) )
+		return 0;
+
+	out->u.packed.cur += len;
+	out->u.packed.nblk = 0;
+	return 1;
+}
+
+/* Write out the last block and the entry which ends the index, then give
+ * the space that the level didn't need back to the filesystem.
+*/
+static int pack_finish(struct outbuf *out, struct _cola *c)
+{
+	unsigned int lvlno = out->u.packed.lvlno;
+	cola_key_t end;
+
+	if ( out->u.packed.nblk && !pack_emit(out, c) )
+		return 0;
+	if ( !pack_idx_push(out, c, 0, 0) || !pack_flush(out, c) )
+		return 0;
+
+	end = level_ofs(lvlno) + out->u.packed.pos;
+	if ( fallocate(c->c_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			end, la_ofs(lvlno) - end) ) {
+		dprintf(" - punch hole: %s\n", os_err());
+	}
+
+	return 1;
+}
+
+/* Entries [from, from + n) of a level split in to columns. Unless they're
+ * mapped the keys are read in to the top half of e and spread out in place,
+ * and the values are read in to stage, which has room for n.
+*/
+static int cols_load(struct _cola *c, unsigned int lvlno, cola_key_t from,
+			cola_key_t n, struct cola_elem *e, cola_val_t *stage,
+			int cached)
+{
+	const cola_val_t *v;
+	const uint8_t *k;
+	cola_key_t i;
+
+	if ( lvlno < c->c_maplvls ) {
+		k = c->c_map + key_ofs(lvlno, from);
+		v = (const cola_val_t *)(c->c_map + val_ofs(lvlno, from));
+	}else{
+		uint8_t *top = (uint8_t *)e + n * sizeof(cola_key_t);
+
+		if ( !read_at(c, cached, key_ofs(lvlno, from), top,
+					n * sizeof(cola_key_t)) ||
+				!read_at(c, cached, val_ofs(lvlno, from), stage,
+					n * sizeof(*stage)) )
+			return 0;
+		k = top;
+		v = stage;
+	}
+
+	/* Each entry only overwrites keys which have been moved already. The
+	 * entries may not be aligned, nor then the keys read in behind them.
+	*/
+	for(i = 0; i < n; i++) {
+		cola_key_t key;
+
+		memcpy(&key, k + i * sizeof(key), sizeof(key));
+		e[i].key = key;
+		e[i].val = v[i];
+	}
+
+	return 1;
+}
+
+/* two thirds of the buffer for entries and the rest for their values */
+static void outbuf_cols(struct _cola *c, struct outbuf *out,
+				unsigned int lvlno, cola_key_t opos,
+				uint8_t *buf, size_t bufsz)
+{
+	size_t cnt = bufsz * 2 / 3;
+
+	out->u.cols.lvlno = lvlno;
+	out->u.cols.buf = (struct cola_elem *)buf;
+	out->u.cols.cur = out->u.cols.buf;
+	out->u.cols.end = out->u.cols.buf + cnt;
+	out->u.cols.stage = (cola_val_t *)(out->u.cols.end);
+	out->u.cols.pos = opos;
+	out->mapped = 0;
+	out->packed = 0;
+	out->cols = 1;
+}
+
+/* gather the keys in place, and the values in to the stage, and write both */
+static int cols_flush(struct outbuf *out, struct _cola *c)
+{
+	struct cola_elem *e = out->u.cols.buf;
+	cola_key_t n = out->u.cols.cur - e, i;
+	unsigned int lvlno = out->u.cols.lvlno;
+	cola_key_t pos = out->u.cols.pos;
+	cola_val_t *v = out->u.cols.stage;
+	uint8_t *buf = (uint8_t *)e;
+	cola_key_t *k = (cola_key_t *)buf;
+
+	if ( !n )
+		return 1;
+
+	for(i = 0; i < n; i++) {
+		v[i] = e[i].val;
+		k[i] = e[i].key;
+	}
+
+	if ( lvlno < c->c_maplvls ) {
+		memcpy(c->c_map + key_ofs(lvlno, pos), k, n * sizeof(*k));
+		memcpy(c->c_map + val_ofs(lvlno, pos), v, n * sizeof(*v));
+	}else if ( !write_at(c, key_ofs(lvlno, pos), k, n * sizeof(*k)) ||
+			!write_at(c, val_ofs(lvlno, pos), v,
+					n * sizeof(*v)) ) {
+		return 0;
+	}
+
+	out->u.cols.pos += n;
+	out->u.cols.cur = out->u.cols.buf;
+	return 1;
+}
+
+static void outbuf_region(struct _cola *c, struct outbuf *out, int mapped,
+				cola_key_t ofs, cola_key_t nelem,
+				uint8_t *buf, size_t bufsz)
+{
+	if ( mapped ) {
+		out->u.mapped.ptr = (struct cola_elem *)(c->c_map + ofs);
+		out->u.mapped.end = out->u.mapped.ptr + nelem;
+		out->mapped = 1;
+		out->packed = 0;
+		out->cols = 0;
+	}else{
+		size_t cnt;
+
+		if ( nelem < bufsz )
+			cnt = nelem;
+		else
+			cnt = bufsz;
+
+		out->u.buf.buf = (struct cola_elem *)buf;
+		out->u.buf.cur = out->u.buf.buf;
+		out->u.buf.end = out->u.buf.cur + cnt;
+		out->u.buf.ofs = ofs;
+		out->u.buf.ring = NULL;
+		out->mapped = 0;
+		out->packed = 0;
+		out->cols = 0;
+	}
+}
+
+/* a level from entry opos on, which has to be the start if it's packed */
+static void outbuf_level(struct _cola *c, struct outbuf *out,
+				unsigned int lvlno, cola_key_t opos,
+				cola_key_t nelem, uint8_t *buf, size_t bufsz)
+{
+	if ( level_packed(c, lvlno) ) {
+		assert(!opos);
+		outbuf_packed(c, out, lvlno, buf, bufsz);
+		return;
+	}
+	if ( level_cols(c, lvlno) ) {
+		outbuf_cols(c, out, lvlno, opos, buf, bufsz);
+		return;
+	}
+
+	outbuf_region(c, out, lvlno < c->c_maplvls,
+			level_ofs(lvlno) + opos * sizeof(struct cola_elem),
+			nelem, buf, bufsz);
+}
+
+/* write through a ring, splitting the buffer in two */
+static void outbuf_ring(struct outbuf *out, struct ioring *ring)
+{
+	cola_key_t cnt;
+
+	if ( out->mapped || out->packed || out->cols || NULL == ring )
+		return;
+
+	cnt = (out->u.buf.end - out->u.buf.buf) / 2;
+	if ( !cnt )
+		return;
+
+	out->u.buf.ring = ring;
+	out->u.buf.base = out->u.buf.buf;
+	out->u.buf.end = out->u.buf.buf + cnt;
+	out->u.buf.half = 0;
+	memset(out->u.buf.req, 0, sizeof(out->u.buf.req));
+}
+
+/* wait for the last write from one half, finishing it off if it was short */
+static int outbuf_wait(struct outbuf *out, struct _cola *c, unsigned int half)
+{
+	struct ioreq *req = &out->u.buf.req[half];
+	const uint8_t *ptr;
+
+	if ( !ioring_wait(out->u.buf.ring, req) )
+		return 0;
+
+	if ( req->res < 0 ) {
+		errno = -req->res;
+		return 0;
+	}
+
+	cache_drop(c, out->u.buf.wofs[half], req->res);
+	if ( (size_t)req->res == req->len )
+		return 1;
+
+	ptr = (uint8_t *)(out->u.buf.base +
+			half * (out->u.buf.end - out->u.buf.buf));
+	return write_at(c, out->u.buf.wofs[half] + req->res,
+			ptr + req->res, req->len - req->res);
+}
+
+static int outbuf_flush(struct outbuf *out, struct _cola *c)
+{
+	unsigned int half;
+	cola_key_t cnt;
+	size_t sz;
+
+	if ( out->packed )
+		return pack_flush(out, c);
+	if ( out->cols )
+		return cols_flush(out, c);
+	if ( out->mapped || out->u.buf.cur == out->u.buf.buf )
+		return 1;
+
+	sz = (uint8_t *)out->u.buf.cur - (uint8_t *)out->u.buf.buf;
+	if ( NULL == out->u.buf.ring ) {
+		if ( !write_at(c, out->u.buf.ofs, out->u.buf.buf, sz) )
+			return 0;
+
+		out->u.buf.ofs += sz;
+		out->u.buf.cur = out->u.buf.buf;
+		return 1;
+	}
+
+	half = out->u.buf.half;
+	out->u.buf.wofs[half] = out->u.buf.ofs;
+	if ( !ioring_pwrite(out->u.buf.ring, c->c_fd, out->u.buf.ofs,
+				out->u.buf.buf, sz, &out->u.buf.req[half]) )
+		return 0;
+	out->u.buf.ofs += sz;
+
+	/* carry on in the other half once its last write is done */
+	half ^= 1;
+	if ( !outbuf_wait(out, c, half) )
+		return 0;
+
+	cnt = out->u.buf.end - out->u.buf.buf;
+	out->u.buf.half = half;
+	out->u.buf.buf = out->u.buf.base + half * cnt;
+	out->u.buf.cur = out->u.buf.buf;
+	out->u.buf.end = out->u.buf.buf + cnt;
+	return 1;
+}
+
+/* flush and wait for any writes in flight */
+static int outbuf_finish(struct outbuf *out, struct _cola *c)
+{
+	if ( out->packed )
+		return pack_finish(out, c);
+	if ( out->cols )
+		return cols_flush(out, c);
+	if ( !outbuf_flush(out, c) )
+		return 0;
+
+	if ( out->mapped || NULL == out->u.buf.ring )
+		return 1;
+
+	return outbuf_wait(out, c, 0) && outbuf_wait(out, c, 1);
+}
+
+static int outbuf_push(struct outbuf *out, struct _cola *c,
+			const struct cola_elem *e)
+{
+	if ( out->mapped ) {
+		assert(out->u.mapped.ptr < out->u.mapped.end);
+		out->u.mapped.ptr[0] = *e;
+		out->u.mapped.ptr++;
+		return 1;
+	}else if ( out->packed ) {
+		out->u.packed.blk[out->u.packed.nblk++] = *e;
+		if ( out->u.packed.nblk < COLA_PACK_ELEM )
+			return 1;
+
+		return pack_emit(out, c);
+	}else if ( out->cols ) {
+		assert(out->u.cols.cur < out->u.cols.end);
+		out->u.cols.cur[0] = *e;
+		out->u.cols.cur++;
+
+		if ( out->u.cols.cur < out->u.cols.end )
+			return 1;
+
+		return cols_flush(out, c);
+	}else{
+		assert(out->u.buf.cur < out->u.buf.end);
+		out->u.buf.cur[0] = *e;
+		out->u.buf.cur++;
+
+		if ( out->u.buf.cur < out->u.buf.end )
+			return 1;
+
+		return outbuf_flush(out, c);
+	}
+}
+
+static void init_bufs(struct _cola *c)
+{
+	c->c_bufptr = c->c_buf;
+}
+
+static void inbuf_run(struct _cola *c, struct inbuf *in,
+				const struct cola_elem *run, cola_key_t nrun)
+{
+	in->mapped = 1;
+	in->packed = 0;
+	in->cols = 0;
+	in->u.mapped.buf = (struct cola_elem *)run;
+	in->u.mapped.end = in->u.mapped.buf + nrun;
+}
+
+/* queue a read of the next chunk of the region in to a block */
+static int inbuf_issue(struct _cola *c, struct inbuf *in, unsigned int blk)
+{
+	cola_key_t bcnt = in->u.buf.end - in->u.buf.buf;
+	cola_key_t cnt;
+
+	if ( in->u.buf.issued >= in->u.buf.nelem )
+		return 1;
+
+	cnt = in->u.buf.nelem - in->u.buf.issued;
+	if ( cnt > bcnt )
+		cnt = bcnt;
+
+	if ( !ioring_pread(in->u.buf.ring, c->c_fd,
+			in->u.buf.ofs +
+				in->u.buf.issued * sizeof(struct cola_elem),
+			in->u.buf.buf + blk * bcnt,
+			cnt * sizeof(struct cola_elem),
+			&in->u.buf.req[blk]) )
+		return 0;
+
+	in->u.buf.issued += cnt;
+	return 1;
+}
+
+/* Reads complete in order, one block at a time. The block which was just
+ * consumed is reused for the next read-ahead before waiting on the next one.
+*/
+static int inbuf_refill_ring(struct _cola *c, struct inbuf *in)
+{
+	unsigned int blk = in->u.buf.head;
+	struct ioreq *req = &in->u.buf.req[blk];
+	struct cola_elem *ptr;
+	cola_key_t cnt;
+
+	if ( !in->u.buf.issued ) {
+		unsigned int i;
+
+		for(i = 0; i < in->u.buf.nblk; i++) {
+			if ( !inbuf_issue(c, in, i) )
+				return 0;
+		}
+	}else if ( !inbuf_issue(c, in, (blk + in->u.buf.nblk - 1) %
+					in->u.buf.nblk) ) {
+		return 0;
+	}
+
+	if ( !ioring_wait(in->u.buf.ring, req) )
+		return 0;
+	if ( req->res < 0 ) {
+		errno = -req->res;
+		return 0;
+	}
+
+	ptr = in->u.buf.buf + blk * (in->u.buf.end - in->u.buf.buf);
+	if ( (size_t)req->res < req->len ) {
+		size_t sz = req->len - req->res;
+		int eof;
+
+		if ( !fd_pread(c->c_fd, in->u.buf.ofs + req->res +
+				in->u.buf.off * sizeof(struct cola_elem),
+				(uint8_t *)ptr + req->res, &sz, &eof) ||
+				sz != req->len - req->res )
+			return 0;
+	}
+
+	cnt = req->len / sizeof(struct cola_elem);
+	in->u.buf.off += cnt;
+	in->u.buf.cur = ptr;
+	in->u.buf.lim = ptr + cnt;
+	in->u.buf.head = (blk + 1) % in->u.buf.nblk;
+	return 1;
+}
+
+/* decode the next block, the first may start part way in */
+static int inbuf_refill_packed(struct _cola *c, struct inbuf *in)
+{
+	cola_key_t left = in->u.buf.nelem - in->u.buf.off;
+	unsigned int skip = in->u.buf.skip, n;
+
+	if ( !pack_load(c, &in->u.buf.pk, in->u.buf.blk, in->u.buf.buf, &n) )
+		return 0;
+	if ( n <= skip ) {
+		fprintf(stderr, "%s: level %u: short packed block\n",
+			cmd, in->u.buf.pk.lvlno);
+		return 0;
+	}
+
+	n -= skip;
+	if ( n > left )
+		n = left;
+
+	in->u.buf.cur = in->u.buf.buf + skip;
+	in->u.buf.lim = in->u.buf.cur + n;
+	in->u.buf.off += n;
+	in->u.buf.blk++;
+	in->u.buf.skip = 0;
+	return 1;
+}
+
+static int inbuf_refill_cols(struct _cola *c, struct inbuf *in)
+{
+	cola_key_t cnt = in->u.buf.end - in->u.buf.buf;
+
+	if ( cnt > in->u.buf.nelem - in->u.buf.off )
+		cnt = in->u.buf.nelem - in->u.buf.off;
+
+	if ( !cols_load(c, in->u.buf.lvlno, in->u.buf.from + in->u.buf.off,
+			cnt, in->u.buf.buf, in->u.buf.stage, 0) )
+		return 0;
+
+	in->u.buf.off += cnt;
+	in->u.buf.cur = in->u.buf.buf;
+	in->u.buf.lim = in->u.buf.buf + cnt;
+	return 1;
+}
+
+static int inbuf_refill(struct _cola *c, struct inbuf *in)
+{
+	size_t buf_sz, ret_sz;
+	cola_key_t cnt;
+	off_t off;
+	int eof;
+
+	assert(in->u.buf.cur == in->u.buf.lim);
+	if(in->u.buf.off >= in->u.buf.nelem)
+		return 0;
+
+	if ( in->packed )
+		return inbuf_refill_packed(c, in);
+	if ( in->cols )
+		return inbuf_refill_cols(c, in);
+	if ( in->u.buf.ring )
+		return inbuf_refill_ring(c, in);
+
+	cnt = in->u.buf.end - in->u.buf.buf;
+	if ( cnt > in->u.buf.nelem - in->u.buf.off )
+		cnt = in->u.buf.nelem - in->u.buf.off;
+
+	buf_sz = cnt * sizeof(struct cola_elem);
+	ret_sz = buf_sz;
+
+	off = in->u.buf.ofs;
+	off += in->u.buf.off * sizeof(struct cola_elem);
+
+	if ( !fd_pread(c->c_fd, off, in->u.buf.buf, &ret_sz, &eof) )
+		return 0;
+	if ( ret_sz != buf_sz )
+		return 0;
+
+	in->u.buf.off += cnt;
+	in->u.buf.cur = in->u.buf.buf;
+	in->u.buf.lim = in->u.buf.buf + cnt;
+	return 1;
+}
+
+/* buffered inputs carve a block out of *bufp */
+static void inbuf_region(struct _cola *c, struct inbuf *in, int mapped,
+				cola_key_t ofs, cola_key_t nelem,
+				uint8_t **bufp)
+{
+	in->packed = 0;
+	in->cols = 0;
+	if ( mapped ) {
+		in->mapped = 1;
+		in->u.mapped.buf = (struct cola_elem *)(c->c_map + ofs);
+		in->u.mapped.end = in->u.mapped.buf + nelem;
+	}else{
+		cola_key_t cnt;
+
+		if ( nelem < (BLOCK_SIZE / sizeof(struct cola_elem)) ) {
+			cnt = nelem;
+		}else{
+			cnt = BLOCK_SIZE / sizeof(struct cola_elem);
+		}
+
+		in->mapped = 0;
+		in->u.buf.buf = (struct cola_elem *)(*bufp);
+		in->u.buf.cur = in->u.buf.buf;
+		in->u.buf.lim = in->u.buf.buf;
+		in->u.buf.end = in->u.buf.buf + cnt;
+		in->u.buf.off = 0;
+		in->u.buf.nelem = nelem;
+		in->u.buf.ofs = ofs;
+		in->u.buf.ring = NULL;
+
+		*bufp += (cnt * sizeof(struct cola_elem));
+	}
+}
+
+/* Entries [from, from + nelem) of a level. A packed one takes a whole block
+ * out of *bufp for the decoded block, its index and the packed bytes, and
+ * columns take one for the entries and their values.
+*/
+static void inbuf_level(struct _cola *c, struct inbuf *in, unsigned int lvlno,
+				cola_key_t from, cola_key_t nelem,
+				uint8_t **bufp)
+{
+	uint8_t *p = *bufp;
+
+	if ( level_cols(c, lvlno) ) {
+		cola_key_t cnt = BLOCK_SIZE /
+			(sizeof(struct cola_elem) + sizeof(cola_val_t));
+
+		in->mapped = 0;
+		in->packed = 0;
+		in->cols = 1;
+		in->u.buf.buf = (struct cola_elem *)p;
+		in->u.buf.cur = in->u.buf.buf;
+		in->u.buf.lim = in->u.buf.buf;
+		in->u.buf.end = in->u.buf.buf + cnt;
+		in->u.buf.off = 0;
+		in->u.buf.nelem = nelem;
+		in->u.buf.ring = NULL;
+		in->u.buf.stage = (cola_val_t *)in->u.buf.end;
+		in->u.buf.from = from;
+		in->u.buf.lvlno = lvlno;
+		*bufp += BLOCK_SIZE;
+		return;
+	}
+
+	if ( !level_packed(c, lvlno) ) {
+		inbuf_region(c, in, lvlno < c->c_maplvls,
+				level_ofs(lvlno) +
+					from * sizeof(struct cola_elem),
+				nelem, bufp);
+		return;
+	}
+
+	in->mapped = 0;
+	in->packed = 1;
+	in->cols = 0;
+	in->u.buf.buf = (struct cola_elem *)p;
+	in->u.buf.cur = in->u.buf.buf;
+	in->u.buf.lim = in->u.buf.buf;
+	in->u.buf.end = in->u.buf.buf + COLA_PACK_ELEM;
+	in->u.buf.off = 0;
+	in->u.buf.nelem = nelem;
+	in->u.buf.ring = NULL;
+	in->u.buf.blk = from >> PACK_SHIFT;
+	in->u.buf.skip = from & (COLA_PACK_ELEM - 1);
+	pack_rd_init(&in->u.buf.pk, lvlno,
+			(struct cola_pidx *)(p + PACK_BLOCK),
+			PACK_BLOCK / sizeof(struct cola_pidx),
+			p + 2 * PACK_BLOCK,
+			BLOCK_SIZE - 2 * PACK_BLOCK - PACK_PAD, 0);
+	*bufp += BLOCK_SIZE;
+}
+
+/* read ahead through a ring, carving the extra blocks out of *bufp */
+static void inbuf_ring(struct inbuf *in, struct ioring *ring, uint8_t **bufp)
+{
+	cola_key_t bcnt, nblk;
+
+	if ( in->mapped || in->packed || in->cols || NULL == ring )
+		return;
+
+	bcnt = in->u.buf.end - in->u.buf.buf;
+	if ( !bcnt )
+		return;
+
+	nblk = (in->u.buf.nelem + bcnt - 1) / bcnt;
+	if ( nblk > INBUF_BLOCKS )
+		nblk = INBUF_BLOCKS;
+
+	in->u.buf.ring = ring;
+	in->u.buf.nblk = nblk;
+	in->u.buf.head = 0;
+	in->u.buf.issued = 0;
+	memset(in->u.buf.req, 0, sizeof(in->u.buf.req));
+	*bufp += (nblk - 1) * bcnt * sizeof(struct cola_elem);
+}
+
+static void inbuf_la(struct _cola *c, struct inbuf *in, unsigned int lvlno)
+{
+	inbuf_region(c, in, lvlno < c->c_maplvls,
+			la_ofs(lvlno), c->c_lalen[lvlno], &c->c_bufptr);
+}
+
+/* Returns a pointer to the next element in place, it remains valid until the
+ * next pop from the same input.
+*/
+static const struct cola_elem *inbuf_pop(struct _cola *c, struct inbuf *in)
+{
+	const struct cola_elem *ret;
+
+	if ( in->mapped ) {
+		if ( in->u.mapped.buf >= in->u.mapped.end )
+			return NULL;
+		ret = in->u.mapped.buf;
+		in->u.mapped.buf++;
+	}else{
+		if ( in->u.buf.cur == in->u.buf.lim && !inbuf_refill(c, in) )
+			return NULL;
+		ret = in->u.buf.cur;
+		in->u.buf.cur++;
+	}
+	return ret;
+}
+
+/* Feed the merged sequence of a level and its lookahead array, in key order,
+ * to build the lookahead array of the level below. Every LA_STRIDE'th item
+ * is sampled along with the number of real elements before it. The number of
+ * lookahead entries before it is implicit: its position less that.
+*/
+static int la_push(struct _cola *c, struct la_gen *g, cola_key_t key, int real)
+{
+	if ( !(g->pos & (LA_STRIDE - 1)) ) {
+		struct cola_la la;
+
+		la.key = key;
+		la.real = g->real;
+		if ( !outbuf_push(&g->out, c, (struct cola_elem *)&la) )
+			return 0;
+	}
+
+	g->pos++;
+	if ( real )
+		g->real++;
+	return 1;
+}
+
+static void la_gen_init(struct _cola *c, struct la_gen *g, unsigned int lvlno,
+			cola_key_t nelem)
+{
+	outbuf_region(c, &g->out, lvlno < c->c_maplvls, la_ofs(lvlno),
+			nelem, c->c_labuf, LABUF_ELEM);
+	g->pos = 0;
+	g->real = 0;
+}
+
+static unsigned int cfls(cola_key_t k)
+{
+	unsigned int i, ret;
+	for(i = ret = 0; i < sizeof(k)*8; i++) {
+		cola_key_t tmp;
+
+		tmp = 1ULL << i;
+		if ( tmp > k )
+			break;
+
+		if ( k & tmp )
+			ret = i;
+	}
+	return ret;
+}
+
+/* do everything possible to try to get hugepages here */
+static int alloc_buffers(struct _cola *c)
+{
+	int flags;
+	uint8_t *map;
+	int retries = 0;
+
+	if ( c->c_buf )
+		return 1;
+
+again:
+	flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+	if ( !retries )
+		flags |= MAP_HUGETLB;
+#endif
+
+	map = mmap(NULL, TOTAL_BUFFER_SIZE, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if ( MAP_FAILED == map ) {
+		if ( retries < 1 ) {
+			retries++;
+			goto again;
+		}
+		return 0;
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise(map, TOTAL_BUFFER_SIZE, MADV_HUGEPAGE);
+#endif
+
+	c->c_buf = map;
+	c->c_wrbuf = map + RDBUF_SIZE;
+	c->c_labuf = c->c_wrbuf + WRBUF_SIZE;
+	return 1;
+}
+
+/* Publish the handle as it is now, with a carry in progress if f is given,
+ * as the view which readers start from, and retire the last one.
+*/
+static int publish(struct _cola *c, const struct frozen *f)
+{
+	struct views *vs = c->c_views;
+	struct view *v, *old;
+
+	if ( NULL == vs )
+		return 1;
+
+	v = malloc(sizeof(*v));
+	if ( NULL == v ) {
+		fprintf(stderr, "%s: malloc: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	v->c = *c;
+	v->c.c_bg = NULL;
+	v->c.c_shadow = NULL;
+	v->c.c_wal = NULL;
+	v->c.c_mem = NULL;
+	v->c.c_replay = NULL;
+	v->c.c_views = NULL;
+	v->c.c_isview = 1;
+	if ( f ) {
+		v->f = *f;
+		v->c.c_frozen = &v->f;
+	}else{
+		v->c.c_frozen = NULL;
+	}
+
+	old = vs->cur;
+	__atomic_store_n(&vs->cur, v, __ATOMIC_SEQ_CST);
+	if ( old ) {
+		old->next = vs->retired;
+		vs->retired = old;
+	}
+	vs->npub++;
+	return 1;
+}
+
+/* Wait out the readers of every view but the current one, then free them
+ * along with the mappings which only they used.
+*/
+static void settle(struct _cola *c)
+{
+	struct views *vs = c->c_views;
+	struct old_map **pm, *m;
+	struct view *v;
+
+	if ( NULL == vs || (NULL == vs->retired && NULL == vs->unmaps) )
+		return;
+
+	epoch_sync(vs->epoch);
+
+	while ( (v = vs->retired) ) {
+		vs->retired = v->next;
+		free(v);
+	}
+
+	for(pm = &vs->unmaps; (m = *pm); ) {
+		if ( m->pub < vs->npub ) {
+			*pm = m->next;
+			munmap(m->map, m->sz);
+			free(m);
+		}else{
+			pm = &m->next;
+		}
+	}
+}
+
+/* enter the epoch and pick up the current view */
+static struct _cola *view_get(struct _cola *c, unsigned int *ticket)
+{
+	struct views *vs = c->c_views;
+
+	*ticket = epoch_enter(vs->epoch);
+	return &__atomic_load_n(&vs->cur, __ATOMIC_SEQ_CST)->c;
+}
+
+static void view_put(struct _cola *c, unsigned int ticket)
+{
+	epoch_exit(c->c_views->epoch, ticket);
+}
+
+static void writer_lock(struct _cola *c)
+{
+	if ( c->c_views )
+		pthread_mutex_lock(&c->c_views->wlock);
+}
+
+static void writer_unlock(struct _cola *c)
+{
+	if ( c->c_views )
+		pthread_mutex_unlock(&c->c_views->wlock);
+}
+
+/* Readers take the write buffer lock before they pick up a view so that the
+ * two agree, see mem_flush(). The writer must never wait for readers while
+ * holding it.
+*/
+static void mem_lock(struct _cola *c, int wr)
+{
+	if ( NULL == c->c_views )
+		return;
+	if ( wr )
+		pthread_rwlock_wrlock(&c->c_views->memlock);
+	else
+		pthread_rwlock_rdlock(&c->c_views->memlock);
+}
+
+static void mem_unlock(struct _cola *c)
+{
+	if ( c->c_views )
+		pthread_rwlock_unlock(&c->c_views->memlock);
+}
+
+/* how many of the levels below top may be mapped */
+static unsigned int map_levels(struct _cola *c, unsigned int top)
+{
+	return (top < c->c_mapmax) ? top : c->c_mapmax;
+}
+
+/* In thread-safe mode the old mapping can't be moved out from under the
+ * readers, so a new one is made and the old one is kept until they're done.
+*/
+static int remap(struct _cola *c, unsigned int num_levels)
+{
+	struct views *vs = c->c_views;
+	struct old_map *old = NULL;
+	size_t sz;
+	uint8_t *map;
+
+	dprintf(" - remap %u levels\n", num_levels);
+	stat_add(c, remaps, 1);
+
+	sz = level_ofs(num_levels);
+
+	if ( c->c_map && NULL == vs ) {
+		map = mremap(c->c_map, c->c_mapsz, sz, MREMAP_MAYMOVE);
+	}else{
+		int f = (c->c_rw) ? (PROT_READ|PROT_WRITE) : (PROT_READ);
+
+		if ( c->c_map ) {
+			old = malloc(sizeof(*old));
+			if ( NULL == old ) {
+				fprintf(stderr, "%s: malloc: %s\n",
+					cmd, os_err());
+				return 0;
+			}
+		}
+		map = mmap(NULL, sz, f, MAP_SHARED, c->c_fd, 0);
+	}
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "%s: mremap: %s\n", cmd, os_err());
+		free(old);
+		return 0;
+	}
+
+	if ( old ) {
+		old->map = c->c_map;
+		old->sz = c->c_mapsz;
+		old->pub = vs->npub;
+		old->next = vs->unmaps;
+		vs->unmaps = old;
+	}
+
+	/* writes to mapped levels aren't seen by the cache */
+	madvise(map, sz, MADV_RANDOM);
+	cache_drop(c, 0, ~0ULL);
+	c->c_maplvls = num_levels;
+	c->c_mapsz = sz;
+	c->c_map = map;
+	return 1;
+}
+
+static int map(struct _cola *c)
+{
+	int f;
+	size_t sz;
+	uint8_t *map;
+
+	c->c_mapmax = MAP_LEVELS;
+	if ( !INITIAL_LEVELS )
+		return 1;
+
+	dprintf("mapping in %u levels\n", INITIAL_LEVELS);
+	f = (c->c_rw) ? (PROT_READ|PROT_WRITE) : (PROT_READ);
+	sz = level_ofs(INITIAL_LEVELS + 1);
+
+	map = mmap(NULL, sz, f, MAP_SHARED, c->c_fd, 0);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "%s: mmap: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	madvise(map, sz, MADV_RANDOM);
+
+	c->c_maplvls = INITIAL_LEVELS;
+	c->c_mapsz = sz;
+	c->c_map = map;
+	return 1;
+}
+
+/* version 5 headers end before h_packlvl, with the checksum there */
+#define HDR_V5_SUM	offsetof(struct cola_hdr, h_packlvl)
+
+static uint64_t hdr_sum(const struct cola_hdr *hdr, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)hdr;
+	uint64_t h = 0, w;
+	size_t i;
+
+	for(i = 0; i < len; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		h = bloom_hash(h ^ w);
+	}
+
+	return h;
+}
+
+/* written over the older copy, and synced */
+static int write_header(struct _cola *c, struct cola_hdr *hdr)
+{
+	hdr->h_magic = COLA_MAGIC;
+	hdr->h_vers = COLA_CURRENT_VER;
+	hdr->h_sum = hdr_sum(hdr, offsetof(struct cola_hdr, h_sum));
+
+	if ( !fd_pwrite(c->c_fd, (hdr->h_seq & 1) * HDR_SLOT,
+				hdr, sizeof(*hdr)) ||
+			fdatasync(c->c_fd) ) {
+		fprintf(stderr, "%s: write header: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	return 1;
+}
+
+static int read_slots(struct _cola *c, const char *fn, struct cola_hdr *h)
+{
+	unsigned int i;
+
+	for(i = 0; i < 2; i++) {
+		size_t sz = sizeof(h[i]);
+		int eof;
+
+		if ( !fd_pread(c->c_fd, i * HDR_SLOT, &h[i], &sz, &eof) ||
+				sz != sizeof(h[i]) ) {
+			fprintf(stderr, "%s: read: %s: %s\n",
+				cmd, fn, os_err2("File truncated"));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* the newest valid copy, c_seen is left with both slots as they were read */
+static int read_header(struct _cola *c, const char *fn, struct cola_hdr *hdr)
+{
+	const char *err = "Bad magic";
+	struct cola_hdr *h = c->c_seen;
+	unsigned int i;
+	int found = 0;
+
+	if ( !read_slots(c, fn, h) )
+		return 0;
+
+	for(i = 0; i < 2; i++) {
+		struct cola_hdr tmp = h[i];
+		uint64_t sum;
+
+		if ( tmp.h_magic != COLA_MAGIC )
+			continue;
+		if ( tmp.h_vers == 5 ) {
+			memcpy(&sum, (uint8_t *)&tmp + HDR_V5_SUM, sizeof(sum));
+			tmp.h_packlvl = 0;
+			tmp.h_collvl = 0;
+			tmp.h_sum = sum;
+			sum = hdr_sum(&tmp, HDR_V5_SUM);
+		}else if ( tmp.h_vers == 7 ||
+				tmp.h_vers == COLA_CURRENT_VER ) {
+			/* version 7 only differs in having no columns */
+			sum = hdr_sum(&tmp, offsetof(struct cola_hdr, h_sum));
+		}else{
+			err = "Unsupported vers";
+			continue;
+		}
+		if ( tmp.h_sum != sum ) {
+			err = "Bad header checksum";
+			continue;
+		}
+
+		if ( !found || tmp.h_seq > hdr->h_seq )
+			*hdr = tmp;
+		found = 1;
+	}
+
+	if ( !found ) {
+		fprintf(stderr, "%s: %s: %s\n", cmd, fn, err);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int do_init(struct _cola *c, const char *fn, int rw, int create)
+{
+	struct cola_hdr hdr;
+	unsigned int i;
+
+	if ( create ) {
+		off_t initial;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.h_clean = 1;
+		if ( !write_header(c, &hdr) )
+			return 0;
+
+		initial = level_ofs(INITIAL_LEVELS + 1);
+		if ( posix_fallocate(c->c_fd, 0, initial) ) {
+			fprintf(stderr, "%s: %s: fallocate: %s\n",
 				cmd, fn, os_err());
-			goto out_close;
 		}
+	}else{
+		if ( !read_header(c, fn, &hdr) )
+			return 0;
+		c->c_nelem = hdr.h_nelem;
+		c->c_packlvl = hdr.h_packlvl;
+		c->c_collvl = hdr.h_collvl;
+	}
+
+	/* the levels are only known to be older than the log */
+	c->c_lsn = hdr.h_lsn;
+	for(i = 0; i < NUM_LEVELS; i++) {
+		c->c_range[i].first = 0;
+		c->c_range[i].end = hdr.h_lsn;
+	}
+	c->c_commit = hdr;
+	c->c_rw = rw;
+	calc_lalen(c);
+	if ( !map(c) )
+		return 0;
+
+	c->c_nxtlvl = cfls(c->c_nelem);
+	if ( c->c_nxtlvl < INITIAL_LEVELS )
+		c->c_nxtlvl = INITIAL_LEVELS + 1;
+	dprintf("next level init to %u\n", c->c_nxtlvl);
+
+	return 1;
+}
+
+static int wal_attach(struct _cola *c, const char *fn, int create);
+
+static struct _cola *do_open(const char *fn, int rw, int create, int overwrite)
+{
+	struct _cola *c = NULL;
+	int oflags;
+
+	c = calloc(1, sizeof(*c));
+	if ( NULL == c )
+		goto out;
+
+	if ( create ) {
+		oflags = O_RDWR | O_CREAT | ((overwrite) ? O_TRUNC : O_EXCL);
+	}else{
+		oflags = (rw) ? O_RDWR : O_RDONLY;
+	}
+
+	c->c_fd = open(fn, oflags, 0644);
+	if ( c->c_fd < 0 ) {
+		fprintf(stderr, "%s: open: %s: %s\n", cmd, fn, os_err());
+		goto out_free;
+	}
+
+	if ( !do_init(c, fn, rw, create) )
+		goto out_close;
+
+	if ( rw ) {
+		c->c_mem = memtable_new(MEMTABLE_SIZE /
+					sizeof(struct cola_elem));
+		if ( NULL == c->c_mem || !wal_attach(c, fn, create) )
+			goto out_unmap;
+	}
+
+	/* success */
+	goto out;
+
+out_unmap:
+	memtable_free(c->c_mem);
+	wal_close(c->c_wal);
+	if ( c->c_map )
+		munmap(c->c_map, c->c_mapsz);
+	if ( c->c_buf )
+		munmap(c->c_buf, TOTAL_BUFFER_SIZE);
+out_close:
+	close(c->c_fd);
+out_free:
+	free(c);
+	c = NULL;
+out:
+	return c;
+}
+
+cola_t cola_open(const char *fn, int rw)
+{
+	return do_open(fn, rw, 0, 0);
+}
+
+cola_t cola_creat(const char *fn, int overwrite)
+{
+	return do_open(fn, 1, 1, overwrite);
+}
+
+/* Read-only handles may share the file with a writer in another process,
+ * which only overwrites the levels that a commit refers to once it has made
+ * another commit. So anything read since the header slots were last read is
+ * good if they're still the same afterwards, byte for byte, since a slot
+ * that's being written may be caught half done. If not, the handle is
+ * refreshed and the read tried again.
+*/
+static int stale(struct _cola *c)
+{
+	struct cola_hdr h[2];
+
+	if ( c->c_rw )
+		return 0;
+
+	if ( c->c_map ) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		memcpy(&h[0], c->c_map, sizeof(h[0]));
+		memcpy(&h[1], c->c_map + HDR_SLOT, sizeof(h[1]));
+	}else if ( !read_slots(c, "header", h) ) {
+		return 1;
+	}
+
+	return !!memcmp(h, c->c_seen, sizeof(h));
+}
+
+/* Only the committed levels are picked up, whatever's in the writer's log
+ * isn't. Levels are only ever mapped in addition to what's mapped already.
+*/
+int cola_refresh(cola_t c)
+{
+	struct cola_hdr hdr;
+	unsigned int top;
+	int ret = 0;
+
+	if ( c->c_rw )
+		return 1;
+
+	writer_lock(c);
+	if ( !read_header(c, "header", &hdr) )
+		goto out;
+
+	if ( hdr.h_seq != c->c_commit.h_seq ) {
+		dprintf("refresh to commit %"PRIu64"\n", hdr.h_seq);
+		top = map_levels(c, cfls(hdr.h_nelem));
+		if ( c->c_map && c->c_maplvls < top && !remap(c, top) )
+			goto out;
+
+		c->c_nelem = hdr.h_nelem;
+		c->c_packlvl = hdr.h_packlvl;
+		c->c_collvl = hdr.h_collvl;
+		c->c_commit = hdr;
+		calc_lalen(c);
+		cache_drop(c, 0, ~0ULL);
+	}
+
+	/* c_seen may have changed even if the commit hasn't */
+	if ( !publish(c, NULL) )
+		goto out;
+	settle(c);
+	ret = 1;
+out:
+	writer_unlock(c);
+	return ret;
+}
+
+static struct _cola *shadow_open(void)
+{
+	struct _cola *c;
+
+	c = calloc(1, sizeof(*c));
+	if ( NULL == c )
+		return NULL;
+
+	c->c_fd = memfd_create("cola-shadow", MFD_CLOEXEC);
+	if ( c->c_fd < 0 ) {
+		fprintf(stderr, "%s: memfd_create: %s\n", cmd, os_err());
+		free(c);
+		return NULL;
+	}
+
+	if ( !do_init(c, "shadow", 1, 1) ) {
+		close(c->c_fd);
+		free(c);
+		return NULL;
+	}
+
+	/* its tombstones have to reach the main cola */
+	c->c_nogc = 1;
+	return c;
+}
+
+static void buf_finish(struct buf *buf)
+{
+	if ( buf->heap )
+		free(buf->ptr);
+	buf->ptr = NULL;
+	buf->nelem = 0;
+}
+
+/* read entries [from, to) of a region, small windows are read in to the
+ * buffer itself so that queries never need to allocate
+*/
+static int read_part(struct _cola *c, int mapped, cola_key_t ofs,
+			cola_key_t from, cola_key_t to,
+			struct buf *buf)
+{
+	cola_key_t nr_ent;
+
+	assert(from <= to);
+
+	nr_ent = to - from;
+	ofs += from * sizeof(struct cola_elem);
+
+	if ( mapped ) {
+		buf->ptr = (struct cola_elem *)(c->c_map + ofs);
+		buf->nelem = nr_ent;
+		buf->heap = 0;
+	}else{
+		if ( nr_ent <= WIN_ELEM ) {
+			buf->ptr = buf->win;
+			buf->heap = 0;
+		}else{
+			buf->ptr = malloc(nr_ent * sizeof(*buf->ptr));
+			if ( NULL == buf->ptr )
+				return 0;
+			buf->heap = 1;
+		}
+
+		buf->nelem = nr_ent;
+
+		if ( !read_at(c, !buf->heap, ofs, buf->ptr,
+				nr_ent * sizeof(*buf->ptr)) ) {
+			buf_finish(buf);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* entries [from, to) of a packed level, a block at a time */
+static int read_packed(struct _cola *c, unsigned int lvlno,
+			cola_key_t from, cola_key_t to,
+			struct buf *buf)
+{
+	struct cola_elem e[COLA_PACK_ELEM];
+	struct cola_pidx idx[PACK_IDX];
+	uint8_t raw[PACK_BLOCK + PACK_PAD];
+	cola_key_t nr_ent = to - from, pos;
+	struct pack_rd r;
+
+	if ( nr_ent <= WIN_ELEM ) {
+		buf->ptr = buf->win;
+		buf->heap = 0;
+	}else{
+		buf->ptr = malloc(nr_ent * sizeof(*buf->ptr));
+		if ( NULL == buf->ptr )
+			return 0;
+		buf->heap = 1;
+	}
+	buf->nelem = nr_ent;
+
+	pack_rd_init(&r, lvlno, idx, PACK_IDX, raw, PACK_BLOCK, !buf->heap);
+	for(pos = from; pos < to; ) {
+		unsigned int skip = pos & (COLA_PACK_ELEM - 1), n;
+		cola_key_t cnt;
+
+		if ( !pack_load(c, &r, pos >> PACK_SHIFT, e, &n) ) {
+			buf_finish(buf);
+			return 0;
+		}
+		if ( n <= skip ) {
+			fprintf(stderr, "%s: level %u: short packed block\n",
+				cmd, lvlno);
+			buf_finish(buf);
+			return 0;
+		}
+
+		cnt = n - skip;
+		if ( cnt > to - pos )
+			cnt = to - pos;
+		memcpy(buf->ptr + (pos - from), e + skip, cnt * sizeof(*e));
+		pos += cnt;
+	}
+
+	return 1;
+}
+
+/* entries [from, to) of a level split in to columns */
+static int read_cols(struct _cola *c, unsigned int lvlno,
+			cola_key_t from, cola_key_t to,
+			struct buf *buf)
+{
+	cola_val_t win[WIN_ELEM], *stage = win;
+	cola_key_t nr_ent = to - from;
+
+	if ( nr_ent <= WIN_ELEM ) {
+		buf->ptr = buf->win;
+		buf->heap = 0;
+	}else{
+		buf->ptr = malloc(nr_ent * (sizeof(*buf->ptr) +
+						sizeof(*stage)));
+		if ( NULL == buf->ptr )
+			return 0;
+		buf->heap = 1;
+		stage = (cola_val_t *)(buf->ptr + nr_ent);
+	}
+	buf->nelem = nr_ent;
+
+	if ( !cols_load(c, lvlno, from, nr_ent, buf->ptr, stage,
+				!buf->heap) ) {
+		buf_finish(buf);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int read_level_part(struct _cola *c, unsigned int lvlno,
+					cola_key_t from, cola_key_t to,
+					struct buf *buf)
+{
+	assert(to <= (1ULL << lvlno));
+	if ( level_packed(c, lvlno) )
+		return read_packed(c, lvlno, from, to, buf);
+	if ( level_cols(c, lvlno) )
+		return read_cols(c, lvlno, from, to, buf);
+	return read_part(c, lvlno < c->c_maplvls, level_ofs(lvlno),
+			from, to, buf);
+}
+
+static int read_la_part(struct _cola *c, unsigned int lvlno,
+					cola_key_t from, cola_key_t to,
+					struct buf *buf)
+{
+	assert(to <= c->c_lalen[lvlno]);
+	return read_part(c, lvlno < c->c_maplvls, la_ofs(lvlno),
+			from, to, buf);
+}
+
+static int read_level(struct _cola *c, unsigned int lvlno,
+				struct buf *buf)
+{
+	return read_level_part(c, lvlno, 0, 1ULL << lvlno, buf);
+}
+
+/* make sure every level needed to hold newcnt items is allocated and, if
+ * required, mapped
+*/
+static int grow(struct _cola *c, cola_key_t newcnt)
+{
+	while ( newcnt >= (1ULL << c->c_nxtlvl) ) {
+		cola_key_t ofs, sz;
+
+		/* packed levels take only the space they need */
+		if ( level_packed(c, c->c_nxtlvl) )
+			ofs = la_ofs(c->c_nxtlvl);
+		else
+			ofs = level_ofs(c->c_nxtlvl);
+		sz = level_ofs(c->c_nxtlvl + 1) - ofs;
+		dprintf("fallocate level %u\n", c->c_nxtlvl);
+		if ( posix_fallocate(c->c_fd, ofs, sz) )
+			fprintf(stderr, "%s: fallocate: %s\n",
+				cmd, os_err());
+		if ( c->c_nxtlvl < c->c_mapmax &&
+				c->c_nxtlvl >= c->c_maplvls ) {
+			if ( !remap(c, c->c_nxtlvl + 1) )
+				return 0;
+		}
+
+		c->c_nxtlvl++;
+	}
+
+	return 1;
+}
+
+/* A level's new bloom filter is built in place if it's mapped or else in
+ * memory and written out afterwards.
+*/
+static uint8_t *bloom_init(struct _cola *c, unsigned int lvlno)
+{
+	uint8_t *f;
+
+	if ( lvlno < c->c_maplvls ) {
+		f = c->c_map + bloom_ofs(lvlno);
+		memset(f, 0, bloom_size(lvlno));
+		return f;
+	}
+
+	return calloc(1, bloom_size(lvlno));
+}
+
+static int bloom_finish(struct _cola *c, unsigned int lvlno, uint8_t *f,
+			int ret)
+{
+	if ( lvlno < c->c_maplvls )
+		return ret;
+
+	if ( ret && !write_at(c, bloom_ofs(lvlno), f, bloom_size(lvlno)) ) {
+		fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+		ret = 0;
+	}
+
+	free(f);
+	return ret;
+}
+
+/* Fetch the block of a level's bloom filter for a key and test it. Note that
+ * this has nothing to say about empty levels.
+*/
+static int bloom_test(struct _cola *c, unsigned int lvlno, cola_key_t key,
+			int *maybe)
+{
+	uint64_t buf[BLOOM_BLOCK / sizeof(uint64_t)];
+	uint64_t h = bloom_hash(key);
+	const uint64_t *blk;
+	cola_key_t ofs;
+	unsigned int i;
+
+	ofs = bloom_ofs(lvlno) + bloom_block(lvlno, h);
+	if ( lvlno < c->c_maplvls ) {
+		blk = (const uint64_t *)(c->c_map + ofs);
+	}else{
+		if ( !read_at(c, 1, ofs, buf, sizeof(buf)) )
+			return 0;
+		blk = buf;
+	}
+
+	for(h = bloom_hash(h), i = 0; i < BLOOM_PROBES; i++, h >>= BLOOM_BITS) {
+		unsigned int bit = h & ((1U << BLOOM_BITS) - 1);
+
+		if ( !(blk[bit / 64] & (1ULL << (bit % 64))) ) {
+			*maybe = 0;
+			return 1;
+		}
+	}
+
+	*maybe = 1;
+	return 1;
+}
+
+/* the live levels from lvlno up which may contain a key */
+static int bloom_levels(struct _cola *c, cola_key_t key, unsigned int lvlno,
+			cola_key_t *mask)
+{
+	*mask = 0;
+	for(; c->c_nelem >> lvlno; lvlno++) {
+		int maybe;
+
+		if ( !level_live(c, lvlno) )
+			continue;
+		if ( !bloom_test(c, lvlno, key, &maybe) )
+			return 0;
+		if ( maybe )
+			*mask |= 1ULL << lvlno;
+	}
+
+	return 1;
+}
+
+/* write part of a sorted run directly in to an empty level */
+static int write_level(struct _cola *c, unsigned int lvlno,
+			const struct cola_elem *e, cola_key_t nelem)
+{
+	size_t sz = nelem * sizeof(*e);
+	cola_key_t i;
+	uint8_t *f;
+
+	f = bloom_init(c, lvlno);
+	if ( NULL == f )
+		return 0;
+	for(i = 0; i < nelem; i++)
+		bloom_add(f, lvlno, e[i].key, 0);
+	if ( !bloom_finish(c, lvlno, f, 1) )
+		return 0;
+
+	if ( level_packed(c, lvlno) || level_cols(c, lvlno) ) {
+		struct outbuf out;
+
+		if ( !alloc_buffers(c) )
+			return 0;
+		outbuf_level(c, &out, lvlno, 0, nelem, c->c_wrbuf, WRBUF_ELEM);
+		for(i = 0; i < nelem; i++) {
+			if ( !outbuf_push(&out, c, e + i) )
+				break;
+		}
+		if ( i == nelem && outbuf_finish(&out, c) )
+			return 1;
+		fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	if ( lvlno < c->c_maplvls ) {
+		memcpy(c->c_map + level_ofs(lvlno), e, sz);
+		return 1;
+	}
+
+	if ( !write_at(c, level_ofs(lvlno), e, sz) ) {
+		fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Move entries down the file, a chunk at a time through the read buffer if
+ * the source isn't mapped. The keys are added to the bloom filter f of level
+ * lvlno if it's set.
+*/
+static int move_region(struct _cola *c, cola_key_t dst, cola_key_t src,
+			cola_key_t nelem, uint8_t *f, unsigned int lvlno)
+{
+	assert(dst <= src);
+
+	while ( nelem ) {
+		struct cola_elem *e;
+		cola_key_t n, i;
+		size_t sz;
+
+		if ( src + nelem * sizeof(*e) <= c->c_mapsz ) {
+			n = nelem;
+			e = (struct cola_elem *)(c->c_map + src);
+		}else{
+			int eof;
+
+			n = (nelem < RDBUF_ELEM) ? nelem : RDBUF_ELEM;
+			e = (struct cola_elem *)c->c_buf;
+			sz = n * sizeof(*e);
+			if ( !fd_pread(c->c_fd, src, e, &sz, &eof) ||
+					sz != n * sizeof(*e) ) {
+				fprintf(stderr, "%s: read: %s\n",
+					cmd, os_err2("File truncated"));
+				return 0;
+			}
+		}
+
+		for(i = 0; f && i < n; i++)
+			bloom_add(f, lvlno, e[i].key, 0);
+
+		sz = n * sizeof(*e);
+		if ( dst + sz <= c->c_mapsz ) {
+			memmove(c->c_map + dst, e, sz);
+		}else if ( !write_at(c, dst, e, sz) ) {
+			fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+			return 0;
+		}
+
+		dst += sz;
+		src += sz;
+		nelem -= n;
+	}
+
+	return 1;
+}
+
+/* Narrow the window [*lo, *hi] containing the lower bound of a key in an
+ * unmapped region by probing single entries, until it can be read in one go.
+*/
+static int narrow(struct _cola *c, cola_key_t ofs, cola_key_t key,
+			cola_key_t *lo, cola_key_t *hi)
+{
+	while ( *hi - *lo > LA_STRIDE ) {
+		cola_key_t mid = *lo + (*hi - *lo) / 2;
+		struct cola_elem e;
+
+		if ( !read_at(c, 1, ofs + mid * sizeof(e), &e, sizeof(e)) )
+			return 0;
+
+		if ( e.key < key )
+			*lo = mid + 1;
+		else
+			*hi = mid;
+	}
+
+	return 1;
+}
+
+/* index of the first of nelem entries in a region not less than key */
+static int seek_region(struct _cola *c, int mapped, cola_key_t ofs,
+			cola_key_t nelem, cola_key_t key, cola_key_t *pos)
+{
+	cola_key_t lo = 0, hi = nelem;
+	struct buf win;
+
+	if ( !mapped && !narrow(c, ofs, key, &lo, &hi) )
+		return 0;
+
+	if ( !read_part(c, mapped, ofs, lo, hi, &win) )
+		return 0;
+
+	*pos = lo + search_lower_bound(win.ptr, win.nelem, key);
+	buf_finish(&win);
+	return 1;
+}
+
+/* Narrow [*lo, *hi] down to the lower bound of a key in a packed level: the
+ * last block in the window to start with a smaller key holds it, or it's
+ * the start of the next.
+*/
+static int narrow_packed(struct _cola *c, unsigned int lvlno, cola_key_t key,
+				cola_key_t *lo, cola_key_t *hi)
+{
+	struct cola_elem e[COLA_PACK_ELEM];
+	struct cola_pidx idx[PACK_IDX];
+	uint8_t raw[PACK_BLOCK + PACK_PAD];
+	cola_key_t blo, bhi, base;
+	struct pack_rd r;
+	unsigned int n;
+
+	if ( *hi - *lo <= LA_STRIDE )
+		return 1;
+
+	blo = *lo >> PACK_SHIFT;
+	bhi = (*hi - 1) >> PACK_SHIFT;
+	while ( blo < bhi ) {
+		cola_key_t mid = blo + (bhi - blo + 1) / 2;
+		struct cola_pidx x;
+
+		if ( !read_at(c, 1, pidx_ofs(lvlno, mid), &x, sizeof(x)) )
+			return 0;
+		if ( x.p_key < key )
+			blo = mid;
+		else
+			bhi = mid - 1;
+	}
+
+	pack_rd_init(&r, lvlno, idx, PACK_IDX, raw, PACK_BLOCK, 1);
+	if ( !pack_load(c, &r, blo, e, &n) )
+		return 0;
+
+	base = blo << PACK_SHIFT;
+	if ( *lo < base )
+		*lo = base;
+	if ( *hi > base + n )
+		*hi = base + n;
+	*lo += search_lower_bound(e + (*lo - base), *hi - *lo, key);
+	*hi = *lo;
+	return 1;
+}
+
+/* Narrow [*lo, *hi] down to the lower bound of a key in a level split in to
+ * columns, searching only the keys. Those which aren't mapped are probed one
+ * at a time until the rest can be read in one go.
+*/
+static int narrow_cols(struct _cola *c, unsigned int lvlno, cola_key_t key,
+				cola_key_t *lo, cola_key_t *hi)
+{
+	cola_key_t k[COLS_WIN];
+
+	if ( lvlno < c->c_maplvls ) {
+		const cola_key_t *keys;
+
+		keys = (const cola_key_t *)(c->c_map + key_ofs(lvlno, *lo));
+		*lo += search_lower_keys(keys, *hi - *lo, key);
+		*hi = *lo;
+		return 1;
+	}
+
+	while ( *hi - *lo > COLS_WIN ) {
+		cola_key_t mid = *lo + (*hi - *lo) / 2;
+
+		if ( !read_at(c, 1, key_ofs(lvlno, mid), k, sizeof(*k)) )
+			return 0;
+
+		if ( k[0] < key )
+			*lo = mid + 1;
+		else
+			*hi = mid;
+	}
+
+	if ( !read_at(c, 1, key_ofs(lvlno, *lo), k,
+			(*hi - *lo) * sizeof(*k)) )
+		return 0;
+
+	*lo += search_lower_keys(k, *hi - *lo, key);
+	*hi = *lo;
+	return 1;
+}
+
+/* narrow() for a level, which only has to be done if it isn't mapped */
+static int narrow_level(struct _cola *c, unsigned int lvlno, cola_key_t key,
+				cola_key_t *lo, cola_key_t *hi)
+{
+	if ( level_packed(c, lvlno) )
+		return narrow_packed(c, lvlno, key, lo, hi);
+	if ( level_cols(c, lvlno) )
+		return narrow_cols(c, lvlno, key, lo, hi);
+	if ( lvlno < c->c_maplvls )
+		return 1;
+	return narrow(c, level_ofs(lvlno), key, lo, hi);
+}
+
+/* seek_region() for the first nelem entries of a level */
+static int seek_level(struct _cola *c, unsigned int lvlno, cola_key_t nelem,
+			cola_key_t key, cola_key_t *pos)
+{
+	cola_key_t lo = 0, hi = nelem;
+	struct buf win;
+
+	if ( !narrow_level(c, lvlno, key, &lo, &hi) )
+		return 0;
+
+	if ( !read_level_part(c, lvlno, lo, hi, &win) )
+		return 0;
+
+	*pos = lo + search_lower_bound(win.ptr, win.nelem, key);
+	buf_finish(&win);
+	return 1;
+}
+
+/* The copies of a key seen so far, newest first, folded with the merge
+ * operator. A tombstone ends the fold, and cuts it if any value came before.
+*/
+struct lookup {
+	cola_merge_fn fn;
+	struct cola_elem e;
+	int found;
+	int done;
+	int cut;
+	unsigned int probes; /* levels searched */
+};
+
+static void lookup_init(struct lookup *l, struct _cola *c)
+{
+	l->fn = c->c_merge;
+	l->found = 0;
+	l->done = 0;
+	l->cut = 0;
+	l->probes = 0;
+}
+
+/* fold in the next older copy, returns true once no more are wanted */
+static int lookup_add(struct lookup *l, const struct cola_elem *e)
+{
+	if ( !l->found ) {
+		l->found = 1;
+		l->e = *e;
+		l->done = (NULL == l->fn || e->val == COLA_TOMBSTONE);
+	}else if ( e->val == COLA_TOMBSTONE ) {
+		l->done = 1;
+		l->cut = 1;
+	}else{
+		l->e.val = (*l->fn)(l->e.val, e->val);
+	}
+	return l->done;
+}
+
+/* found and not deleted */
+static int lookup_result(const struct lookup *l)
+{
+	return l->found && l->e.val != COLA_TOMBSTONE;
+}
+
+/* where the output of a slice of a merge goes */
+struct merge_out {
+	struct outbuf out;
+	struct la_gen g;
+	struct inbuf la_in;
+	const struct cola_elem *la;
+};
+
+/* Write one element out, and the lookahead entries which precede it. The
+ * lookahead array of the level below the output is written on the fly by
+ * interleaving the output with the (unchanged) lookahead array of the output
+ * level.
+*/
+static int merge_emit(struct merge_part *p, struct merge_out *o,
+			const struct cola_elem *e)
+{
+	struct _cola *c = p->c;
+
+	if ( !outbuf_push(&o->out, c, e) )
+		return 0;
+	p->kept++;
+
+	bloom_add(p->bloom, p->outlvl, e->key, p->bloom_atomic);
+
+	if ( p->outlvl ) {
+		for(; o->la && o->la->key < e->key;
+				o->la = inbuf_pop(c, &o->la_in)) {
+			if ( !la_push(c, &o->g, o->la->key, 0) )
+				return 0;
+		}
+		if ( !la_push(c, &o->g, e->key, 1) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Write out the result of folding all the copies of a key. If a tombstone
+ * cut the fold short it has to be kept, after the value, to hide any older
+ * copies still above the output. At the top there are none.
+*/
+static int merge_fold(struct merge_part *p, struct merge_out *o,
+			const struct lookup *l)
+{
+	struct cola_elem dead;
+
+	if ( l->e.val == COLA_TOMBSTONE )
+		return p->gc || merge_emit(p, o, &l->e);
+
+	if ( !merge_emit(p, o, &l->e) )
+		return 0;
+	if ( !l->cut || p->gc )
+		return 1;
+
+	dead.key = l->e.key;
+	dead.val = COLA_TOMBSTONE;
+	return merge_emit(p, o, &dead);
+}
+
+/* k-way merge of one slice of a merge. Inputs are numbered newest first and
+ * the heap breaks ties on that number, so equal keys come out newest first.
+ *
+ * With dedup set the copies of each key are folded in to one, newest first,
+ * with the cola's merge operator, or else the newest copy wins. A tombstone
+ * ends the fold. With gc set as well nothing older remains above the output
+ * so keys which end up deleted go altogether. The output is then short and
+ * the lookahead array written here is garbage, the caller sorts that out.
+*/
+static int merge_part(struct merge_part *p)
+{
+	struct _cola *c = p->c;
+	unsigned int outlvl = p->outlvl;
+	const struct cola_elem **cur;
+	struct inbuf *in;
+	struct merge_out o;
+#if MERGE_HEAP
+	struct heap_item *h;
+#else
+	struct tourn_node *t, *leaf;
+#endif
+	struct ioring *ring = NULL;
+	struct lookup l;
+	cola_key_t opos, nout;
+	uint8_t *bufptr;
+	unsigned int k, i;
+	int ret = 0;
+
+	dprintf(" - will write to level %u (%u-way merge)\n",
+			outlvl, p->k);
+#if MERGE_HEAP
+	h = alloca(sizeof(*h) * p->k);
+#else
+	t = alloca(sizeof(*t) * p->k);
+	leaf = alloca(sizeof(*leaf) * p->k);
+#endif
+	in = alloca(sizeof(*in) * p->k);
+	cur = alloca(sizeof(*cur) * p->k);
+
+	for(opos = nout = 0, i = 0; i < p->k; i++) {
+		opos += p->from[i];
+		nout += p->to[i] - p->from[i];
+	}
+
+	/* the output level is the biggest so if it's mapped, all are */
+	if ( outlvl >= c->c_maplvls && outlvl >= RING_MIN_LEVEL )
+		ring = ioring_new((p->k + 1) * INBUF_BLOCKS + 4);
+
+	bufptr = p->rdbuf;
+	inbuf_run(c, in, p->run + p->from[0], p->to[0] - p->from[0]);
+	for(i = 1; i < p->k; i++) {
+		inbuf_level(c, in + i, p->lvl[i], p->from[i],
+				p->to[i] - p->from[i], &bufptr);
+		inbuf_ring(in + i, ring, &bufptr);
+	}
+
+#if MERGE_HEAP
+	/* initialize the heap, slices may have empty inputs */
+	h = h - 1;
+	for(i = k = 0; i < p->k; i++) {
+		cur[i] = inbuf_pop(c, in + i);
+		if ( NULL == cur[i] )
+			continue;
+		k++;
+		h[k].val = i;
+		h[k].key = cur[i]->key;
+	}
+	minheap_init(k, h);
+#else
+	/* initialize the tournament, slices may have empty inputs */
+	for(i = k = 0; i < p->k; i++) {
+		cur[i] = inbuf_pop(c, in + i);
+		leaf[i].leaf = i;
+		leaf[i].done = (NULL == cur[i]);
+		leaf[i].key = (cur[i]) ? cur[i]->key : 0;
+		if ( cur[i] )
+			k++;
+	}
+	losertree_init(p->k, t, leaf);
+#endif
+
+	inbuf_region(c, &o.la_in, outlvl < c->c_maplvls,
+			la_ofs(outlvl) + p->la_from * sizeof(struct cola_la),
+			p->la_to - p->la_from, &bufptr);
+	inbuf_ring(&o.la_in, ring, &bufptr);
+	o.la = inbuf_pop(c, &o.la_in);
+	if ( outlvl ) {
+		cola_key_t first, last;
+
+		/* sample positions are global, only write our own */
+		o.g.pos = opos + p->la_from;
+		o.g.real = opos;
+		first = (o.g.pos + LA_STRIDE - 1) >> LA_SHIFT;
+		last = (opos + nout + p->la_to + LA_STRIDE - 1) >> LA_SHIFT;
+		outbuf_region(c, &o.g.out, outlvl - 1 < c->c_maplvls,
+				la_ofs(outlvl - 1) +
+					first * sizeof(struct cola_la),
+				last - first, p->labuf, p->laelem);
+		outbuf_ring(&o.g.out, ring);
+	}
+
+	/* k-way merge in to output buffer */
+	outbuf_level(c, &o.out, outlvl, opos, nout, p->wrbuf, p->wrelem);
+	outbuf_ring(&o.out, ring);
+	lookup_init(&l, c);
+	p->kept = 0;
+	while(k) {
+		const struct cola_elem *e;
+		unsigned long next_in;
+
+#if MERGE_HEAP
+		next_in = h[1].val;
+#else
+		next_in = t[0].leaf;
+#endif
+		e = cur[next_in];
+
+		if ( !p->dedup ) {
+			if ( !merge_emit(p, &o, e) )
+				goto err;
+		}else if ( l.found && e->key == l.e.key ) {
+			/* an older copy */
+			if ( !l.done )
+				lookup_add(&l, e);
+		}else{
+			if ( l.found && !merge_fold(p, &o, &l) )
+				goto err;
+			lookup_init(&l, c);
+			lookup_add(&l, e);
+		}
+
+#if MERGE_HEAP
+		/* delete item from heap */
+		h[1] = h[k];
+		minheap_sift_down(k - 1, h);
+
+		cur[next_in] = inbuf_pop(c, &in[next_in]);
+		if ( cur[next_in] ) {
+			/* re-add to heap */
+			h[k].key = cur[next_in]->key;
+			h[k].val = next_in;
+			minheap_sift_up(k, h);
+		}else{
+			k--;
+		}
+#else
+		cur[next_in] = inbuf_pop(c, &in[next_in]);
+		if ( cur[next_in] ) {
+			t[0].key = cur[next_in]->key;
+		}else{
+			t[0].done = 1;
+			k--;
+		}
+		losertree_replay(p->k, t);
+#endif
+	}
+
+	if ( l.found && !merge_fold(p, &o, &l) )
+		goto err;
+
+	if ( !outbuf_finish(&o.out, c) )
+		goto err;
+
+	if ( outlvl ) {
+		for(; o.la; o.la = inbuf_pop(c, &o.la_in)) {
+			if ( !la_push(c, &o.g, o.la->key, 0) )
+				goto err;
+		}
+		if ( !outbuf_finish(&o.g.out, c) )
+			goto err;
+	}
+
+	ret = 1;
+	goto free_ring;
+err:
+	fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+free_ring:
+	/* drains anything still in flight on error */
+	ioring_free(ring);
+	return ret;
+}
+
+static void *merge_worker(void *priv)
+{
+	struct merge_part *p = priv;
+	p->ret = merge_part(p);
+	return NULL;
+}
+
+/* Cut a merge in to nr slices at splitter keys sampled evenly from the
+ * highest, and therefore biggest, input. Each slice starts at the lower
+ * bound of its splitter in every input so equal keys never straddle two.
+*/
+static int split_merge(struct _cola *c, const struct merge_part *whole,
+			struct merge_part *p, unsigned int nr)
+{
+	unsigned int big = whole->k - 1, i, j;
+	int mapped = whole->lvl[big] < c->c_maplvls;
+	cola_key_t bigofs = level_ofs(whole->lvl[big]);
+
+	p[0] = *whole;
+	for(j = 1; j < nr; j++) {
+		struct buf sk;
+		cola_key_t key;
+
+		p[j] = *whole;
+		if ( !read_part(c, mapped, bigofs, whole->to[big] * j / nr,
+				whole->to[big] * j / nr + 1, &sk) )
+			return 0;
+		key = sk.ptr->key;
+		buf_finish(&sk);
+
+		p[j].from[0] = search_lower_bound(whole->run, whole->to[0],
+							key);
+		for(i = 1; i < whole->k; i++) {
+			if ( !seek_region(c, whole->lvl[i] < c->c_maplvls,
+					level_ofs(whole->lvl[i]),
+					whole->to[i], key, p[j].from + i) )
+				return 0;
+		}
+		if ( !seek_region(c, whole->outlvl < c->c_maplvls,
+				la_ofs(whole->outlvl), whole->la_to,
+				key, &p[j].la_from) )
+			return 0;
+
+		memcpy(p[j - 1].to, p[j].from, sizeof(p[j].from));
+		p[j - 1].la_to = p[j].la_from;
+	}
+
+	return 1;
+}
+
+static int par_merge(struct _cola *c, struct merge_part *whole,
+			unsigned int nr)
+{
+	struct merge_part *p;
+	size_t rdsz, sz;
+	unsigned int i;
+	int ret = 0;
+
+	p = calloc(nr, sizeof(*p));
+	if ( NULL == p )
+		return 0;
+
+	if ( !split_merge(c, whole, p, nr) )
+		goto out;
+
+	rdsz = (whole->k + 1) * INBUF_BLOCKS * BLOCK_SIZE;
+	sz = rdsz + PART_WRBUF_SIZE + PART_LABUF_SIZE;
+	for(i = 0; i < nr; i++) {
+		p[i].rdbuf = malloc(sz);
+		if ( NULL == p[i].rdbuf )
+			goto out;
+		p[i].wrbuf = p[i].rdbuf + rdsz;
+		p[i].labuf = p[i].wrbuf + PART_WRBUF_SIZE;
+		p[i].wrelem = PART_WRBUF_SIZE / sizeof(struct cola_elem);
+		p[i].laelem = PART_LABUF_SIZE / sizeof(struct cola_elem);
+	}
+
+	dprintf(" - %u-way parallel merge\n", nr);
+	for(i = 1; i < nr; i++) {
+		if ( pthread_create(&p[i].thread, NULL, merge_worker, p + i) )
+			p[i].thread = 0;
+	}
+
+	ret = merge_part(p);
+	for(i = 1; i < nr; i++) {
+		if ( p[i].thread )
+			pthread_join(p[i].thread, NULL);
+		else
+			merge_worker(p + i);
+		if ( !p[i].ret )
+			ret = 0;
+	}
+
+	/* slices which dropped entries leave gaps, close them up */
+	whole->kept = p[0].kept;
+	for(i = 1; ret && i < nr; i++) {
+		cola_key_t opos = 0;
+		unsigned int j;
+
+		for(j = 0; j < p[i].k; j++)
+			opos += p[i].from[j];
+
+		if ( opos != whole->kept ) {
+			ret = move_region(c, level_ofs(whole->outlvl) +
+					whole->kept * sizeof(struct cola_elem),
+				level_ofs(whole->outlvl) +
+					opos * sizeof(struct cola_elem),
+				p[i].kept, NULL, 0);
+		}
+		whole->kept += p[i].kept;
+	}
+
+out:
+	for(i = 0; i < nr; i++)
+		free(p[i].rdbuf);
+	free(p);
+	return ret;
+}
+
+#define MERGE_DEDUP	(1U << 0)
+#define MERGE_GC	(1U << 1)
+
+/* Merge a sorted run and every level in lvlmask in to outlvl, see merge_part()
+ * for the flags. *kept gets the number of entries which were written.
+*/
+static int level_cold(struct _cola *c, unsigned int lvlno)
+{
+	return c->c_rss && level_ofs(lvlno + 1) > c->c_rss;
+}
+
+enum {
+	ADVISE_IN,
+	ADVISE_OUT,
+	ADVISE_DONE,
+};
+
+/* Merges read their inputs in order and write their output in order, after
+ * which the levels go back to random access for lookups, and if they're cold,
+ * see cola_map_budget(), their pages are dropped. The whole mapping has to
+ * end up with the same advice or it can't be remapped. The hints only cover
+ * whole blocks of the entries, and only range hints go to the file since the
+ * others would apply to all of it.
+*/
+static void advise(struct _cola *c, unsigned int lvlno, int how)
+{
+	int mapped = lvlno < c->c_maplvls;
+	cola_key_t ofs, end, len;
+
+	if ( lvlno < ADVISE_MIN_LEVEL )
+		return;
+
+	ofs = (level_ofs(lvlno) + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1ULL);
+	end = la_ofs(lvlno) & ~(BLOCK_SIZE - 1ULL);
+	if ( end <= ofs )
+		return;
+	len = end - ofs;
+
+	switch(how) {
+	case ADVISE_IN:
+		if ( mapped )
+			madvise(c->c_map + ofs, len, MADV_SEQUENTIAL);
+		if ( len > ADVISE_AHEAD )
+			len = ADVISE_AHEAD;
+		if ( mapped )
+			madvise(c->c_map + ofs, len, MADV_WILLNEED);
+		else
+			posix_fadvise(c->c_fd, ofs, len, POSIX_FADV_WILLNEED);
+		break;
+	case ADVISE_OUT:
+		if ( mapped )
+			madvise(c->c_map + ofs, len, MADV_SEQUENTIAL);
+		break;
+	case ADVISE_DONE:
+		if ( mapped )
+			madvise(c->c_map + ofs, len, MADV_RANDOM);
+		if ( !level_cold(c, lvlno) )
+			break;
+		if ( mapped )
+			madvise(c->c_map + ofs, len, MADV_DONTNEED);
+		posix_fadvise(c->c_fd, ofs, len, POSIX_FADV_DONTNEED);
+		break;
+	}
+}
+
+static void advise_merge(struct _cola *c, cola_key_t lvlmask,
+				unsigned int outlvl, int how)
+{
+	unsigned int lvl;
+
+	for(lvl = ADVISE_MIN_LEVEL; lvlmask >> lvl; lvl++) {
+		if ( lvlmask & (1ULL << lvl) )
+			advise(c, lvl, (how == ADVISE_OUT) ? ADVISE_IN : how);
+	}
+	advise(c, outlvl, how);
+}
+
+static int merge(struct _cola *c, const struct cola_elem *run,
+			cola_key_t nrun, cola_key_t lvlmask,
+			unsigned int outlvl, unsigned int flags,
+			cola_key_t *kept)
+{
+	struct merge_part whole;
+	unsigned int lvl;
+	uint64_t t0;
+	int ret;
+
+	t0 = stat_clock(c);
+	whole.c = c;
+	whole.run = run;
+	whole.outlvl = outlvl;
+	whole.from[0] = 0;
+	whole.to[0] = nrun;
+	for(whole.k = 1, lvl = 0; lvlmask >> lvl; lvl++) {
+		if ( !(lvlmask & (1ULL << lvl)) )
+			continue;
+		whole.lvl[whole.k] = lvl;
+		whole.from[whole.k] = 0;
+		whole.to[whole.k] = 1ULL << lvl;
+		whole.k++;
+	}
+	whole.kept = 0;
+	whole.la_from = 0;
+	whole.la_to = c->c_lalen[outlvl];
+	whole.dedup = !!(flags & (MERGE_DEDUP | MERGE_GC));
+	whole.gc = !!(flags & MERGE_GC);
+
+	if ( !level_mapped(c, outlvl) && !alloc_buffers(c) ) {
+		return 0;
+	}
+
+	whole.bloom = bloom_init(c, outlvl);
+	if ( NULL == whole.bloom )
+		return 0;
+
+	advise_merge(c, lvlmask, outlvl, ADVISE_OUT);
+
+	/* slices of a packed level can't be written in place, and the gaps
+	 * between them are closed up as if the level was in one piece
+	*/
+	if ( c->c_nthreads > 1 && outlvl >= PAR_MERGE_LEVEL && whole.k > 1 &&
+			!level_packed(c, outlvl) && !level_cols(c, outlvl) ) {
+		whole.bloom_atomic = 1;
+		ret = par_merge(c, &whole, c->c_nthreads);
+	}else{
+		whole.rdbuf = c->c_buf;
+		whole.wrbuf = c->c_wrbuf;
+		whole.labuf = c->c_labuf;
+		whole.wrelem = WRBUF_ELEM;
+		whole.laelem = LABUF_ELEM;
+		whole.bloom_atomic = 0;
+		ret = merge_part(&whole);
+	}
+
+	if ( kept )
+		*kept = whole.kept;
+	ret = bloom_finish(c, outlvl, whole.bloom, ret);
+	advise_merge(c, lvlmask, outlvl, ADVISE_DONE);
+	if ( !ret )
+		return 0;
+
+	if ( unlikely(c->c_stats) ) {
+		stat_add(c, level[outlvl].merges, 1);
+		stat_add(c, level[outlvl].merged, whole.kept);
+		stat_add(c, level[outlvl].bytes,
+			whole.kept * sizeof(struct cola_elem));
+		stat_add(c, level[outlvl].nsec, stat_clock(c) - t0);
+	}
+	return 1;
+}
+
+/* move_region() for when either level is packed or split in to columns,
+ * entries [pos, pos + 2^i) of outlvl go to level i
+*/
+static int spill_packed(struct _cola *c, unsigned int i, unsigned int outlvl,
+			cola_key_t pos, uint8_t *f)
+{
+	const struct cola_elem *e;
+	uint8_t *bufptr = c->c_buf;
+	struct outbuf out;
+	struct inbuf in;
+	cola_key_t n;
+
+	inbuf_level(c, &in, outlvl, pos, 1ULL << i, &bufptr);
+	outbuf_level(c, &out, i, 0, 1ULL << i, c->c_wrbuf, WRBUF_ELEM);
+	for(n = 0; (e = inbuf_pop(c, &in)); n++) {
+		bloom_add(f, i, e->key, 0);
+		if ( !outbuf_push(&out, c, e) )
+			goto err;
+	}
+
+	if ( n != (1ULL << i) ) {
+		fprintf(stderr, "%s: read: %s\n",
+			cmd, os_err2("File truncated"));
+		return 0;
+	}
+	if ( !outbuf_finish(&out, c) )
+		goto err;
+	return 1;
+err:
+	fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+	return 0;
+}
+
+/* After a merge has dropped entries, the survivors no longer fill the output
+ * level. Spread them over the levels given by the bits of their count, which
+ * are all below the output and empty. They go smallest level first so that
+ * copies of a key which straddle two levels stay newest first. If the output
+ * was the top level, the space taken by it and above is given back to the
+ * filesystem, see trim().
+*/
+static int spill(struct _cola *c, unsigned int outlvl, cola_key_t nelem,
+			int top)
+{
+	cola_key_t pos = 0;
+	unsigned int i;
+
+	dprintf(" - spill %"PRIu64" from level %u\n", nelem, outlvl);
+
+	for(i = 0; i < outlvl; i++) {
+		uint8_t *f;
+		int ret;
+
+		if ( !(nelem & (1ULL << i)) )
+			continue;
+
+		f = bloom_init(c, i);
+		if ( NULL == f )
+			return 0;
+		if ( level_packed(c, outlvl) || level_cols(c, outlvl) ) {
+			ret = spill_packed(c, i, outlvl, pos, f);
+		}else{
+			ret = move_region(c, level_ofs(i), level_ofs(outlvl) +
+						pos * sizeof(struct cola_elem),
+					1ULL << i, f, i);
+		}
+		if ( !bloom_finish(c, i, f, ret) )
+			return 0;
+		pos += 1ULL << i;
+
+		stat_add(c, level[i].spills, 1);
+		stat_add(c, level[i].spilled, 1ULL << i);
+		stat_add(c, level[i].bytes, sizeof(struct cola_elem) << i);
+	}
+
+	if ( top )
+		c->c_trim = outlvl + 1;
+
+	return 1;
+}
+
+/* rebuild the lookahead array of a level from the two above it */
+static int build_la(struct _cola *c, unsigned int lvlno)
+{
+	const struct cola_elem *real, *la;
+	struct inbuf real_in, la_in;
+	struct la_gen g;
+
+	dprintf(" - lookahead for level %u\n", lvlno);
+
+	init_bufs(c);
+	inbuf_level(c, &real_in, lvlno + 1, 0, level_nelem(c, lvlno + 1),
+			&c->c_bufptr);
+	inbuf_la(c, &la_in, lvlno + 1);
+	la_gen_init(c, &g, lvlno, c->c_lalen[lvlno]);
+
+	real = inbuf_pop(c, &real_in);
+	la = inbuf_pop(c, &la_in);
+	while ( real || la ) {
+		if ( la && (!real || la->key < real->key) ) {
+			if ( !la_push(c, &g, la->key, 0) )
+				goto err;
+			la = inbuf_pop(c, &la_in);
+		}else{
+			if ( !la_push(c, &g, real->key, 1) )
+				goto err;
+			real = inbuf_pop(c, &real_in);
+		}
+	}
+
+	assert(g.pos == c->c_lalen[lvlno + 1] + level_nelem(c, lvlno + 1));
+	if ( !outbuf_flush(&g.out, c) )
+		goto err;
+	return 1;
+err:
+	fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+	return 0;
+}
+
+/* whether the last commit still refers to level lvlno */
+static int committed(struct _cola *c, unsigned int lvlno)
+{
+	const struct cola_hdr *h = &c->c_commit;
+
+	if ( h->h_nelem & (1ULL << lvlno) )
+		return 1;
+	return h->h_short && h->h_shortlvl == lvlno;
+}
+
+/* ... or to any level below it */
+static int committed_below(struct _cola *c, unsigned int lvlno)
+{
+	const struct cola_hdr *h = &c->c_commit;
+
+	if ( h->h_nelem & ((1ULL << lvlno) - 1) )
+		return 1;
+	return h->h_short && h->h_shortlvl < lvlno;
+}
+
+/* ... or to it or any level above it */
+static int committed_above(struct _cola *c, unsigned int lvlno)
+{
+	const struct cola_hdr *h = &c->c_commit;
+
+	if ( h->h_nelem >> lvlno )
+		return 1;
+	return h->h_short && h->h_shortlvl >= lvlno;
+}
+
+/* Punch out level c_trim - 1 and everything above it, unless it's in use
+ * again, once the last commit no longer refers to any of it.
+*/
+static void trim(struct _cola *c)
+{
+	unsigned int lvlno;
+
+	if ( !c->c_trim )
+		return;
+
+	lvlno = c->c_trim - 1;
+	if ( !(c->c_nelem >> lvlno) ) {
+		if ( committed_above(c, lvlno) )
+			return;
+		settle(c);
+		if ( fallocate(c->c_fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				level_ofs(lvlno),
+				level_ofs(c->c_nxtlvl) - level_ofs(lvlno)) ) {
+			dprintf(" - punch hole: %s\n", os_err());
+		}
+	}
+
+	c->c_trim = 0;
+}
+
+/* Could the levels from b up be committed on their own? They have to hold
+ * every item logged before *lsn and the levels below only later ones.
+*/
+static int commit_point(struct _cola *c, unsigned int b, uint64_t *lsn)
+{
+	cola_key_t hi = c->c_nelem & ~((1ULL << b) - 1);
+	cola_key_t lo = c->c_nelem & ((1ULL << b) - 1);
+	unsigned int i;
+
+	if ( !hi ) {
+		*lsn = c->c_lsn;
+		return !lo;
+	}
+
+	*lsn = c->c_range[ctz64(hi)].end;
+	for(i = 0; lo >> i; i++) {
+		if ( (lo & (1ULL << i)) && c->c_range[i].first < *lsn )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Make the levels from about WAL_LEVEL up durable as they are now, and drop
+ * the log records that they hold. The data is synced before the header that
+ * refers to it is written, and from then on nothing that the header refers
+ * to may be overwritten until another commit has been made: writers check
+ * committed() first. The lower levels are left to the log so small merges
+ * never have to commit.
+ *
+ * A merge which comes up short commits its output, with c_short set, before
+ * the survivors are spilled in to levels that the last commit may refer to,
+ * and recovery finishes the spill. With clean set, everything is committed
+ * and the lookahead arrays are known to be good.
+*/
+static int commit(struct _cola *c, int clean)
+{
+	struct cola_hdr hdr;
+	unsigned int b;
+	uint64_t lsn;
+
+	b = (clean) ? 0 : WAL_LEVEL;
+	while ( !commit_point(c, b, &lsn) || lsn < c->c_commit.h_lsn )
+		b--;
+
+	dprintf(" - commit levels %u and up, log from %"PRIu64"\n", b, lsn);
+
+	if ( (c->c_map && msync(c->c_map, c->c_mapsz, MS_SYNC)) ||
+			fdatasync(c->c_fd) ) {
+		fprintf(stderr, "%s: sync: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.h_nelem = c->c_nelem & ~((1ULL << b) - 1);
+	hdr.h_seq = c->c_commit.h_seq + 1;
+	hdr.h_lsn = lsn;
+	if ( c->c_short && c->c_shortlvl >= b ) {
+		hdr.h_short = c->c_short;
+		hdr.h_shortlvl = c->c_shortlvl;
+	}
+	hdr.h_clean = clean;
+	hdr.h_packlvl = c->c_packlvl;
+	hdr.h_collvl = c->c_collvl;
+	if ( !write_header(c, &hdr) )
+		return 0;
+
+	c->c_commit = hdr;
+	trim(c);
+	return wal_truncate(c->c_wal, lsn);
+}
+
+static int insert_run(struct _cola *c, const struct cola_elem *run,
+			cola_key_t nrun, const struct lsn_range *span);
+static int dump(struct _cola *c);
+
+static void *bg_worker(void *priv)
+{
+	struct bg_merge *bg = priv;
+	struct _cola *c = &bg->c;
+	unsigned int i;
+
+	bg->ret = merge(c, bg->run, bg->nrun, bg->lvlmask, bg->outlvl,
+			0, NULL);
+	for(i = bg->outlvl; bg->ret && i-- > 1; )
+		bg->ret = build_la(c, i - 1);
+
+	__atomic_store_n(&bg->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int bg_done(struct _cola *c)
+{
+	return __atomic_load_n(&c->c_bg->done, __ATOMIC_ACQUIRE);
+}
+
+static int bg_start(struct _cola *c, const struct cola_elem *run,
+			cola_key_t nrun, cola_key_t lvlmask,
+			unsigned int outlvl)
+{
+	struct bg_merge *bg;
+	int err;
+
+	/* nothing that the worker allocates is visible to the handle */
+	if ( !level_mapped(c, outlvl) && !alloc_buffers(c) )
+		return 0;
+
+	bg = calloc(1, sizeof(*bg));
+	if ( NULL == bg )
+		return 0;
+
+	bg->run = malloc(nrun * sizeof(*bg->run));
+	if ( NULL == bg->run ) {
+		free(bg);
+		return 0;
+	}
+
+	memcpy(bg->run, run, nrun * sizeof(*bg->run));
+	bg->nrun = nrun;
+	bg->lvlmask = lvlmask;
+	bg->outlvl = outlvl;
+
+	bg->c = *c;
+	bg->c.c_nelem = (c->c_nelem & ~lvlmask) | (1ULL << outlvl);
+	bg->c.c_bg = NULL;
+	bg->c.c_shadow = NULL;
+	bg->c.c_bglvl = 0;
+	calc_lalen(&bg->c);
+
+	dprintf(" - background merge in to level %u\n", outlvl);
+	err = pthread_create(&bg->thread, NULL, bg_worker, bg);
+	if ( err ) {
+		fprintf(stderr, "%s: pthread_create: %s\n",
+			cmd, os_error(err));
+		free(bg->run);
+		free(bg);
+		return 0;
+	}
+
+	c->c_bg = bg;
+	return 1;
+}
+
+/* Copy the shadow levels in to the levels below the background merge, which
+ * are all empty now. The lookahead arrays down to the top of the shadow were
+ * built by the worker and are still right, those below need rebuilding.
+*/
+static int shadow_flush(struct _cola *c)
+{
+	struct _cola *s = c->c_shadow;
+	unsigned int i;
+
+	if ( !s->c_nelem )
+		return 1;
+
+	for(i = 0; s->c_nelem >> i; i++) {
+		struct buf level;
+		int ret;
+
+		if ( !level_live(s, i) )
+			continue;
+		if ( !read_level(s, i, &level) )
+			return 0;
+		ret = write_level(c, i, level.ptr, level.nelem);
+		buf_finish(&level);
+		if ( !ret )
+			return 0;
+		c->c_range[i] = s->c_range[i];
+	}
+
+	c->c_nelem += s->c_nelem;
+	calc_lalen(c);
+	for(i = cfls(s->c_nelem); i > 0; i--) {
+		if ( !build_la(c, i - 1) )
+			return 0;
+	}
+
+	s->c_nelem = 0;
+	calc_lalen(s);
+	return 1;
+}
+
+static int bg_finish(struct _cola *c)
+{
+	struct bg_merge *bg = c->c_bg;
+	int ret;
+
+	if ( NULL == bg )
+		return 1;
+
+	pthread_join(bg->thread, NULL);
+	c->c_bg = NULL;
+
+	ret = bg->ret;
+	if ( ret ) {
+		c->c_nelem = bg->c.c_nelem;
+		c->c_range[bg->outlvl] = bg->c.c_range[bg->outlvl];
+		calc_lalen(c);
+
+		/* the last commit may still refer to the levels below */
+		if ( committed_below(c, bg->outlvl) )
+			ret = commit(c, 0);
+		if ( ret )
+			ret = shadow_flush(c);
+	}
+
+	free(bg->run);
+	free(bg);
+	return ret;
+}
+
+/* the most of a run which can go in one carry and exactly fill the level that
+ * it ripples in to: what it takes to round the count up to a multiple of the
+ * biggest power of two that it can
+*/
+static cola_key_t carry_len(cola_key_t nelem, cola_key_t nrun)
+{
+	unsigned int i;
+
+	for(i = NUM_LEVELS - 1; i; i--) {
+		cola_key_t need = (1ULL << i) - (nelem & ((1ULL << i) - 1));
+		if ( need <= nrun )
+			return need;
+	}
+
+	return 1;
+}
+
+/* the first empty level with room for a run and everything below it */
+static unsigned int carry_level(cola_key_t nelem, cola_key_t nrun)
+{
+	unsigned int i;
+
+	for(i = 0; ; i++) {
+		cola_key_t below = (1ULL << i) - 1;
+
+		if ( !(nelem & (1ULL << i)) &&
+				(nelem & below) + nrun <= (1ULL << i) )
+			return i;
+	}
+}
+
+/* Add a sorted run as a carry in to the binary counter c_nelem which leaves
+ * nothing below the level that it ripples in to. That level gets the merge of
+ * the run and the old lower levels and so each affected level is written
+ * exactly once, unless the merge comes up short, because it folded copies or
+ * the run didn't fill it, and has to be spilled.
+*/
+static int carry(struct _cola *c, const struct cola_elem *run,
+			cola_key_t nrun, const struct lsn_range *span)
+{
+	cola_key_t newcnt, kept, below;
+	unsigned int outlvl, flags, i;
+	struct lsn_range r;
+	struct frozen f;
+	int spilled;
+
+	outlvl = carry_level(c->c_nelem, nrun);
+	below = (1ULL << outlvl) - 1;
+	newcnt = (c->c_nelem & ~below) | (1ULL << outlvl);
+	if ( !grow(c, newcnt) )
+		return 0;
+
+	if ( span ) {
+		r = *span;
+	}else{
+		r.first = c->c_lsn;
+		r.end = c->c_lsn + nrun;
+	}
+	for(i = 0; i < outlvl; i++) {
+		if ( level_live(c, i) && c->c_range[i].first < r.first )
+			r.first = c->c_range[i].first;
+	}
+
+	/* the output level is empty, but the last commit may refer to it */
+	if ( committed(c, outlvl) && !commit(c, 0) )
+		return 0;
+
+	/* a background merge has to fill its level, the levels below are
+	 * still being searched so there's nowhere to spill to
+	*/
+	if ( c->c_bglvl && outlvl >= c->c_bglvl &&
+			(c->c_nelem & below) + nrun == (1ULL << outlvl) ) {
+		if ( !bg_start(c, run, nrun, c->c_nelem & below, outlvl) )
+			return 0;
+		c->c_bg->c.c_range[outlvl] = r;
+		c->c_lsn = r.end;
+		return 1;
+	}
+
+	/* readers are moved off the lookahead arrays below outlvl and on to
+	 * the run and the input levels, before any of it is overwritten
+	*/
+	f.run = run;
+	f.nrun = nrun;
+	f.kept = 0;
+	f.outlvl = outlvl;
+	f.spilling = 0;
+	if ( outlvl ) {
+		if ( !publish(c, &f) )
+			return 0;
+		settle(c);
+	}
+
+	/* When everything ends up in the one level, nothing older can be
+	 * hidden by the dead entries and they can go too.
+	*/
+	flags = MERGE_DEDUP;
+	if ( !c->c_nogc && newcnt == (1ULL << outlvl) )
+		flags |= MERGE_GC;
+	if ( !merge(c, run, nrun, c->c_nelem & below, outlvl, flags, &kept) )
+		return 0;
+
+	c->c_range[outlvl] = r;
+	c->c_lsn = r.end;
+
+	spilled = (kept < (1ULL << outlvl));
+	if ( spilled ) {
+		f.run = NULL;
+		f.nrun = 0;
+		f.kept = kept;
+		f.spilling = 1;
+		if ( !publish(c, &f) )
+			return 0;
+		settle(c);
+
+		if ( committed_below(c, outlvl) ) {
+			c->c_nelem = (c->c_nelem & ~below) | (1ULL << outlvl);
+			c->c_short = kept;
+			c->c_shortlvl = outlvl;
+			if ( !commit(c, 0) )
+				return 0;
+			c->c_short = 0;
+		}
+		if ( !spill(c, outlvl, kept, flags & MERGE_GC) )
+			return 0;
+		for(i = 0; i < outlvl; i++)
+			c->c_range[i] = r;
+		newcnt -= (1ULL << outlvl) - kept;
+	}
+
+	c->c_nelem = newcnt;
+	calc_lalen(c);
+
+	/* the merge took care of the lookahead array below outlvl, unless it
+	 * spilled, the rest need rebuilding top down
+	*/
+	for(i = (spilled) ? outlvl + 1 : outlvl; i-- > 1; ) {
+		if ( !build_la(c, i - 1) )
+			return 0;
+	}
+
+	/* the run belongs to the caller */
+	if ( !publish(c, NULL) )
+		return 0;
+	if ( outlvl )
+		settle(c);
+	trim(c);
+
+	/* readers in other processes only see what's committed, and a shadow
+	 * has no log or header of its own to commit
+	*/
+	if ( c->c_wal && outlvl >= WAL_LEVEL && !commit(c, 0) )
+		return 0;
+
+	dprintf("\n");
+#if DEBUG
+	dump(c);
+	dprintf("\n");
+#endif
+	return 1;
+}
+
+/* Add a sorted run of items as a series of carries, biggest first, which
+ * each fill a level. The items are the ones logged from c_lsn on, in that
+ * order, unless span is given to cover them all. Then it's a single carry,
+ * which may spill, since the commit that a later carry might need could only
+ * count the items in an earlier one as logged after the whole span.
+*/
+static int insert_run(struct _cola *c, const struct cola_elem *run,
+			cola_key_t nrun, const struct lsn_range *span)
+{
+	while ( nrun ) {
+		cola_key_t n;
+
+		if ( c->c_bg ) {
+			struct _cola *s = c->c_shadow;
+			unsigned int outlvl = c->c_bg->outlvl;
+			int fits;
+
+			/* the shadow may only fill levels below the merge */
+			if ( span )
+				fits = carry_level(s->c_nelem, nrun) < outlvl;
+			else
+				fits = s->c_nelem + nrun < (1ULL << outlvl);
+			if ( !bg_done(c) && fits ) {
+				s->c_lsn = c->c_lsn;
+				if ( !insert_run(s, run, nrun, span) )
+					return 0;
+				c->c_lsn = s->c_lsn;
+				return 1;
+			}
+			if ( !bg_finish(c) )
+				return 0;
+		}
+
+		n = (span) ? nrun : carry_len(c->c_nelem, nrun);
+		if ( !carry(c, run, n, span) )
+			return 0;
+		run += n;
+		nrun -= n;
+	}
+
+	return 1;
+}
+
+/* Flush the write buffer as one sorted run. Its items were logged in no
+ * particular order so the carry covers all of them.
+ *
+ * Readers go from the buffer to a view with the sorted run in front of the
+ * levels in one step, and it's only cleared once they're all off that.
+*/
+static int mem_flush(struct _cola *c)
+{
+	const struct cola_elem *run;
+	struct lsn_range span;
+	struct frozen f;
+	cola_key_t nrun;
+	int ret;
+
+	if ( NULL == c->c_mem || !memtable_nelem(c->c_mem) )
+		return 1;
+
+	dprintf("flush %"PRIu64" buffered\n", memtable_nelem(c->c_mem));
+	stat_add(c, flushes, 1);
+
+	span.first = c->c_lsn;
+	span.end = c->c_lsn + c->c_memrec;
+
+	mem_lock(c, 1);
+	run = memtable_sort(c->c_mem, &nrun);
+	if ( run ) {
+		memset(&f, 0, sizeof(f));
+		f.run = run;
+		f.nrun = nrun;
+		ret = publish(c, &f);
+	}else{
+		ret = 0;
+	}
+	c->c_memoff = 1;
+	mem_unlock(c);
+
+	ret = ret && insert_run(c, run, nrun, &span);
+	if ( !ret )
+		publish(c, NULL);
+	settle(c);
+
+	/* the log still has them if it failed */
+	mem_lock(c, 1);
+	memtable_clear(c->c_mem);
+	c->c_memoff = 0;
+	mem_unlock(c);
+	c->c_memrec = 0;
+	if ( !ret )
+		return 0;
+
+	c->c_lsn = span.end;
+	return 1;
+}
+
+/* Add logged items to the write buffer, or go straight to the levels if it's
+ * no use, in which case the run has to be sorted.
+*/
+static int absorb(struct _cola *c, const struct cola_elem *run,
+			cola_key_t nrun)
+{
+	cola_key_t i;
+
+	if ( NULL == c->c_mem )
+		return insert_run(c, run, nrun, NULL);
+
+	if ( nrun >= memtable_size(c->c_mem) )
+		return mem_flush(c) && insert_run(c, run, nrun, NULL);
+
+	for(i = 0; i < nrun; i++) {
+		int full;
+
+		c->c_memrec++;
+		mem_lock(c, 1);
+		full = memtable_add(c->c_mem, run + i, c->c_merge);
+		mem_unlock(c);
+		if ( full && !mem_flush(c) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Finish any spill that a crash cut short, then rebuild every lookahead array
+ * since they're not covered by commits.
+*/
+static int recover(struct _cola *c)
+{
+	unsigned int i;
+
+	dprintf("recovering %"PRIu64" items\n", c->c_nelem);
+
+	if ( !alloc_buffers(c) )
+		return 0;
+
+	if ( c->c_commit.h_short ) {
+		unsigned int lvlno = c->c_commit.h_shortlvl;
+		cola_key_t kept = c->c_commit.h_short;
+
+		if ( !spill(c, lvlno, kept, !(c->c_nelem >> lvlno >> 1)) )
+			return 0;
+		c->c_nelem -= (1ULL << lvlno) - kept;
+	}
+
+	calc_lalen(c);
+	for(i = cfls(c->c_nelem); i > 0; i--) {
+		if ( !build_la(c, i - 1) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Open the log and, unless the cola is new, recover it if it wasn't closed
+ * cleanly and read in everything logged since the last commit to be replayed.
+ * The header is then marked as not clean until cola_close().
+*/
+static int wal_attach(struct _cola *c, const char *fn, int create)
+{
+	struct cola_elem *e = NULL;
+	size_t n = 0;
+	char *wfn;
+	int ret = 0;
+
+	if ( asprintf(&wfn, "%s.wal", fn) < 0 )
+		return 0;
+	c->c_wal = wal_open(wfn, create, c->c_lsn);
+	free(wfn);
+	if ( NULL == c->c_wal )
+		return 0;
+
+	/* anything synced to the log before the commit is in the levels */
+	if ( wal_lsn(c->c_wal) < c->c_lsn &&
+			!wal_truncate(c->c_wal, c->c_lsn) )
+		goto out;
+
+	if ( !wal_read(c->c_wal, c->c_lsn, &e, &n) )
+		goto out;
+	if ( n != wal_lsn(c->c_wal) - c->c_lsn ) {
+		fprintf(stderr, "%s: %s: log is missing items\n", cmd, fn);
+		goto out;
+	}
+
+	if ( !c->c_commit.h_clean && !recover(c) )
+		goto out;
+	if ( !commit(c, 0) )
+		goto out;
+
+	c->c_replay = e;
+	c->c_nreplay = n;
+	e = NULL;
+	ret = 1;
+out:
+	free(e);
+	if ( !ret ) {
+		wal_close(c->c_wal);
+		c->c_wal = NULL;
+	}
+	return ret;
+}
+
+/* The log is replayed on first use rather than by cola_open(), so that the
+ * merge operator has been set by then.
+*/
+static int replay(struct _cola *c)
+{
+	struct cola_elem *e = c->c_replay;
+	size_t i;
+
+	if ( NULL == e )
+		return 1;
+
+	dprintf("replaying %zu items\n", c->c_nreplay);
+	c->c_replay = NULL;
+	for(i = 0; i < c->c_nreplay; i++) {
+		if ( !absorb(c, e + i, 1) ) {
+			free(e);
+			return 0;
+		}
+	}
+
+	free(e);
+	return 1;
+}
+
+/* items are logged before they're added */
+static int insert_logged(struct _cola *c, const struct cola_elem *run,
+			cola_key_t nrun)
+{
+	int ret = 0;
+
+	writer_lock(c);
+	if ( !replay(c) )
+		goto out;
+	if ( c->c_wal && !wal_append(c->c_wal, run, nrun) )
+		goto out;
+	ret = absorb(c, run, nrun);
+out:
+	writer_unlock(c);
+	return ret;
+}
+
+int cola_put(cola_t c, cola_key_t key, cola_val_t val)
+{
+	struct cola_elem elem;
+
+	if ( val == COLA_TOMBSTONE ) {
+		fprintf(stderr, "%s: put: reserved value\n", cmd);
+		return 0;
+	}
+
+	dprintf("Insert key %"PRIu64"\n", key);
+
+	elem.key = key;
+	elem.val = val;
+	return insert_logged(c, &elem, 1);
+}
+
+/* A tombstone shadows any older copies of the key until they all meet in a
+ * merge in to the top level, which drops the lot.
+*/
+int cola_delete(cola_t c, cola_key_t key)
+{
+	struct cola_elem elem;
+
+	dprintf("Delete key %"PRIu64"\n", key);
+
+	elem.key = key;
+	elem.val = COLA_TOMBSTONE;
+	return insert_logged(c, &elem, 1);
+}
+
+int cola_insert(cola_t c, cola_key_t key)
+{
+	return cola_put(c, key, 0);
+}
+
+static int elem_cmp(const void *A, const void *B)
+{
+	const struct cola_elem *a = A, *b = B;
+
+	if ( a->key < b->key )
+		return -1;
+	if ( a->key > b->key )
+		return 1;
+	return 0;
+}
+
+int cola_insert_batch(cola_t c, const cola_key_t *keys, size_t n)
+{
+	struct cola_elem *run;
+	size_t i;
+	int ret;
+
+	if ( !n )
+		return 1;
+
+	run = malloc(n * sizeof(*run));
+	if ( NULL == run )
+		return 0;
+
+	for(i = 0; i < n; i++) {
+		run[i].key = keys[i];
+		run[i].val = 0;
+	}
+
+	qsort(run, n, sizeof(*run), elem_cmp);
+	ret = insert_logged(c, run, n);
+	free(run);
+	return ret;
+}
+
+/* A bulk load sorts its input in runs, in a memtable so that the copies of a
+ * key are folded as they arrive, and writes them all but the last to a
+ * temporary file. The runs are then merged, newest first, straight in to the
+ * levels that their count calls for, biggest first. The input may have held
+ * copies of a key in more than one run so the merge can come up short: the
+ * level it was writing is then spilled over the empty ones below it.
+*/
+struct load_run {
+	off_t ofs; /* in the temporary file */
+	cola_key_t left;
+	const struct cola_elem *cur;
+	const struct cola_elem *lim;
+	struct cola_elem *buf;
+	cola_key_t bufcnt;
+};
+
+struct load {
+	struct _cola *c;
+	struct memtable *m;
+	int fd;
+	off_t end;
+	struct load_run *run;
+	unsigned int nrun;
+	cola_key_t total;
+	/* output, level lvl has nout of its entries so far */
+	struct outbuf out;
+	uint8_t *bloom;
+	cola_key_t todo;
+	cola_key_t nout;
+	unsigned int lvl;
+};
+
+/* an unnamed file in dir, or one which is unlinked straight away */
+static int load_tmpfile(const char *dir)
+{
+	char path[4096];
+	int fd;
+
+	fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if ( fd >= 0 )
+		return fd;
+
+	snprintf(path, sizeof(path), "%s/.cola-load-XXXXXX", dir);
+	fd = mkstemp(path);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: load: %s: %s\n", cmd, dir, os_err());
+		return -1;
+	}
+
+	unlink(path);
+	return fd;
+}
+
+/* sort the memtable and, unless it's the only run, write it out */
+static int load_run_end(struct load *ld, const char *tmpdir, int last)
+{
+	const struct cola_elem *e;
+	struct load_run *r;
+	cola_key_t n;
+
+	if ( !memtable_nelem(ld->m) )
+		return 1;
+
+	e = memtable_sort(ld->m, &n);
+	if ( NULL == e )
+		return 0;
+
+	r = realloc(ld->run, (ld->nrun + 1) * sizeof(*r));
+	if ( NULL == r )
+		return 0;
+	ld->run = r;
+	r += ld->nrun++;
+	memset(r, 0, sizeof(*r));
+	r->left = n;
+	ld->total += n;
+
+	if ( last && ld->nrun == 1 ) {
+		r->cur = e;
+		r->lim = e + n;
+		return 1;
+	}
+
+	if ( ld->fd < 0 ) {
+		ld->fd = load_tmpfile(tmpdir);
+		if ( ld->fd < 0 )
+			return 0;
+	}
+
+	dprintf(" - load run %u, %"PRIu64" items\n", ld->nrun - 1, n);
+	if ( !fd_pwrite(ld->fd, ld->end, e, n * sizeof(*e)) ) {
+		fprintf(stderr, "%s: load: write: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	r->ofs = ld->end;
+	ld->end += n * sizeof(*e);
+	memtable_clear(ld->m);
+	return 1;
+}
+
+static int load_runs(struct load *ld, cola_feed_fn feed, void *priv,
+			const char *tmpdir)
+{
+	struct cola_elem e;
+	cola_key_t key;
+	cola_val_t val;
+	int ret;
+
+	while ( (ret = (*feed)(priv, &key, &val)) > 0 ) {
+		e.key = key;
+		e.val = val;
+		if ( val == COLA_TOMBSTONE ) {
+			fprintf(stderr, "%s: load: reserved value\n", cmd);
+			return 0;
+		}
+		if ( memtable_add(ld->m, &e, ld->c->c_merge) &&
+				!load_run_end(ld, tmpdir, 0) )
+			return 0;
+	}
+
+	return !ret && load_run_end(ld, tmpdir, 1);
+}
+
+static const struct cola_elem *load_pop(struct load *ld, struct load_run *r)
+{
+	if ( r->cur == r->lim ) {
+		cola_key_t cnt = (r->left < r->bufcnt) ? r->left : r->bufcnt;
+		size_t sz = cnt * sizeof(*r->buf);
+		int eof;
+
+		if ( !cnt )
+			return NULL;
+		if ( !fd_pread(ld->fd, r->ofs, r->buf, &sz, &eof) ||
+				sz != cnt * sizeof(*r->buf) ) {
+			fprintf(stderr, "%s: load: read: %s\n",
+				cmd, os_err2("File truncated"));
+			return NULL;
+		}
+
+		r->ofs += sz;
+		r->cur = r->buf;
+		r->lim = r->buf + cnt;
+	}
+
+	r->left--;
+	return r->cur++;
+}
+
+/* the entry goes in to the biggest level yet to be filled */
+static int load_push(struct load *ld, const struct cola_elem *e)
+{
+	struct _cola *c = ld->c;
+
+	if ( !ld->nout ) {
+		ld->lvl = cfls(ld->todo);
+		ld->bloom = bloom_init(c, ld->lvl);
+		if ( NULL == ld->bloom )
+			return 0;
+		outbuf_level(c, &ld->out, ld->lvl, 0, 1ULL << ld->lvl,
+				c->c_wrbuf, WRBUF_ELEM);
+	}
+
+	bloom_add(ld->bloom, ld->lvl, e->key, 0);
+	if ( !outbuf_push(&ld->out, c, e) ) {
+		fprintf(stderr, "%s: write: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	if ( ++ld->nout < (1ULL << ld->lvl) )
+		return 1;
+
+	ld->nout = 0;
+	ld->todo &= ~(1ULL << ld->lvl);
+	c->c_nelem |= 1ULL << ld->lvl;
+	return bloom_finish(c, ld->lvl, ld->bloom, outbuf_finish(&ld->out, c));
+}
+
+/* finish off a level which the merge didn't fill */
+static int load_short(struct load *ld)
+{
+	struct _cola *c = ld->c;
+	cola_key_t n = ld->nout;
+
+	ld->nout = 0;
+	if ( !bloom_finish(c, ld->lvl, ld->bloom, outbuf_finish(&ld->out, c)) )
+		return 0;
+	if ( !spill(c, ld->lvl, n, 0) )
+		return 0;
+
+	c->c_nelem |= n;
+	return 1;
+}
+
+/* merge the runs, folding the copies of each key newest first */
+static int load_merge(struct load *ld, size_t mem)
+{
+	struct _cola *c = ld->c;
+	const struct cola_elem **cur;
+	struct tourn_node *t, *leaf;
+	struct cola_elem *bufs = NULL;
+	cola_key_t bufcnt;
+	struct lookup l;
+	unsigned int i, k;
+	int ret = 0;
+
+	t = calloc(ld->nrun, sizeof(*t));
+	leaf = calloc(ld->nrun, sizeof(*leaf));
+	cur = calloc(ld->nrun, sizeof(*cur));
+	if ( NULL == t || NULL == leaf || NULL == cur )
+		goto out;
+
+	/* the runs on file share what the memtable had */
+	if ( ld->fd >= 0 ) {
+		bufcnt = mem / ld->nrun;
+		if ( bufcnt < LOAD_RDBUF )
+			bufcnt = LOAD_RDBUF;
+		bufcnt /= sizeof(*bufs);
+		bufs = malloc(ld->nrun * bufcnt * sizeof(*bufs));
+		if ( NULL == bufs )
+			goto out;
+		for(i = 0; i < ld->nrun; i++) {
+			ld->run[i].buf = bufs + i * bufcnt;
+			ld->run[i].bufcnt = bufcnt;
+		}
+	}
+
+	/* later runs are newer, and lower leaves win ties */
+	for(i = k = 0; i < ld->nrun; i++) {
+		struct load_run *r = ld->run + (ld->nrun - 1 - i);
+
+		cur[i] = load_pop(ld, r);
+		leaf[i].leaf = i;
+		leaf[i].done = (NULL == cur[i]);
+		leaf[i].key = (cur[i]) ? cur[i]->key : 0;
+		if ( cur[i] )
+			k++;
+	}
+	losertree_init(ld->nrun, t, leaf);
+
+	lookup_init(&l, c);
+	while ( k ) {
+		unsigned int next_in = t[0].leaf;
+		const struct cola_elem *e = cur[next_in];
+
+		if ( l.found && e->key == l.e.key ) {
+			if ( !l.done )
+				lookup_add(&l, e);
+		}else{
+			if ( l.found && !load_push(ld, &l.e) )
+				goto out;
+			lookup_init(&l, c);
+			lookup_add(&l, e);
+		}
+
+		cur[next_in] = load_pop(ld, ld->run + (ld->nrun - 1 - next_in));
+		if ( cur[next_in] ) {
+			t[0].key = cur[next_in]->key;
+		}else{
+			if ( ld->run[ld->nrun - 1 - next_in].left )
+				goto out;
+			t[0].done = 1;
+			k--;
+		}
+		losertree_replay(ld->nrun, t);
+	}
+
+	if ( l.found && !load_push(ld, &l.e) )
+		goto out;
+	if ( ld->nout && !load_short(ld) )
+		goto out;
+
+	ret = 1;
+out:
+	free(bufs);
+	free(cur);
+	free(leaf);
+	free(t);
+	return ret;
+}
+
+int cola_bulk_load(cola_t c, cola_feed_fn feed, void *priv, size_t mem,
+			const char *tmpdir)
+{
+	struct load ld;
+	cola_key_t size;
+	unsigned int i;
+	int ret = 0;
+
+	if ( !c->c_rw )
+		return 0;
+	if ( !mem )
+		mem = LOAD_MEM;
+
+	/* each entry takes two hash slots as well */
+	size = mem / (sizeof(struct cola_elem) + 2 * sizeof(uint32_t));
+	size = (size < 2) ? 1 : (1ULL << log2_floor64(size));
+	if ( size > (1ULL << 31) )
+		size = 1ULL << 31;
+
+	memset(&ld, 0, sizeof(ld));
+	ld.c = c;
+	ld.fd = -1;
+	ld.m = memtable_new(size);
+	if ( NULL == ld.m )
+		return 0;
+
+	writer_lock(c);
+	if ( !replay(c) || !bg_finish(c) )
+		goto out;
+	if ( c->c_nelem || (c->c_mem && memtable_nelem(c->c_mem)) ) {
+		fprintf(stderr, "%s: load: the cola isn't empty\n", cmd);
+		goto out;
+	}
+
+	if ( !load_runs(&ld, feed, priv, tmpdir) )
+		goto out;
+
+	dprintf("load %"PRIu64" items in %u runs\n", ld.total, ld.nrun);
+	if ( ld.fd >= 0 ) {
+		memtable_free(ld.m);
+		ld.m = NULL;
+	}
+
+	ld.todo = ld.total;
+	if ( !grow(c, ld.total) || !alloc_buffers(c) ||
+			!load_merge(&ld, mem) ) {
+		c->c_nelem = 0;
+		calc_lalen(c);
+		goto out;
+	}
+
+	/* nothing that was loaded is in the log */
+	calc_lalen(c);
+	for(i = 0; c->c_nelem >> i; i++) {
+		c->c_range[i].first = c->c_lsn;
+		c->c_range[i].end = c->c_lsn;
+	}
+	for(i = cfls(c->c_nelem); i > 0; i--) {
+		if ( !build_la(c, i - 1) )
+			goto out;
+	}
+
+	ret = commit(c, 1) && publish(c, NULL);
+out:
+	writer_unlock(c);
+	if ( ld.fd >= 0 )
+		close(ld.fd);
+	memtable_free(ld.m);
+	free(ld.run);
+	return ret;
+}
+
+/* Search the first nelem entries of a level for the copies of the key,
+ * newest first, given that its lower bound is within [lo, hi].
+*/
+static int query_level(struct _cola *c, cola_key_t key,
+			unsigned int lvlno, cola_key_t nelem, struct lookup *l,
+			cola_key_t lo, cola_key_t hi)
+{
+	struct buf level;
+	cola_key_t t;
+
+	l->probes++;
+	stat_add(c, level[lvlno].probes, 1);
+
+	if ( !narrow_level(c, lvlno, key, &lo, &hi) )
+		return 0;
+	if ( hi < nelem )
+		hi++;
+
+	dprintf("bsearch level %u (%"PRIu64":%"PRIu64")\n", lvlno, lo, hi);
+	if ( !read_level_part(c, lvlno, lo, hi, &level) )
+		return 0;
+
+	/* the window holds the lower bound, but with a merge operator the
+	 * copies after it may run on past the end
+	*/
+	t = search_lower_bound(level.ptr, level.nelem, key);
+	for(;;) {
+		for(; t < level.nelem && level.ptr[t].key == key; t++) {
+			if ( lookup_add(l, level.ptr + t) )
+				goto out;
+		}
+
+		lo += level.nelem;
+		if ( t < level.nelem || lo >= nelem )
+			break;
+
+		hi = (nelem - lo > WIN_ELEM) ? lo + WIN_ELEM : nelem;
+		buf_finish(&level);
+		if ( !read_level_part(c, lvlno, lo, hi, &level) )
+			return 0;
+		t = 0;
+	}
+
+out:
+	buf_finish(&level);
+	return 1;
+}
+
+/* Search a level's lookahead array, given the lower bound of the key within
+ * it is in [*la, *lb], for the entries which bracket the key. That gives the
+ * same windows for the next level up and its lookahead array.
+*/
+static int query_la(struct _cola *c, cola_key_t key, unsigned int lvlno,
+			cola_key_t *ra, cola_key_t *rb,
+			cola_key_t *la, cola_key_t *lb)
+{
+	cola_key_t from, to, t, n, p1, p2, r1, r2;
+	const struct cola_la *e;
+	struct buf win;
+
+	if ( lvlno >= c->c_maplvls &&
+			!narrow(c, la_ofs(lvlno), key, la, lb) )
+		return 0;
+
+	from = (*la) ? *la - 1 : 0;
+	to = *lb + 1;
+	if ( to > c->c_lalen[lvlno] )
+		to = c->c_lalen[lvlno];
+
+	if ( !read_la_part(c, lvlno, from, to, &win) )
+		return 0;
+
+	/* entries are indexed relative to the start of the window */
+	e = (const struct cola_la *)win.ptr;
+	for(t = *la, n = *lb - *la; n; ) {
+		cola_key_t i = n / 2;
+		if ( e[t + i - from].key < key ) {
+			t = t + (i + 1);
+			n = n - (i + 1);
+		}else{
+			n = i;
+		}
+	}
 
-		initial = (1U << (INITIAL_LEVELS + 1)) - 1;
-		initial *= sizeof(struct cola_elem);
-		initial += sizeof(hdr);
-		if ( posix_fallocate(c->c_fd, 0, initial) ) {
-			fprintf(stderr, "%s: %s: fallocate: %s\n",
-				cmd, fn, os_err());
+	if ( t ) {
+		p1 = (t - 1) << LA_SHIFT;
+		r1 = e[t - 1 - from].real;
+	}else{
+		p1 = r1 = 0;
+	}
+
+	if ( t < c->c_lalen[lvlno] ) {
+		p2 = t << LA_SHIFT;
+		r2 = e[t - from].real;
+	}else{
+		r2 = level_nelem(c, lvlno + 1);
+		p2 = r2 + c->c_lalen[lvlno + 1];
+	}
+
+	dprintf(" - lookahead %u [%"PRIu64":%"PRIu64"] -> %"PRIu64"\n",
+		lvlno, *la, *lb, t);
+
+	*ra = r1;
+	*rb = r2;
+	*la = p1 - r1;
+	*lb = p2 - r2;
+
+	buf_finish(&win);
+	return 1;
+}
+
+/* Search the levels in mask from lvlno, and therefore newest, up. Empty
+ * levels still hold whatever was last merged out of them so they must never
+ * be searched, but their lookahead arrays are always valid.
+*/
+static int cascade(struct _cola *c, cola_key_t key, unsigned int lvlno,
+			cola_key_t mask,
+			cola_key_t ra, cola_key_t rb,
+			cola_key_t la, cola_key_t lb,
+			struct lookup *l)
+{
+	unsigned int top;
+
+	top = cfls(mask);
+	if ( !mask || lvlno > top )
+		return 1;
+
+	for(;; lvlno++) {
+		if ( mask & (1ULL << lvlno) ) {
+			if ( !query_level(c, key, lvlno, 1ULL << lvlno, l,
+						ra, rb) )
+				return 0;
+			if ( l->done )
+				return 1;
 		}
+
+		if ( lvlno == top )
+			break;
+
+		if ( !query_la(c, key, lvlno, &ra, &rb, &la, &lb) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* search the levels of a view with a carry in progress, see struct frozen */
+static int query_frozen(struct _cola *c, const struct frozen *f,
+			cola_key_t key, struct lookup *l)
+{
+	const struct cola_elem *p, *end;
+	cola_key_t mask;
+	unsigned int i;
+
+	end = f->run + f->nrun;
+	p = f->run + search_lower_bound(f->run, f->nrun, key);
+	for(; p < end && p->key == key; p++) {
+		if ( lookup_add(l, p) )
+			return 1;
+	}
+
+	if ( f->spilling ) {
+		int maybe;
+
+		if ( !bloom_test(c, f->outlvl, key, &maybe) )
+			return 0;
+		if ( maybe && !query_level(c, key, f->outlvl, f->kept, l,
+						0, f->kept) )
+			return 0;
+		if ( l->done )
+			return 1;
+		if ( !bloom_levels(c, key, f->outlvl, &mask) )
+			return 0;
 	}else{
-		sz = sizeof(hdr);
-		if ( !fd_read(c->c_fd, &hdr, &sz, &eof) || sz != sizeof(hdr) ) {
-			fprintf(stderr, "%s: read: %s: %s\n",
-				cmd, fn, os_err2("File truncated"));
-			goto out_close;
+		if ( !bloom_levels(c, key, 0, &mask) )
+			return 0;
+
+		for(i = 0; i < f->outlvl; i++) {
+			if ( !(mask & (1ULL << i)) )
+				continue;
+			if ( !query_level(c, key, i, 1ULL << i, l,
+						0, 1ULL << i) )
+				return 0;
+			if ( l->done )
+				return 1;
+		}
+	}
+
+	return cascade(c, key, f->outlvl, mask, 0, 0,
+			0, c->c_lalen[f->outlvl], l);
+}
+
+/* The lookahead arrays aren't covered by commits, so a reader can't use them
+ * while the file is open for writing, and searches every level in full.
+*/
+static int query_committed(struct _cola *c, cola_key_t key, struct lookup *l)
+{
+	unsigned int i;
+
+	for(i = 0; c->c_nelem >> i; i++) {
+		cola_key_t n = level_len(c, i);
+		int maybe;
+
+		if ( !level_live(c, i) )
+			continue;
+		if ( !bloom_test(c, i, key, &maybe) )
+			return 0;
+		if ( !maybe )
+			continue;
+		if ( !query_level(c, key, i, n, l, 0, n) )
+			return 0;
+		if ( l->done )
+			return 1;
+	}
+
+	return 1;
+}
+
+static int query(struct _cola *c, cola_key_t key, struct lookup *l)
+{
+	unsigned int top;
+	cola_key_t mask;
+
+	/* While a background merge runs the lookahead arrays below it are
+	 * being rewritten. Search the shadow, then the run being merged and the
+	 * frozen input levels in full, then pick up the cascade from the
+	 * merge's output level whose own lookahead array is untouched.
+	*/
+	if ( c->c_bg ) {
+		struct bg_merge *bg = c->c_bg;
+		struct frozen f;
+
+		if ( !query(c->c_shadow, key, l) )
+			return 0;
+		if ( l->done )
+			return 1;
+
+		memset(&f, 0, sizeof(f));
+		f.run = bg->run;
+		f.nrun = bg->nrun;
+		f.outlvl = bg->outlvl;
+		return query_frozen(c, &f, key, l);
+	}
+
+	if ( c->c_frozen )
+		return query_frozen(c, c->c_frozen, key, l);
+
+	if ( !c->c_nelem )
+		return 1;
+
+	/* a view can't remap, it reads whatever isn't mapped instead */
+	top = map_levels(c, cfls(c->c_nelem));
+	if ( c->c_maplvls < top && !c->c_isview ) {
+		dprintf("remap %u\n", top);
+		if ( !remap(c, top) )
+			return 0;
+	}
+
+	if ( !c->c_rw && !c->c_commit.h_clean )
+		return query_committed(c, key, l);
+
+	if ( !bloom_levels(c, key, 0, &mask) )
+		return 0;
+
+	return cascade(c, key, 0, mask, 0, 0, 0, c->c_lalen[0], l);
+}
+
+/* the write buffer has the newest copy of anything in it, returns true if
+ * that's all the lookup needs
+*/
+static int mem_query(struct _cola *c, cola_key_t key, struct lookup *l)
+{
+	const struct cola_elem *e;
+	struct cola_elem dead;
+	int cut;
+
+	if ( NULL == c->c_mem || c->c_memoff )
+		return 0;
+
+	e = memtable_get(c->c_mem, key, &cut);
+	if ( NULL == e )
+		return 0;
+	if ( lookup_add(l, e) || !cut )
+		return l->done;
+
+	dead.key = key;
+	dead.val = COLA_TOMBSTONE;
+	return lookup_add(l, &dead);
+}
+
+/* In thread-safe mode, readers search the write buffer and then the view
+ * that they picked up with it.
+*/
+static int lookup(struct _cola *c, cola_key_t key, struct lookup *l)
+{
+	unsigned int ticket;
+	struct _cola *v;
+	int ret;
+
+	if ( NULL == c->c_views ) {
+		if ( !replay(c) )
+			return 0;
+		for(;;) {
+			lookup_init(l, c);
+			if ( !mem_query(c, key, l) && !query(c, key, l) )
+				return 0;
+			if ( !stale(c) )
+				return 1;
+			if ( !cola_refresh(c) )
+				return 0;
+		}
+	}
+
+	for(;;) {
+		int again;
+
+		mem_lock(c, 0);
+		v = view_get(c, &ticket);
+		lookup_init(l, v);
+		ret = mem_query(c, key, l);
+		mem_unlock(c);
+
+		ret = ret || query(v, key, l);
+		again = ret && stale(v);
+		view_put(c, ticket);
+		if ( !again )
+			return ret;
+		if ( !cola_refresh(c) )
+			return 0;
+	}
+}
+
+static void stat_lookup(struct _cola *c, const struct lookup *l)
+{
+	unsigned int d = l->probes;
+
+	if ( likely(NULL == c->c_stats) )
+		return;
+
+	if ( d > COLA_STATS_LEVELS )
+		d = COLA_STATS_LEVELS;
+	stat_add(c, lookups, 1);
+	stat_add(c, depth[d], 1);
+}
+
+int cola_query(cola_t c, cola_key_t key, int *result)
+{
+	struct lookup l;
+
+	if ( !lookup(c, key, &l) )
+		return 0;
+
+	stat_lookup(c, &l);
+	*result = lookup_result(&l);
+	return 1;
+}
+
+int cola_get(cola_t c, cola_key_t key, cola_val_t *val, int *result)
+{
+	struct lookup l;
+
+	if ( !lookup(c, key, &l) )
+		return 0;
+
+	stat_lookup(c, &l);
+	*result = lookup_result(&l);
+	if ( *result )
+		*val = l.e.val;
+	return 1;
+}
+
+struct probe {
+	cola_key_t key;
+	size_t idx;
+};
+
+static int probe_cmp(const void *A, const void *B)
+{
+	const struct probe *a = A, *b = B;
+
+	if ( a->key < b->key )
+		return -1;
+	if ( a->key > b->key )
+		return 1;
+	return 0;
+}
+
+/* lower bound of key in e[from, n) searching outwards from from */
+static cola_key_t gallop(const struct cola_elem *e, cola_key_t from,
+				cola_key_t n, cola_key_t key)
+{
+	cola_key_t lo = from, hi = from, step = 1;
+
+	while ( hi < n && e[hi].key < key ) {
+		lo = hi + 1;
+		hi += step;
+		step <<= 1;
+	}
+
+	if ( hi > n )
+		hi = n;
+	return lo + search_lower_bound(e + lo, hi - lo, key);
+}
+
+/* Look up sorted probes in one level, a single pass over it in key order.
+ * Probes which are found, or deleted, are resolved and dropped from the
+ * array. Levels which are much bigger than the batch are searched, otherwise
+ * they are streamed through.
+*/
+static int sweep_level(struct _cola *c, unsigned int lvlno,
+			struct probe *pr, size_t *nr, int *results)
+{
+	const struct cola_elem *e = NULL;
+	cola_key_t nelem = level_len(c, lvlno);
+	cola_key_t pos = 0;
+	struct inbuf in;
+	uint8_t *buf = NULL;
+	int stream, ret = 0;
+	size_t i, j;
+
+	stream = !level_mapped(c, lvlno) &&
+		nelem <= *nr * (BLOCK_SIZE / sizeof(struct cola_elem));
+	if ( stream ) {
+		uint8_t *bufptr;
+
+		bufptr = buf = malloc(BLOCK_SIZE);
+		if ( NULL == buf )
+			return 0;
+		inbuf_level(c, &in, lvlno, 0, nelem, &bufptr);
+		e = inbuf_pop(c, &in);
+	}
+
+	for(i = j = 0; i < *nr; i++) {
+		cola_key_t key = pr[i].key;
+		int found, dead = 0;
+
+		if ( stream ) {
+			while ( e && e->key < key )
+				e = inbuf_pop(c, &in);
+			found = (e && e->key == key);
+			dead = found && e->val == COLA_TOMBSTONE;
+		}else if ( level_mapped(c, lvlno) ) {
+			const struct cola_elem *lvl;
+			int maybe;
+
+			if ( !bloom_test(c, lvlno, key, &maybe) )
+				goto out;
+
+			lvl = (struct cola_elem *)(c->c_map + level_ofs(lvlno));
+			if ( maybe )
+				pos = gallop(lvl, pos, nelem, key);
+			found = maybe && pos < nelem && lvl[pos].key == key;
+			dead = found && lvl[pos].val == COLA_TOMBSTONE;
+		}else{
+			cola_key_t lo = pos, hi = nelem, t;
+			struct buf win;
+			int maybe;
+
+			if ( !bloom_test(c, lvlno, key, &maybe) )
+				goto out;
+			found = 0;
+			if ( maybe ) {
+				if ( !narrow_level(c, lvlno, key, &lo, &hi) )
+					goto out;
+				if ( hi < nelem )
+					hi++;
+				if ( !read_level_part(c, lvlno, lo, hi, &win) )
+					goto out;
+				t = search_lower_bound(win.ptr, win.nelem, key);
+				found = (t < win.nelem && win.ptr[t].key == key);
+				dead = found && win.ptr[t].val == COLA_TOMBSTONE;
+				pos = lo + t;
+				buf_finish(&win);
+			}
+		}
+
+		if ( found )
+			results[pr[i].idx] = !dead;
+		else
+			pr[j++] = pr[i];
+	}
+
+	*nr = j;
+	ret = 1;
+out:
+	free(buf);
+	return ret;
+}
+
+static int query_batch(struct _cola *c, const cola_key_t *keys, size_t n,
+			int *results, int *again)
+{
+	struct _cola *v = c;
+	unsigned int lvl, top, ticket = 0;
+	struct probe *pr;
+	size_t i, nr;
+	int ret = 0;
+
+	*again = 0;
+	if ( NULL == c->c_views && !replay(c) )
+		return 0;
+	if ( !n )
+		return 1;
+
+	if ( c->c_views ) {
+		mem_lock(c, 0);
+		v = view_get(c, &ticket);
+	}
+
+	/* levels are in flux, or copies have to be folded, fall back to
+	 * single lookups
+	*/
+	if ( v->c_bg || v->c_merge || v->c_frozen ) {
+		mem_unlock(c);
+		if ( c->c_views )
+			view_put(c, ticket);
+		for(nr = 0; nr < n; nr++) {
+			if ( !cola_query(c, keys[nr], results + nr) )
+				return 0;
+		}
+		return 1;
+	}
+
+	memset(results, 0, n * sizeof(*results));
+
+	/* the write buffer settles any key that it holds */
+	pr = malloc(n * sizeof(*pr));
+	for(i = nr = 0; pr && i < n; i++) {
+		const struct cola_elem *e = NULL;
+		int cut;
+
+		if ( c->c_mem && !c->c_memoff )
+			e = memtable_get(c->c_mem, keys[i], &cut);
+		if ( e ) {
+			results[i] = (e->val != COLA_TOMBSTONE);
+			continue;
+		}
+		pr[nr].key = keys[i];
+		pr[nr].idx = i;
+		nr++;
+	}
+	mem_unlock(c);
+	if ( NULL == pr )
+		goto out;
+	qsort(pr, nr, sizeof(*pr), probe_cmp);
+
+	top = map_levels(v, cfls(v->c_nelem));
+	if ( v->c_nelem && v->c_maplvls < top && !v->c_isview ) {
+		dprintf("remap %u\n", top);
+		if ( !remap(v, top) )
+			goto out;
+	}
+
+	for(lvl = 0; nr && v->c_nelem >> lvl; lvl++) {
+		if ( !level_live(v, lvl) )
+			continue;
+		if ( !sweep_level(v, lvl, pr, &nr, results) )
+			goto out;
+	}
+
+	*again = stale(v);
+	ret = 1;
+out:
+	free(pr);
+	if ( c->c_views )
+		view_put(c, ticket);
+	return ret;
+}
+
+int cola_query_batch(cola_t c, const cola_key_t *keys, size_t n,
+			int *results)
+{
+	int again;
+
+	for(;;) {
+		if ( !query_batch(c, keys, n, results, &again) )
+			return 0;
+		if ( !again )
+			return 1;
+		if ( !cola_refresh(c) )
+			return 0;
+	}
+}
+
+/* A range scan is a k-way merge, like merge(), of every live level from the
+ * lower bound of lo onwards. Inputs are numbered from the lowest level so
+ * the copies of a key come out newest first to be folded like a lookup.
+ * Keys which turn out to be deleted are skipped.
+*/
+struct _cola_iter {
+	struct _cola *c;
+	struct _cola *owner; /* in thread-safe mode, c is a view held from it */
+	unsigned int ticket;
+	cola_key_t lo; /* where to pick up from after a refresh */
+	cola_key_t hi;
+	unsigned int k;
+	uint8_t *buf;
+	const struct cola_elem *cur[NUM_LEVELS];
+	struct inbuf in[NUM_LEVELS];
+	struct heap_item h[NUM_LEVELS + 1];
+};
+
+static int iter_seek(struct _cola_iter *it)
+{
+	struct _cola *c = it->c;
+	cola_key_t pos[NUM_LEVELS];
+	unsigned int i, top, nbuf;
+	uint8_t *bufptr;
+
+	free(it->buf);
+	it->buf = NULL;
+	it->k = 0;
+
+	top = map_levels(c, cfls(c->c_nelem));
+	if ( c->c_nelem && c->c_maplvls < top && !c->c_isview ) {
+		dprintf("remap %u\n", top);
+		if ( !remap(c, top) )
+			return 0;
+	}
+
+	for(i = nbuf = 0; c->c_nelem >> i; i++) {
+		if ( !level_live(c, i) )
+			continue;
+		if ( !seek_level(c, i, level_len(c, i), it->lo, pos + i) )
+			return 0;
+		if ( !level_mapped(c, i) )
+			nbuf++;
+	}
+
+	if ( nbuf ) {
+		it->buf = malloc(nbuf * BLOCK_SIZE);
+		if ( NULL == it->buf )
+			return 0;
+	}
+
+	bufptr = it->buf;
+	for(i = 0; c->c_nelem >> i; i++) {
+		const struct cola_elem *e;
+		cola_key_t n;
+
+		if ( !level_live(c, i) )
+			continue;
+
+		n = level_len(c, i);
+		inbuf_level(c, it->in + it->k, i, pos[i], n - pos[i], &bufptr);
+
+		e = inbuf_pop(c, it->in + it->k);
+		if ( NULL == e )
+			continue;
+
+		it->cur[it->k] = e;
+		it->h[it->k + 1].key = e->key;
+		it->h[it->k + 1].val = it->k;
+		it->k++;
+	}
+
+	minheap_init(it->k, it->h);
+	return 1;
+}
+
+cola_iter_t cola_iter_open(cola_t c, cola_key_t lo, cola_key_t hi)
+{
+	struct _cola_iter *it;
+
+	it = calloc(1, sizeof(*it));
+	if ( NULL == it )
+		return NULL;
+
+	writer_lock(c);
+	if ( replay(c) && mem_flush(c) && bg_finish(c) ) {
+		it->c = c;
+		if ( c->c_views ) {
+			it->owner = c;
+			it->c = view_get(c, &it->ticket);
 		}
+	}
+	writer_unlock(c);
+	if ( NULL == it->c ) {
+		free(it);
+		return NULL;
+	}
+
+	it->lo = lo;
+	it->hi = hi;
+	if ( !iter_seek(it) ) {
+		cola_iter_close(it);
+		return NULL;
+	}
+
+	return it;
+}
+
+/* pick up where we left off in the latest commit, see stale() */
+static int iter_refresh(struct _cola_iter *it)
+{
+	if ( it->owner ) {
+		view_put(it->owner, it->ticket);
+		it->c = NULL;
+		if ( !cola_refresh(it->owner) )
+			return 0;
+		it->c = view_get(it->owner, &it->ticket);
+	}else if ( !cola_refresh(it->c) ) {
+		return 0;
+	}
+
+	return iter_seek(it);
+}
+
+/* next entry in key order, newest first */
+static void iter_pop(struct _cola_iter *it, struct cola_elem *e)
+{
+	struct heap_item *h = it->h;
+	unsigned long next_in;
 
-		if ( hdr.h_magic != COLA_MAGIC ) {
-			fprintf(stderr, "%s: %s: Bad magic\n", cmd, fn);
-			goto out_close;
-		}
+	next_in = h[1].val;
+	*e = *it->cur[next_in];
 
-		if ( hdr.h_vers != COLA_CURRENT_VER ) {
-			fprintf(stderr, "%s: %s: Unsupported vers\n", cmd, fn);
-			goto out_close;
-		}
+	/* delete item from heap */
+	h[1] = h[it->k];
+	minheap_sift_down(it->k - 1, h);
 
-		c->c_nelem = hdr.h_nelem;
+	it->cur[next_in] = inbuf_pop(it->c, &it->in[next_in]);
+	if ( it->cur[next_in] ) {
+		/* re-add to heap */
+		h[it->k].key = it->cur[next_in]->key;
+		h[it->k].val = next_in;
+		minheap_sift_up(it->k, h);
+	}else{
+		it->k--;
 	}
+}
 
-	c->c_rw = rw;
-	if ( !map(c) )
-		goto out_close;
+static void iter_step(struct _cola_iter *it, cola_key_t *key,
+			cola_val_t *val, int *result)
+{
+	*result = 0;
+	while ( it->k ) {
+		struct cola_elem e;
+		struct lookup l;
 
-	c->c_nxtlvl = cfls(c->c_nelem);
-	if ( c->c_nxtlvl < INITIAL_LEVELS )
-		c->c_nxtlvl = INITIAL_LEVELS + 1;
-	dprintf("next level init to %u\n", c->c_nxtlvl);
+		iter_pop(it, &e);
+		if ( e.key > it->hi ) {
+			it->k = 0;
+			break;
+		}
 
-	/* success */
-	goto out;
+		lookup_init(&l, it->c);
+		lookup_add(&l, &e);
+		while ( it->k && it->h[1].key == l.e.key ) {
+			iter_pop(it, &e);
+			if ( !l.done )
+				lookup_add(&l, &e);
+		}
 
-out_close:
-	close(c->c_fd);
-out_free:
-	free(c);
-	c = NULL;
-out:
-	return c;
-}
+		if ( !lookup_result(&l) )
+			continue;
 
-cola_t cola_open(const char *fn, int rw)
-{
-	return do_open(fn, rw, 0, 0);
+		*key = l.e.key;
+		*val = l.e.val;
+		*result = 1;
+		break;
+	}
 }
 
-cola_t cola_creat(const char *fn, int overwrite)
+int cola_iter_next(cola_iter_t it, cola_key_t *key, cola_val_t *val,
+			int *result)
 {
-	return do_open(fn, 1, 1, overwrite);
+	for(;;) {
+		iter_step(it, key, val, result);
+		if ( !stale(it->c) )
+			break;
+		if ( !iter_refresh(it) )
+			return 0;
+	}
+
+	if ( *result )
+		it->lo = *key + 1;
+	return 1;
 }
 
-static void buf_finish(struct buf *buf)
+void cola_iter_close(cola_iter_t it)
 {
-	if ( buf->heap )
-		free(buf->ptr);
-	buf->ptr = NULL;
-	buf->nelem = 0;
+	if ( it ) {
+		if ( it->owner && it->c )
+			view_put(it->owner, it->ticket);
+		free(it->buf);
+		free(it);
+	}
 }
 
-static int read_level_part(struct _cola *c, unsigned int lvlno,
-					cola_key_t from, cola_key_t to,
-					struct buf *buf)
+static int dump(struct _cola *c)
 {
-	cola_key_t nr_ent, ofs;
-	int eof;
-
-	assert(from <= to);
-	assert(to <= (1U << lvlno));
+	unsigned int i;
 
-	nr_ent = to - from;
-	ofs = level_ofs(lvlno);
-	ofs += from;
+	printf("%"PRId64" items\n", c->c_nelem);
+	for(i = 0; c->c_nelem >= (1ULL << i); i++) {
+		struct buf level;
+		unsigned int j;
 
-	if ( lvlno < c->c_maplvls ) {
-		buf->ptr = (struct cola_elem *)(c->c_map + ofs);
-		buf->nelem = (1U << lvlno);
-		buf->heap = 0;
-	}else{
-		size_t sz;
+		/* an empty packed level may have never been written */
+		if ( !level_live(c, i) && level_packed(c, i) ) {
+			printf("\033[2;37mlevel %u (%"PRIu64" lookahead): "
+				"packed\033[0m\n", i, c->c_lalen[i]);
+			continue;
+		}
 
-		buf->ptr = malloc(nr_ent * sizeof(*buf->ptr));
-		if ( NULL == buf->ptr )
+		if ( !read_level(c, i, &level) )
 			return 0;
 
-		buf->nelem = nr_ent;
-		buf->heap = 1;
-
-		sz = nr_ent * sizeof(*buf->ptr);
-		if ( !fd_pread(c->c_fd, ofs, buf->ptr, &sz, &eof) ||
-				sz != (nr_ent * sizeof(*buf->ptr)) ) {
-			fprintf(stderr, "%s: read: %s\n",
-				cmd, os_err2("File truncated"));
-			buf_finish(buf);
-			return 0;
+		if ( !(c->c_nelem & (1ULL << i)) )
+			printf("\033[2;37m");
+		printf("level %u (%"PRIu64" lookahead):", i, c->c_lalen[i]);
+		for(j = 0; j < (1ULL << i); j++) {
+			if ( j > 8 ) {
+				printf(" ...");
+				break;
+			}else{
+				printf(" %"PRIu64, level.ptr[j].key);
+			}
 		}
+		if ( !(c->c_nelem & (1ULL << i)) )
+			printf("\033[0m");
+		printf("\n");
+		buf_finish(&level);
 	}
 
 	return 1;
 }
 
-static int read_level(struct _cola *c, unsigned int lvlno,
-				struct buf *buf)
+int cola_dump(cola_t c)
 {
-	return read_level_part(c, lvlno, 0, 1U << lvlno, buf);
+	int ret;
+
+	writer_lock(c);
+	ret = replay(c) && mem_flush(c) && bg_finish(c) && dump(c);
+	writer_unlock(c);
+	return ret;
 }
 
-int cola_insert(cola_t c, cola_key_t key)
+int cola_merge_threads(cola_t c, unsigned int nr)
 {
-	cola_key_t newcnt = c->c_nelem + 1;
-	struct inbuf *in;
-	struct outbuf out;
-	struct heap_item *h;
-	unsigned int k, i, outlvl;
-	struct cola_elem elem;
+	if ( !nr )
+		return 0;
+	c->c_nthreads = nr;
+	return 1;
+}
 
-	elem.key = key;
+cola_val_t cola_merge_replace(cola_val_t newer, cola_val_t older)
+{
+	return newer;
+}
 
-	dprintf("Insert key %"PRIu64"\n", key);
+/* saturates rather than wrapping round to a tombstone */
+cola_val_t cola_merge_sum(cola_val_t newer, cola_val_t older)
+{
+	cola_val_t sum = newer + older;
 
-	/* make sure the level we're about to write to is allocated and,
-	 * if required, mapped
-	*/
-	if ( newcnt == (1ULL << c->c_nxtlvl) ) {
-		cola_key_t nr_ent, ofs;
-		size_t sz;
+	if ( sum < newer || sum == COLA_TOMBSTONE )
+		return COLA_TOMBSTONE - 1;
+	return sum;
+}
 
-		nr_ent = (1ULL << c->c_nxtlvl);
-		ofs = nr_ent - 1;
-		ofs *= sizeof(struct cola_elem);
-		ofs += sizeof(struct cola_hdr);
+cola_val_t cola_merge_max(cola_val_t newer, cola_val_t older)
+{
+	return (newer > older) ? newer : older;
+}
 
-		sz = nr_ent * sizeof(struct cola_elem);
-		dprintf("fallocate level %u\n", c->c_nxtlvl);
-		if ( posix_fallocate(c->c_fd, ofs, ofs + sz) )
-			fprintf(stderr, "%s: fallocate: %s\n",
-				cmd, os_err());
-		if ( c->c_nxtlvl < MAP_LEVELS &&
-				(1U << c->c_nxtlvl) > c->c_nelem ) {
-			if ( !remap(c, c->c_nxtlvl + 1) )
-				return 0;
-		}
+int cola_merge_op(cola_t c, cola_merge_fn fn)
+{
+	if ( fn == cola_merge_replace )
+		fn = NULL;
 
-		c->c_nxtlvl++;
-	}
+	c->c_merge = fn;
+	if ( c->c_shadow )
+		c->c_shadow->c_merge = fn;
+	return 1;
+}
 
-	outlvl = __builtin_ctzl(~c->c_nelem & newcnt);
+/* The layout of the levels from *lvlp up is kept in the header so it's
+ * committed straight away, and it may only change while the levels that it
+ * affects are empty.
+*/
+static int set_layout(struct _cola *c, unsigned int *lvlp, unsigned int lvl,
+			unsigned int min, const char *what)
+{
+	unsigned int old = *lvlp, lo;
+	int ret = 0;
 
-	if ( outlvl >= c->c_maplvls && !alloc_buffers(c) ) {
+	if ( !c->c_rw || (lvl && (lvl < min || lvl >= NUM_LEVELS)) )
 		return 0;
+
+	writer_lock(c);
+	if ( !replay(c) || !bg_finish(c) )
+		goto out;
+
+	lo = (!old || (lvl && lvl < old)) ? lvl : old;
+	if ( lo && c->c_nelem >> lo ) {
+		fprintf(stderr, "%s: %s: level %u is in use\n",
+			cmd, what, cfls(c->c_nelem));
+		goto out;
 	}
 
-	k = outlvl + 1;
-	dprintf(" - will write to level %u (%u-way merge)\n",
-			outlvl, k);
-	h = alloca(sizeof(*h) * k);
-	if ( NULL == h )
-		return 0;
+	*lvlp = lvl;
+	ret = commit(c, 0) && publish(c, NULL);
+	if ( !ret )
+		*lvlp = old;
+out:
+	writer_unlock(c);
+	return ret;
+}
 
-	in = alloca(sizeof(*in) * k);
-	if ( NULL == in )
-		return 0;
+int cola_pack(cola_t c, unsigned int lvl)
+{
+	return set_layout(c, &c->c_packlvl, lvl, PACK_MIN_LEVEL, "pack");
+}
 
-	init_bufs(c);
+int cola_columns(cola_t c, unsigned int lvl)
+{
+	return set_layout(c, &c->c_collvl, lvl, COLS_MIN_LEVEL, "columns");
+}
 
-	for(i = 0; i < k; i++) {
-		if ( i == 0 ) {
-			inbuf_one_item(c, in + i, &elem);
-		}else{
-			inbuf_init(c,in + i, i - 1);
+int cola_map_budget(cola_t c, size_t map, size_t rss)
+{
+	unsigned int max = MAP_LEVELS;
+	int ret = 0;
+
+	if ( map ) {
+		for(max = 0; max < MAP_LEVELS; max++) {
+			if ( level_ofs(max + 1) > map )
+				break;
 		}
 	}
 
-	/* initialize the heap */
-	h = h - 1;
-	for(i = 1; i <= k; i++) {
-		h[i].val = i - 1;
-		inbuf_pop(c, in + h[i].val, &h[i].key);
-	}
-	minheap_init(k, h);
+	writer_lock(c);
+	if ( !bg_finish(c) )
+		goto out;
 
-	/* k-way merge in to output buffer */
-	outbuf_init(c, &out, outlvl);
-	//for(i = 0; i < (1U << outlvl); i++) {
-	while(k) {
-		struct cola_elem oelem;
-		cola_key_t next;
-		unsigned long next_in;
+	c->c_mapmax = max;
+	c->c_rss = rss;
+	if ( c->c_map && c->c_maplvls > max && !remap(c, max) )
+		goto out;
 
-		next_in = h[1].val;
-		oelem.key = h[1].key;
+	ret = publish(c, NULL);
+out:
+	writer_unlock(c);
+	return ret;
+}
 
-		outbuf_push(&out, c, &oelem);
+int cola_cache(cola_t c, size_t size)
+{
+	struct cache *m = NULL;
+	char path[64];
+	int fd = -1;
 
-		/* delete item from heap */
-		h[1] = h[k];
-		minheap_sift_down(k - 1, h);
+	if ( c->c_views )
+		return 0;
 
-		if ( inbuf_pop(c, &in[next_in], &next) ) {
-			/* re-add to heap */
-			h[k].key = next;
-			h[k].val = next_in;
-			minheap_sift_up(k, h);
-		}else{
-			k--;
+	/* a file of its own, since the page cache is what it's bypassing */
+	if ( size ) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", c->c_fd);
+		fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+		if ( fd < 0 && errno == EINVAL )
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+		if ( fd < 0 ) {
+			fprintf(stderr, "%s: open: %s: %s\n",
+				cmd, path, os_err());
+			return 0;
+		}
+
+		m = cache_new(fd, size);
+		if ( NULL == m ) {
+			fprintf(stderr, "%s: cache: %s\n", cmd, os_err());
+			close(fd);
+			return 0;
 		}
 	}
 
-	c->c_nelem++;
-	dprintf("\n");
-#if DEBUG
-	cola_dump(c);
-	dprintf("\n");
-#endif
+	/* a merge in the background has a copy of the pointer */
+	writer_lock(c);
+	if ( !bg_finish(c) ) {
+		writer_unlock(c);
+		cache_free(m);
+		if ( fd >= 0 )
+			close(fd);
+		return 0;
+	}
+
+	if ( c->c_cache ) {
+		cache_free(c->c_cache);
+		close(c->c_cachefd);
+	}
+	c->c_cache = m;
+	c->c_cachefd = fd;
+	writer_unlock(c);
 	return 1;
 }
 
-static int query_level(struct _cola *c, cola_key_t key,
-			unsigned int lvlno, int *result,
-			cola_key_t *lo, cola_key_t *hi)
+int cola_stats_enable(cola_t c)
 {
-	struct buf level;
-	struct cola_elem *p;
-	cola_key_t n, l, h, sz;
+	int ret = 1;
 
-	dprintf("bsearch level %u (%"PRIu64":%"PRIu64")\n", lvlno, *lo, *hi);
-	if ( !read_level_part(c, lvlno, *lo, *hi, &level) )
-		return 0;
+	if ( c->c_stats ) {
+		memset(c->c_stats, 0, sizeof(*c->c_stats));
+		return 1;
+	}
 
-	sz = *hi - *lo;
-	l = 0;
-	h = (1U << (lvlno + 1));
+	/* readers pick them up with the next view */
+	writer_lock(c);
+	c->c_stats = calloc(1, sizeof(*c->c_stats));
+	if ( NULL == c->c_stats )
+		ret = 0;
+	else
+		ret = publish(c, NULL);
+	writer_unlock(c);
+	return ret;
+}
 
-	for(*result = 0, p = level.ptr, n = sz; n; ) {
-		cola_key_t i = n / 2;
-		if ( key < p[i].key ) {
-			n = i;
-		}else if ( key > p[i].key ) {
-			p = p + (i + 1);
-			n = n - (i + 1);
-		}else{
-			*result = 1;
-			break;
-		}
-	}
+int cola_stats(cola_t c, struct cola_stats *st)
+{
+	unsigned int i;
 
-	if ( *result == 0 ) {
-		dprintf(" - nope %"PRIu64" @ %"PRIu64"\n", n, p - level.ptr);
-		dprintf(" - lo=%"PRIu64" hi=%"PRIu64"\n", l, h);
+	if ( c->c_stats )
+		memcpy(st, c->c_stats, sizeof(*st));
+	else
+		memset(st, 0, sizeof(*st));
+
+	if ( c->c_cache )
+		cache_stats(c->c_cache, &st->cache_hits, &st->cache_misses);
+
+	st->nlevels = (c->c_nelem) ? cfls(c->c_nelem) + 1 : 0;
+	for(i = 0; i < st->nlevels; i++) {
+		st->level[i].nelem = (level_live(c, i)) ?
+					level_len(c, i) : 0;
 	}
 
-	*lo = l;
-	*hi = h;
-	buf_finish(&level);
 	return 1;
 }
 
-int cola_query(cola_t c, cola_key_t key, int *result)
+int cola_bgmerge(cola_t c, unsigned int lvl)
 {
-	cola_key_t lo = 0, hi = 1;
-	unsigned int i;
+	if ( lvl && c->c_views )
+		return 0;
 
-	if ( c->c_maplvls < cfls(c->c_nelem) ) {
-		dprintf("remap %u\n", cfls(c->c_nelem));
-		if ( !remap(c, cfls(c->c_nelem)) )
+	if ( lvl && NULL == c->c_shadow ) {
+		if ( !c->c_rw )
 			return 0;
-	}
-
-	for(i = 0; c->c_nelem >= (1U << i); i++) {
-		if ( !query_level(c, key, i, result, &lo, &hi) )
+		c->c_shadow = shadow_open();
+		if ( NULL == c->c_shadow )
 			return 0;
-		if ( *result )
-			return 1;
+		c->c_shadow->c_merge = c->c_merge;
 	}
 
-	*result = 0;
+	c->c_bglvl = lvl;
 	return 1;
 }
 
-int cola_dump(cola_t c)
+int cola_memtable(cola_t c, size_t size)
 {
-	unsigned int i;
+	cola_key_t n = size / sizeof(struct cola_elem);
+	struct memtable *m = NULL, *old;
 
-	printf("%"PRId64" items\n", c->c_nelem);
-	for(i = 0; c->c_nelem >= (1U << i); i++) {
-		struct buf level;
-		unsigned int j;
+	if ( !c->c_rw )
+		return 0;
 
-		if ( !read_level(c, i, &level) )
+	if ( n ) {
+		m = memtable_new(1ULL << log2_floor64(n));
+		if ( NULL == m )
 			return 0;
+	}
 
-		if ( !(c->c_nelem & (1U << i)) )
-			printf("\033[2;37m");
-		printf("level %u:", i);
-		for(j = 0; j < (1U << i); j++) {
-			if ( j > 8 ) {
-				printf(" ...");
-				break;
-			}else{
-				printf(" %"PRIu64, level.ptr[j].key);
-			}
-		}
-		if ( !(c->c_nelem & (1U << i)) )
-			printf("\033[0m");
-		printf("\n");
-		buf_finish(&level);
+	writer_lock(c);
+	if ( !replay(c) || !mem_flush(c) ) {
+		writer_unlock(c);
+		memtable_free(m);
+		return 0;
 	}
 
+	mem_lock(c, 1);
+	old = c->c_mem;
+	c->c_mem = m;
+	mem_unlock(c);
+	writer_unlock(c);
+
+	memtable_free(old);
 	return 1;
 }
 
-static int write_header(struct _cola *c)
+int cola_sync(cola_t c)
 {
-	if ( c->c_map ) {
-		struct cola_hdr *hdr = (struct cola_hdr *)c->c_map;
+	int ret;
 
-		hdr->h_nelem = c->c_nelem;
-		hdr->h_magic = COLA_MAGIC;
-		hdr->h_vers = COLA_CURRENT_VER;
-	}else{
-		struct cola_hdr hdr;
-		ssize_t ret;
+	if ( NULL == c->c_wal )
+		return 1;
 
-		hdr.h_nelem = c->c_nelem;
-		hdr.h_magic = COLA_MAGIC;
-		hdr.h_vers = COLA_CURRENT_VER;
-		ret = pwrite(c->c_fd, &hdr, sizeof(hdr), 0);
-		if ( ret < 0 )
-			return 0;
-		if ( (size_t)ret < sizeof(hdr) )
-			return 0;
+	writer_lock(c);
+	ret = wal_sync(c->c_wal);
+	writer_unlock(c);
+	return ret;
+}
+
+static void views_free(struct views *vs)
+{
+	struct old_map *m;
+	struct view *v;
+
+	free(vs->cur);
+	while ( (v = vs->retired) ) {
+		vs->retired = v->next;
+		free(v);
+	}
+	while ( (m = vs->unmaps) ) {
+		vs->unmaps = m->next;
+		munmap(m->map, m->sz);
+		free(m);
+	}
+
+	epoch_free(vs->epoch);
+	pthread_rwlock_destroy(&vs->memlock);
+	pthread_mutex_destroy(&vs->wlock);
+	free(vs);
+}
+
+/* The log is replayed and, if levels are mapped at all, all of them that the
+ * budget allows are mapped now since views can't remap.
+*/
+int cola_threadsafe(cola_t c)
+{
+	pthread_rwlockattr_t attr;
+	struct views *vs;
+	unsigned int top;
+
+	if ( c->c_views )
+		return 1;
+	if ( c->c_bglvl || !replay(c) )
+		return 0;
+
+	top = map_levels(c, cfls(c->c_nelem));
+	if ( c->c_nelem && c->c_maplvls < top && !remap(c, top) )
+		return 0;
+
+	vs = calloc(1, sizeof(*vs));
+	if ( NULL == vs )
+		return 0;
+
+	vs->epoch = epoch_new();
+	if ( NULL == vs->epoch ) {
+		free(vs);
+		return 0;
+	}
+
+	/* inserts mustn't be starved by a steady stream of lookups */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&vs->memlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_mutex_init(&vs->wlock, NULL);
+
+	c->c_views = vs;
+	if ( !publish(c, NULL) ) {
+		c->c_views = NULL;
+		views_free(vs);
+		return 0;
 	}
 
 	return 1;
@@ -753,25 +5554,40 @@ int cola_close(cola_t c)
 {
 	int ret = 1;
 	if ( c ) {
-		if ( c->c_rw ) {
-			if ( !write_header(c) )
+		if ( !replay(c) || !mem_flush(c) )
+			ret = 0;
+		free(c->c_replay);
+		memtable_free(c->c_mem);
+		if ( !bg_finish(c) )
+			ret = 0;
+		if ( c->c_shadow && !cola_close(c->c_shadow) )
+			ret = 0;
+
+		if ( c->c_wal ) {
+			/* else recovery sorts it out next time */
+			if ( ret && !commit(c, 1) )
 				ret = 0;
-			if ( c->c_map && msync(c->c_map,
-						c->c_mapsz,
-						MS_ASYNC) ) {
+			if ( !wal_close(c->c_wal) )
 				ret = 0;
-			}
 		}
 
+		if ( c->c_views )
+			views_free(c->c_views);
+
 		if ( c->c_map && munmap(c->c_map, c->c_mapsz) ) {
 			ret = 0;
 		}
 		if ( c->c_buf && munmap(c->c_buf, TOTAL_BUFFER_SIZE) ) {
 			ret = 0;
 		}
-		if ( !close(c->c_fd) ) {
+		if ( close(c->c_fd) ) {
 			ret = 0;
 		}
+		if ( c->c_cache ) {
+			cache_free(c->c_cache);
+			close(c->c_cachefd);
+		}
+		free(c->c_stats);
 		free(c);
 	}
 	return ret;
@@ -0,0 +1,1268 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cola.h>
+#include <cola-format.h>
+#include <os.h>
+
+/* A block is cut before the entry which would take it past KV_BLOCK, so only
+ * a block of one entry is ever bigger.
+*/
+#define KV_BLOCK		4096U
+#define KV_ALIGN		4096U /* levels start on a page */
+#define KV_BUFFER		(1U << 20) /* key and value bytes held in memory */
+#define KV_WRBUF		(1U << 20)
+#define KV_MAXHDR		30U /* three varints */
+#define HDR_SLOT		(COLA_HDR_SIZE / 2)
+
+/* write buffer entry, the value is stored after the key */
+struct kv_ent {
+	uint8_t *key;
+	size_t klen;
+	size_t vlen;
+	uint64_t seq;
+	int tomb;
+};
+
+struct _cola_kv {
+	struct cola_kv_hdr c_hdr;
+	cola_cmp_fn c_cmp;
+	uint8_t *c_map;
+	size_t c_mapsz; /* the whole file */
+	struct kv_ent *c_buf;
+	size_t c_nbuf;
+	size_t c_bufmax;
+	size_t c_bufsz; /* key and value bytes */
+	size_t c_sorted; /* c_buf[0, c_sorted) is sorted, one entry per key */
+	uint64_t c_seq;
+	uint8_t *c_kbuf; /* room for the longest key in any level */
+	size_t c_kbufmax;
+	int c_fd;
+	int c_rw;
+};
+
+/* One input to a merge or scan, the write buffer or a level. Level entries
+ * are decoded in to kbuf, which has room for the longest key in the level.
+*/
+struct kv_cur {
+	const uint8_t *key;
+	size_t klen;
+	const uint8_t *val;
+	size_t vlen;
+	int tomb;
+	int valid;
+
+	const struct kv_ent *ent, *ent_end;
+
+	const uint8_t *base;
+	const struct cola_kv_idx *idx;
+	uint64_t nblk, blk;
+	const uint8_t *bstart, *p, *end;
+	uint8_t *kbuf;
+};
+
+/* Inputs are numbered newest first, the heap holds the valid ones ordered by
+ * key then age, so that of the copies of a key the newest comes out first.
+*/
+struct kv_merge {
+	struct _cola_kv *c;
+	struct kv_cur src[COLA_KV_LEVELS + 1];
+	unsigned int heap[COLA_KV_LEVELS + 1];
+	unsigned int nsrc;
+	unsigned int nheap;
+	unsigned int out; /* returned last time, to be advanced */
+	int pending;
+};
+
+struct _cola_kv_iter {
+	struct kv_merge m;
+	uint8_t *hi;
+	size_t hilen;
+	int has_hi;
+};
+
+struct kv_build {
+	struct _cola_kv *c;
+	off_t off;
+	uint64_t pos; /* from off, including what's in wbuf */
+	uint8_t *wbuf;
+	size_t wlen;
+	uint64_t bstart;
+	unsigned int nent; /* in this block */
+	uint32_t *rst;
+	size_t nrst, rstmax;
+	uint8_t *last;
+	size_t lastlen, lastmax;
+	struct cola_kv_idx *idx;
+	size_t nidx, idxmax;
+	uint8_t *keys;
+	size_t keylen, keymax;
+	struct cola_kv_level l;
+};
+
+static int bytes_cmp(const void *a, size_t alen, const void *b, size_t blen)
+{
+	int ret;
+
+	ret = memcmp(a, b, (alen < blen) ? alen : blen);
+	if ( ret )
+		return ret;
+	return (alen > blen) - (alen < blen);
+}
+
+static uint64_t kv_hash(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t hdr_sum(const struct cola_kv_hdr *hdr)
+{
+	const uint8_t *p = (const uint8_t *)hdr;
+	uint64_t h = 0, w;
+	size_t i;
+
+	for(i = 0; i < offsetof(struct cola_kv_hdr, h_sum); i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		h = kv_hash(h ^ w);
+	}
+
+	return h;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint64_t *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	do {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	}while(*p++ & 0x80);
+
+	return p;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while ( v >= 0x80 ) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static size_t varint_len(uint64_t v)
+{
+	size_t n = 1;
+
+	while ( v >= 0x80 ) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/* an entry which shares nothing with the one before, the most it can take */
+static uint64_t ent_size(size_t klen, size_t vlen)
+{
+	return 1 + varint_len(klen) + varint_len(((uint64_t)vlen << 1) | 1) +
+		klen + vlen;
+}
+
+/* room for want items of sz, doubling, NULL leaves ptr as it was */
+static void *grow(void *ptr, size_t *max, size_t want, size_t sz)
+{
+	size_t n = (*max) ? *max : 64;
+	void *new;
+
+	if ( ptr && want <= *max )
+		return ptr;
+
+	while ( n < want )
+		n *= 2;
+
+	new = realloc(ptr, n * sz);
+	if ( NULL == new ) {
+		fprintf(stderr, "%s: realloc: %s\n", cmd, os_err());
+		return NULL;
+	}
+
+	*max = n;
+	return new;
+}
+
+static int live(const struct cola_kv_level *l)
+{
+	return l->l_nelem != 0;
+}
+
+static int kbuf_fit(struct _cola_kv *c)
+{
+	size_t max = 1;
+	unsigned int i;
+	void *p;
+
+	for(i = 0; i < COLA_KV_LEVELS; i++) {
+		const struct cola_kv_level *l = c->c_hdr.h_lvl + i;
+
+		if ( live(l) && l->l_maxkey > max )
+			max = l->l_maxkey;
+	}
+
+	p = grow(c->c_kbuf, &c->c_kbufmax, max, 1);
+	if ( NULL == p )
+		return 0;
+
+	c->c_kbuf = p;
+	return 1;
+}
+
+/* written over the older copy, and synced */
+static int write_header(struct _cola_kv *c)
+{
+	struct cola_kv_hdr *hdr = &c->c_hdr;
+
+	hdr->h_magic = COLA_MAGIC;
+	hdr->h_vers = COLA_KV_VER;
+	hdr->h_sum = hdr_sum(hdr);
+
+	if ( !fd_pwrite(c->c_fd, (hdr->h_seq & 1) * HDR_SLOT,
+				hdr, sizeof(*hdr)) ||
+			fdatasync(c->c_fd) ) {
+		fprintf(stderr, "%s: write header: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	return 1;
+}
+
+static int read_header(struct _cola_kv *c, const char *fn)
+{
+	const char *err = "Bad magic";
+	struct cola_kv_hdr h;
+	unsigned int i;
+	int found = 0;
+
+	for(i = 0; i < 2; i++) {
+		size_t sz = sizeof(h);
+		int eof;
+
+		if ( !fd_pread(c->c_fd, i * HDR_SLOT, &h, &sz, &eof) ||
+				sz != sizeof(h) ) {
+			fprintf(stderr, "%s: read: %s: %s\n",
+				cmd, fn, os_err2("File truncated"));
+			return 0;
+		}
+
+		if ( h.h_magic != COLA_MAGIC )
+			continue;
+		if ( h.h_vers != COLA_KV_VER ) {
+			err = "Unsupported vers";
+			continue;
+		}
+		if ( h.h_sum != hdr_sum(&h) ) {
+			err = "Bad header checksum";
+			continue;
+		}
+
+		if ( !found || h.h_seq > c->c_hdr.h_seq )
+			c->c_hdr = h;
+		found = 1;
+	}
+
+	if ( !found ) {
+		fprintf(stderr, "%s: %s: %s\n", cmd, fn, err);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* the file may have grown or shrunk since, levels are only ever written
+ * with pwrite so the map is read-only
+*/
+static int remap(struct _cola_kv *c)
+{
+	struct stat st;
+	uint8_t *map;
+
+	if ( fstat(c->c_fd, &st) ) {
+		fprintf(stderr, "%s: fstat: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	if ( c->c_map && (size_t)st.st_size == c->c_mapsz )
+		return 1;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, c->c_fd, 0);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "%s: mmap: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	if ( c->c_map )
+		munmap(c->c_map, c->c_mapsz);
+	madvise(map, st.st_size, MADV_RANDOM);
+	c->c_map = map;
+	c->c_mapsz = st.st_size;
+	return 1;
+}
+
+static struct _cola_kv *do_open(const char *fn, int rw, int create,
+				int overwrite, cola_cmp_fn cmp)
+{
+	struct _cola_kv *c;
+	int oflags;
+
+	c = calloc(1, sizeof(*c));
+	if ( NULL == c )
+		return NULL;
+
+	c->c_cmp = (cmp) ? cmp : bytes_cmp;
+	c->c_rw = rw;
+
+	if ( create ) {
+		oflags = O_RDWR | O_CREAT | ((overwrite) ? O_TRUNC : O_EXCL);
+	}else{
+		oflags = (rw) ? O_RDWR : O_RDONLY;
+	}
+
+	c->c_fd = open(fn, oflags, 0644);
+	if ( c->c_fd < 0 ) {
+		fprintf(stderr, "%s: open: %s: %s\n", cmd, fn, os_err());
+		goto out_free;
+	}
+
+	if ( create ) {
+		/* the other slot reads back as zeroes, and is skipped */
+		if ( ftruncate(c->c_fd, COLA_HDR_SIZE) ) {
+			fprintf(stderr, "%s: %s: ftruncate: %s\n",
+				cmd, fn, os_err());
+			goto out_close;
+		}
+		if ( !write_header(c) )
+			goto out_close;
+	}else if ( !read_header(c, fn) ) {
+		goto out_close;
+	}
+
+	if ( !remap(c) || !kbuf_fit(c) )
+		goto out_unmap;
+
+	return c;
+
+out_unmap:
+	if ( c->c_map )
+		munmap(c->c_map, c->c_mapsz);
+	free(c->c_kbuf);
+out_close:
+	close(c->c_fd);
+out_free:
+	free(c);
+	return NULL;
+}
+
+cola_kv_t cola_kv_open(const char *fn, int rw, cola_cmp_fn cmp)
+{
+	return do_open(fn, rw, 0, 0, cmp);
+}
+
+cola_kv_t cola_kv_creat(const char *fn, int overwrite, cola_cmp_fn cmp)
+{
+	return do_open(fn, 1, 1, overwrite, cmp);
+}
+
+static int ent_cmp(const void *A, const void *B, void *priv)
+{
+	const struct kv_ent *a = A, *b = B;
+	struct _cola_kv *c = priv;
+	int ret;
+
+	ret = (*c->c_cmp)(a->key, a->klen, b->key, b->klen);
+	if ( ret )
+		return ret;
+
+	return (a->seq < b->seq) - (a->seq > b->seq);
+}
+
+/* sort the buffer, newest first among copies, and keep only the newest */
+static void buf_sort(struct _cola_kv *c)
+{
+	size_t i, n;
+
+	if ( c->c_sorted == c->c_nbuf )
+		return;
+
+	qsort_r(c->c_buf, c->c_nbuf, sizeof(*c->c_buf), ent_cmp, c);
+
+	for(i = n = 0; i < c->c_nbuf; i++) {
+		struct kv_ent *e = c->c_buf + i;
+
+		if ( n && !(*c->c_cmp)(c->c_buf[n - 1].key,
+					c->c_buf[n - 1].klen,
+					e->key, e->klen) ) {
+			c->c_bufsz -= e->klen + e->vlen;
+			free(e->key);
+			continue;
+		}
+		c->c_buf[n++] = *e;
+	}
+
+	c->c_nbuf = c->c_sorted = n;
+}
+
+static void buf_clear(struct _cola_kv *c)
+{
+	size_t i;
+
+	for(i = 0; i < c->c_nbuf; i++)
+		free(c->c_buf[i].key);
+	c->c_nbuf = c->c_sorted = 0;
+	c->c_bufsz = 0;
+}
+
+/* the first entry not below key */
+static const struct kv_ent *buf_seek(struct _cola_kv *c,
+					const void *key, size_t klen)
+{
+	size_t lo = 0, hi = c->c_nbuf;
+
+	while ( lo < hi ) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct kv_ent *e = c->c_buf + mid;
+
+		if ( (*c->c_cmp)(e->key, e->klen, key, klen) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return c->c_buf + lo;
+}
+
+static void ent_load(struct kv_cur *cur)
+{
+	const struct kv_ent *e = cur->ent;
+
+	cur->valid = (e < cur->ent_end);
+	if ( !cur->valid )
+		return;
+
+	cur->key = e->key;
+	cur->klen = e->klen;
+	cur->val = e->key + e->klen;
+	cur->vlen = e->vlen;
+	cur->tomb = e->tomb;
+}
+
+static void blk_load(struct kv_cur *cur, uint64_t blk)
+{
+	const struct cola_kv_idx *idx = cur->idx + blk;
+	uint32_t nr;
+
+	cur->blk = blk;
+	cur->bstart = cur->base + idx->b_off;
+	memcpy(&nr, cur->bstart + idx->b_len - sizeof(nr), sizeof(nr));
+	cur->p = cur->bstart;
+	cur->end = cur->bstart + idx->b_len - (nr + 1) * sizeof(nr);
+}
+
+/* decode the entry at p, the key is built up in kbuf */
+static void cur_decode(struct kv_cur *cur)
+{
+	uint64_t shared, unshared, v;
+	const uint8_t *p = cur->p;
+
+	p = get_varint(p, &shared);
+	p = get_varint(p, &unshared);
+	p = get_varint(p, &v);
+
+	memcpy(cur->kbuf + shared, p, unshared);
+	cur->key = cur->kbuf;
+	cur->klen = shared + unshared;
+	p += unshared;
+
+	cur->tomb = v & 1;
+	cur->vlen = v >> 1;
+	cur->val = p;
+	cur->p = p + cur->vlen;
+	cur->valid = 1;
+}
+
+static void cur_next(struct kv_cur *cur)
+{
+	if ( cur->ent ) {
+		cur->ent++;
+		ent_load(cur);
+		return;
+	}
+
+	while ( cur->p == cur->end ) {
+		if ( cur->blk + 1 >= cur->nblk ) {
+			cur->valid = 0;
+			return;
+		}
+		blk_load(cur, cur->blk + 1);
+	}
+
+	cur_decode(cur);
+}
+
+/* the key of a restart point, which is stored whole */
+static const uint8_t *restart_key(const uint8_t *p, size_t *klen)
+{
+	uint64_t shared, unshared, v;
+
+	p = get_varint(p, &shared);
+	p = get_varint(p, &unshared);
+	p = get_varint(p, &v);
+	*klen = unshared;
+	return p;
+}
+
+/* on to the first entry not below key, from the block whose first key is
+ * the last not above it, and within that from the last restart point
+*/
+static void cur_seek(struct _cola_kv *c, struct kv_cur *cur,
+			const void *key, size_t klen)
+{
+	uint64_t lo, hi;
+	uint32_t nr, off;
+
+	if ( cur->ent ) {
+		cur->ent = buf_seek(c, key, klen);
+		ent_load(cur);
+		return;
+	}
+
+	for(lo = 0, hi = cur->nblk; hi - lo > 1; ) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		const struct cola_kv_idx *idx = cur->idx + mid;
+
+		if ( (*c->c_cmp)(cur->base + idx->b_key, idx->b_klen,
+					key, klen) <= 0 )
+			lo = mid;
+		else
+			hi = mid;
+	}
+	blk_load(cur, lo);
+
+	memcpy(&nr, cur->bstart + cur->idx[lo].b_len - sizeof(nr), sizeof(nr));
+	for(lo = 0, hi = nr; hi - lo > 1; ) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		const uint8_t *k;
+		size_t len;
+
+		memcpy(&off, cur->end + mid * sizeof(off), sizeof(off));
+		k = restart_key(cur->bstart + off, &len);
+		if ( (*c->c_cmp)(k, len, key, klen) <= 0 )
+			lo = mid;
+		else
+			hi = mid;
+	}
+	memcpy(&off, cur->end + lo * sizeof(off), sizeof(off));
+	cur->p = cur->bstart + off;
+
+	for(cur_next(cur); cur->valid; cur_next(cur)) {
+		if ( (*c->c_cmp)(cur->key, cur->klen, key, klen) >= 0 )
+			break;
+	}
+}
+
+static void cur_level(struct _cola_kv *c, struct kv_cur *cur,
+			const struct cola_kv_level *l, uint8_t *kbuf)
+{
+	cur->base = c->c_map + l->l_off;
+	cur->idx = (const struct cola_kv_idx *)(cur->base + l->l_idx);
+	cur->nblk = l->l_nblk;
+	cur->kbuf = kbuf;
+}
+
+static void cur_first(struct kv_cur *cur)
+{
+	if ( cur->ent ) {
+		ent_load(cur);
+		return;
+	}
+
+	blk_load(cur, 0);
+	cur_next(cur);
+}
+
+static int src_lt(struct kv_merge *m, unsigned int a, unsigned int b)
+{
+	const struct kv_cur *x = m->src + a, *y = m->src + b;
+	int ret;
+
+	ret = (*m->c->c_cmp)(x->key, x->klen, y->key, y->klen);
+	if ( ret )
+		return ret < 0;
+	return a < b;
+}
+
+static void sift_down(struct kv_merge *m, unsigned int i)
+{
+	for(;;) {
+		unsigned int l = 2 * i + 1, r = l + 1, min = i, tmp;
+
+		if ( l < m->nheap && src_lt(m, m->heap[l], m->heap[min]) )
+			min = l;
+		if ( r < m->nheap && src_lt(m, m->heap[r], m->heap[min]) )
+			min = r;
+		if ( min == i )
+			return;
+
+		tmp = m->heap[i];
+		m->heap[i] = m->heap[min];
+		m->heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void heap_push(struct kv_merge *m, unsigned int s)
+{
+	unsigned int i = m->nheap++;
+
+	while ( i ) {
+		unsigned int p = (i - 1) / 2;
+
+		if ( !src_lt(m, s, m->heap[p]) )
+			break;
+		m->heap[i] = m->heap[p];
+		i = p;
+	}
+	m->heap[i] = s;
+}
+
+static void heap_pop(struct kv_merge *m)
+{
+	m->heap[0] = m->heap[--m->nheap];
+	sift_down(m, 0);
+}
+
+/* the write buffer, if it's included, then the levels below nlvl which are
+ * live, newest first
+*/
+static int merge_init(struct _cola_kv *c, struct kv_merge *m,
+			int buf, unsigned int nlvl)
+{
+	unsigned int i;
+
+	memset(m, 0, sizeof(*m));
+	m->c = c;
+
+	if ( buf && c->c_nbuf ) {
+		struct kv_cur *cur = m->src + m->nsrc++;
+
+		buf_sort(c);
+		cur->ent = c->c_buf;
+		cur->ent_end = c->c_buf + c->c_nbuf;
+	}
+
+	for(i = 0; i < nlvl; i++) {
+		const struct cola_kv_level *l = c->c_hdr.h_lvl + i;
+		struct kv_cur *cur;
+		uint8_t *kbuf;
+
+		if ( !live(l) )
+			continue;
+
+		kbuf = malloc(l->l_maxkey + 1);
+		if ( NULL == kbuf ) {
+			fprintf(stderr, "%s: malloc: %s\n", cmd, os_err());
+			return 0;
+		}
+
+		cur = m->src + m->nsrc++;
+		cur_level(c, cur, l, kbuf);
+	}
+
+	return 1;
+}
+
+/* after the sources have been positioned */
+static void merge_start(struct kv_merge *m)
+{
+	unsigned int i;
+
+	for(i = 0; i < m->nsrc; i++) {
+		if ( m->src[i].valid )
+			heap_push(m, i);
+	}
+}
+
+static void merge_free(struct kv_merge *m)
+{
+	unsigned int i;
+
+	for(i = 0; i < m->nsrc; i++)
+		free(m->src[i].kbuf);
+}
+
+/* The newest copy of the next key, tombstones included. It stays out of the
+ * heap until the next call, so that its key isn't overwritten, and the older
+ * copies are skipped meanwhile.
+*/
+static const struct kv_cur *merge_next(struct kv_merge *m)
+{
+	const struct kv_cur *top;
+	unsigned int s;
+
+	if ( m->pending ) {
+		struct kv_cur *cur = m->src + m->out;
+
+		cur_next(cur);
+		if ( cur->valid )
+			heap_push(m, m->out);
+		m->pending = 0;
+	}
+
+	if ( !m->nheap )
+		return NULL;
+
+	s = m->heap[0];
+	top = m->src + s;
+	heap_pop(m);
+
+	while ( m->nheap ) {
+		struct kv_cur *dup = m->src + m->heap[0];
+
+		if ( (*m->c->c_cmp)(dup->key, dup->klen,
+					top->key, top->klen) )
+			break;
+
+		cur_next(dup);
+		if ( dup->valid )
+			sift_down(m, 0);
+		else
+			heap_pop(m);
+	}
+
+	m->out = s;
+	m->pending = 1;
+	return top;
+}
+
+static int build_flush(struct kv_build *b)
+{
+	if ( !b->wlen )
+		return 1;
+
+	if ( !fd_pwrite(b->c->c_fd, b->off + b->pos - b->wlen,
+				b->wbuf, b->wlen) ) {
+		fprintf(stderr, "%s: pwrite: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	b->wlen = 0;
+	return 1;
+}
+
+static int emit(struct kv_build *b, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while ( len ) {
+		size_t n = KV_WRBUF - b->wlen;
+
+		if ( n > len )
+			n = len;
+		memcpy(b->wbuf + b->wlen, p, n);
+		b->wlen += n;
+		b->pos += n;
+		p += n;
+		len -= n;
+
+		if ( b->wlen == KV_WRBUF && !build_flush(b) )
+			return 0;
+	}
+
+	return 1;
+}
+
+static int build_init(struct kv_build *b, struct _cola_kv *c, off_t off)
+{
+	memset(b, 0, sizeof(*b));
+	b->c = c;
+	b->off = off;
+	b->wbuf = malloc(KV_WRBUF);
+	if ( NULL == b->wbuf ) {
+		fprintf(stderr, "%s: malloc: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	return 1;
+}
+
+static void build_free(struct kv_build *b)
+{
+	free(b->wbuf);
+	free(b->rst);
+	free(b->last);
+	free(b->idx);
+	free(b->keys);
+}
+
+static int block_end(struct kv_build *b)
+{
+	uint32_t nr = b->nrst;
+
+	if ( !emit(b, b->rst, b->nrst * sizeof(*b->rst)) ||
+			!emit(b, &nr, sizeof(nr)) )
+		return 0;
+
+	b->idx[b->nidx - 1].b_len = b->pos - b->bstart;
+	b->nent = 0;
+	b->nrst = 0;
+	return 1;
+}
+
+static int build_add(struct kv_build *b, const struct kv_cur *e)
+{
+	uint8_t hdr[KV_MAXHDR], *p;
+	size_t shared = 0;
+
+	if ( b->nent && b->pos - b->bstart + e->klen + e->vlen + KV_MAXHDR +
+			(b->nrst + 2) * sizeof(*b->rst) > KV_BLOCK ) {
+		if ( !block_end(b) )
+			return 0;
+	}
+
+	if ( !b->nent ) {
+		struct cola_kv_idx *idx;
+
+		p = grow(b->idx, &b->idxmax, b->nidx + 1, sizeof(*b->idx));
+		if ( NULL == p )
+			return 0;
+		b->idx = (struct cola_kv_idx *)p;
+
+		p = grow(b->keys, &b->keymax, b->keylen + e->klen, 1);
+		if ( NULL == p )
+			return 0;
+		b->keys = p;
+
+		b->bstart = b->pos;
+		idx = b->idx + b->nidx++;
+		idx->b_off = b->pos;
+		idx->b_klen = e->klen;
+		idx->b_key = b->keylen; /* fixed up once the index is placed */
+		memcpy(b->keys + b->keylen, e->key, e->klen);
+		b->keylen += e->klen;
+	}
+
+	if ( b->nent % COLA_KV_RESTART ) {
+		size_t max = (e->klen < b->lastlen) ? e->klen : b->lastlen;
+
+		while ( shared < max && b->last[shared] == e->key[shared] )
+			shared++;
+	}else{
+		p = grow(b->rst, &b->rstmax, b->nrst + 1, sizeof(*b->rst));
+		if ( NULL == p )
+			return 0;
+		b->rst = (uint32_t *)p;
+		b->rst[b->nrst++] = b->pos - b->bstart;
+	}
+
+	p = put_varint(hdr, shared);
+	p = put_varint(p, e->klen - shared);
+	p = put_varint(p, ((uint64_t)e->vlen << 1) | !!e->tomb);
+	if ( !emit(b, hdr, p - hdr) ||
+			!emit(b, e->key + shared, e->klen - shared) ||
+			!emit(b, e->val, e->vlen) )
+		return 0;
+
+	p = grow(b->last, &b->lastmax, e->klen, 1);
+	if ( NULL == p )
+		return 0;
+	b->last = p;
+	memcpy(b->last + shared, e->key + shared, e->klen - shared);
+	b->lastlen = e->klen;
+
+	b->nent++;
+	b->l.l_nelem++;
+	b->l.l_raw += ent_size(e->klen, e->vlen);
+	if ( e->klen > b->l.l_maxkey )
+		b->l.l_maxkey = e->klen;
+	return 1;
+}
+
+/* the index, then the first keys it points to */
+static int build_finish(struct kv_build *b)
+{
+	uint64_t keys;
+	size_t i;
+
+	if ( b->nent && !block_end(b) )
+		return 0;
+
+	b->l.l_idx = b->pos;
+	b->l.l_nblk = b->nidx;
+	keys = b->pos + b->nidx * sizeof(*b->idx);
+	for(i = 0; i < b->nidx; i++)
+		b->idx[i].b_key += keys;
+
+	if ( !emit(b, b->idx, b->nidx * sizeof(*b->idx)) ||
+			!emit(b, b->keys, b->keylen) ||
+			!build_flush(b) )
+		return 0;
+
+	b->l.l_off = b->off;
+	b->l.l_len = b->pos;
+	return 1;
+}
+
+static uint64_t align(uint64_t x)
+{
+	return (x + KV_ALIGN - 1) & ~(uint64_t)(KV_ALIGN - 1);
+}
+
+/* the lowest gap between live levels, or the end of them, with room */
+static uint64_t kv_alloc(struct _cola_kv *c, uint64_t sz)
+{
+	uint64_t at = COLA_HDR_SIZE;
+	unsigned int i;
+	int moved;
+
+	do {
+		moved = 0;
+		for(i = 0; i < COLA_KV_LEVELS; i++) {
+			const struct cola_kv_level *l = c->c_hdr.h_lvl + i;
+
+			if ( !live(l) )
+				continue;
+			if ( at < l->l_off + l->l_len && l->l_off < at + sz ) {
+				at = align(l->l_off + l->l_len);
+				moved = 1;
+			}
+		}
+	}while(moved);
+
+	return at;
+}
+
+/* give back any space past the last live level */
+static int kv_trim(struct _cola_kv *c)
+{
+	uint64_t end = COLA_HDR_SIZE;
+	unsigned int i;
+
+	for(i = 0; i < COLA_KV_LEVELS; i++) {
+		const struct cola_kv_level *l = c->c_hdr.h_lvl + i;
+
+		if ( live(l) && align(l->l_off + l->l_len) > end )
+			end = align(l->l_off + l->l_len);
+	}
+
+	if ( end < c->c_mapsz && ftruncate(c->c_fd, end) ) {
+		fprintf(stderr, "%s: ftruncate: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	return remap(c);
+}
+
+/* Merge the write buffer and every level below the first empty one in to
+ * it, as when incrementing a binary counter. The new level goes in space
+ * that no live level uses, so a crash before the header is written leaves
+ * the old ones intact, and theirs is free once it has been. Tombstones are
+ * dropped when nothing older is left above.
+*/
+static int kv_flush(struct _cola_kv *c)
+{
+	struct kv_merge m;
+	struct kv_build b;
+	const struct kv_cur *e;
+	uint64_t raw = 0, nelem, maxkey = 0, nblk, bound;
+	unsigned int i, lvl;
+	int drop = 1, ret = 0;
+
+	if ( !c->c_nbuf )
+		return 1;
+
+	buf_sort(c);
+
+	for(i = 0; i < c->c_nbuf; i++) {
+		raw += ent_size(c->c_buf[i].klen, c->c_buf[i].vlen);
+		if ( c->c_buf[i].klen > maxkey )
+			maxkey = c->c_buf[i].klen;
+	}
+
+	nelem = c->c_nbuf;
+	for(lvl = 0; lvl < COLA_KV_LEVELS; lvl++) {
+		const struct cola_kv_level *l = c->c_hdr.h_lvl + lvl;
+
+		if ( !live(l) )
+			break;
+		raw += l->l_raw;
+		nelem += l->l_nelem;
+		if ( l->l_maxkey > maxkey )
+			maxkey = l->l_maxkey;
+	}
+
+	if ( lvl == COLA_KV_LEVELS ) {
+		fprintf(stderr, "%s: cola is full\n", cmd);
+		return 0;
+	}
+
+	for(i = lvl + 1; i < COLA_KV_LEVELS; i++) {
+		if ( live(c->c_hdr.h_lvl + i) )
+			drop = 0;
+	}
+
+	/* Any two blocks in a row hold more than KV_BLOCK, since the first was
+	 * cut before the entry which starts the second. Each block has an index
+	 * entry and a key, and restart points every so often.
+	*/
+	nblk = 2 * raw / KV_BLOCK + 1;
+	bound = raw + nblk * (sizeof(struct cola_kv_idx) + maxkey +
+				2 * sizeof(uint32_t)) +
+		(nelem / COLA_KV_RESTART) * sizeof(uint32_t);
+
+	if ( !merge_init(c, &m, 1, lvl) )
+		goto out_merge;
+	for(i = 0; i < m.nsrc; i++)
+		cur_first(m.src + i);
+	merge_start(&m);
+
+	if ( !build_init(&b, c, kv_alloc(c, bound)) )
+		goto out_merge;
+
+	while ( (e = merge_next(&m)) ) {
+		if ( drop && e->tomb )
+			continue;
+		if ( !build_add(&b, e) )
+			goto out_build;
+	}
+
+	if ( !build_finish(&b) )
+		goto out_build;
+
+	if ( fdatasync(c->c_fd) ) {
+		fprintf(stderr, "%s: fdatasync: %s\n", cmd, os_err());
+		goto out_build;
+	}
+
+	for(i = 0; i < lvl; i++) {
+		c->c_hdr.h_nelem -= c->c_hdr.h_lvl[i].l_nelem;
+		memset(c->c_hdr.h_lvl + i, 0, sizeof(c->c_hdr.h_lvl[i]));
+	}
+	c->c_hdr.h_lvl[lvl] = b.l;
+	c->c_hdr.h_nelem += b.l.l_nelem;
+	c->c_hdr.h_seq++;
+	if ( !write_header(c) )
+		goto out_build;
+
+	buf_clear(c);
+	ret = kv_trim(c) && kbuf_fit(c);
+
+out_build:
+	build_free(&b);
+out_merge:
+	merge_free(&m);
+	return ret;
+}
+
+static int kv_add(struct _cola_kv *c, const void *key, size_t klen,
+			const void *val, size_t vlen, int tomb)
+{
+	struct kv_ent *e;
+
+	if ( !c->c_rw ) {
+		fprintf(stderr, "%s: cola is read-only\n", cmd);
+		return 0;
+	}
+
+	e = grow(c->c_buf, &c->c_bufmax, c->c_nbuf + 1, sizeof(*c->c_buf));
+	if ( NULL == e )
+		return 0;
+
+	c->c_buf = e;
+	e += c->c_nbuf;
+	e->key = malloc(klen + vlen + 1);
+	if ( NULL == e->key ) {
+		fprintf(stderr, "%s: malloc: %s\n", cmd, os_err());
+		return 0;
+	}
+
+	memcpy(e->key, key, klen);
+	if ( vlen )
+		memcpy(e->key + klen, val, vlen);
+	e->klen = klen;
+	e->vlen = vlen;
+	e->seq = c->c_seq++;
+	e->tomb = tomb;
+	c->c_nbuf++;
+	c->c_bufsz += klen + vlen;
+
+	if ( c->c_bufsz >= KV_BUFFER )
+		return kv_flush(c);
+
+	return 1;
+}
+
+int cola_kv_put(cola_kv_t c, const void *key, size_t klen,
+			const void *val, size_t vlen)
+{
+	return kv_add(c, key, klen, val, vlen, 0);
+}
+
+int cola_kv_delete(cola_kv_t c, const void *key, size_t klen)
+{
+	return kv_add(c, key, klen, NULL, 0, 1);
+}
+
+/* the write buffer then each level, the first copy found is the newest */
+int cola_kv_get(cola_kv_t c, const void *key, size_t klen,
+			const void **val, size_t *vlen, int *result)
+{
+	struct kv_cur cur;
+	unsigned int i;
+
+	*result = 0;
+	for(i = 0; i <= COLA_KV_LEVELS; i++) {
+		memset(&cur, 0, sizeof(cur));
+		if ( !i ) {
+			if ( !c->c_nbuf )
+				continue;
+			buf_sort(c);
+			cur.ent = c->c_buf;
+			cur.ent_end = c->c_buf + c->c_nbuf;
+		}else{
+			const struct cola_kv_level *l = c->c_hdr.h_lvl + i - 1;
+
+			if ( !live(l) )
+				continue;
+			cur_level(c, &cur, l, c->c_kbuf);
+		}
+
+		cur_seek(c, &cur, key, klen);
+		if ( !cur.valid ||
+				(*c->c_cmp)(cur.key, cur.klen, key, klen) )
+			continue;
+
+		if ( !cur.tomb ) {
+			*val = cur.val;
+			*vlen = cur.vlen;
+			*result = 1;
+		}
+		break;
+	}
+
+	return 1;
+}
+
+cola_kv_iter_t cola_kv_iter_open(cola_kv_t c, const void *lo, size_t lolen,
+				const void *hi, size_t hilen)
+{
+	struct _cola_kv_iter *it;
+	unsigned int i;
+
+	it = calloc(1, sizeof(*it));
+	if ( NULL == it ) {
+		fprintf(stderr, "%s: calloc: %s\n", cmd, os_err());
+		return NULL;
+	}
+
+	if ( hi ) {
+		it->hi = malloc(hilen + 1);
+		if ( NULL == it->hi ) {
+			fprintf(stderr, "%s: malloc: %s\n", cmd, os_err());
+			free(it);
+			return NULL;
+		}
+		memcpy(it->hi, hi, hilen);
+		it->hilen = hilen;
+		it->has_hi = 1;
+	}
+
+	if ( !merge_init(c, &it->m, 1, COLA_KV_LEVELS) ) {
+		cola_kv_iter_close(it);
+		return NULL;
+	}
+
+	for(i = 0; i < it->m.nsrc; i++) {
+		if ( lo )
+			cur_seek(c, it->m.src + i, lo, lolen);
+		else
+			cur_first(it->m.src + i);
+	}
+	merge_start(&it->m);
+
+	return it;
+}
+
+int cola_kv_iter_next(cola_kv_iter_t it, const void **key, size_t *klen,
+			const void **val, size_t *vlen, int *result)
+{
+	const struct kv_cur *e;
+
+	*result = 0;
+	while ( (e = merge_next(&it->m)) ) {
+		if ( it->has_hi && (*it->m.c->c_cmp)(e->key, e->klen,
+						it->hi, it->hilen) > 0 )
+			break;
+		if ( e->tomb )
+			continue;
+
+		*key = e->key;
+		*klen = e->klen;
+		*val = e->val;
+		*vlen = e->vlen;
+		*result = 1;
+		break;
+	}
+
+	return 1;
+}
+
+void cola_kv_iter_close(cola_kv_iter_t it)
+{
+	if ( it ) {
+		merge_free(&it->m);
+		free(it->hi);
+		free(it);
+	}
+}
+
+int cola_kv_sync(cola_kv_t c)
+{
+	return kv_flush(c);
+}
+
+int cola_kv_close(cola_kv_t c)
+{
+	int ret = 1;
+
+	if ( c ) {
+		if ( c->c_rw && !kv_flush(c) )
+			ret = 0;
+		buf_clear(c);
+		free(c->c_buf);
+		free(c->c_kbuf);
+		if ( c->c_map && munmap(c->c_map, c->c_mapsz) )
+			ret = 0;
+		if ( close(c->c_fd) )
+			ret = 0;
+		free(c);
+	}
+
+	return ret;
+}
@@ -0,0 +1,90 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include <epoch.h>
+#include <compiler.h>
+
+/* reader counts are spread over cache lines to keep readers off each other */
+#define EPOCH_SLOTS	64U
+#define CACHELINE	64U
+
+/* Readers count themselves in under the parity of the generation they saw,
+ * and back out and retry if it has moved on since. A sync moves it on and
+ * then waits for the count under the old parity to drain. Any reader from
+ * the generation before that was waited for by the previous sync.
+*/
+struct epoch_slot {
+	unsigned long n[2];
+} __attribute__((aligned(CACHELINE)));
+
+struct epoch {
+	struct epoch_slot slot[EPOCH_SLOTS];
+	unsigned long gen;
+};
+
+static unsigned int next_slot;
+static __thread unsigned int my_slot = ~0U;
+
+struct epoch *epoch_new(void)
+{
+	struct epoch *e;
+
+	if ( posix_memalign((void **)&e, CACHELINE, sizeof(*e)) )
+		return NULL;
+
+	memset(e, 0, sizeof(*e));
+	return e;
+}
+
+void epoch_free(struct epoch *e)
+{
+	free(e);
+}
+
+unsigned int epoch_enter(struct epoch *e)
+{
+	struct epoch_slot *s;
+	unsigned long gen;
+
+	if ( my_slot == ~0U ) {
+		my_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) %
+				EPOCH_SLOTS;
+	}
+	s = e->slot + my_slot;
+
+	for(;;) {
+		gen = __atomic_load_n(&e->gen, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&s->n[gen & 1], 1, __ATOMIC_SEQ_CST);
+		if ( __atomic_load_n(&e->gen, __ATOMIC_SEQ_CST) == gen )
+			break;
+		__atomic_fetch_sub(&s->n[gen & 1], 1, __ATOMIC_RELEASE);
+	}
+
+	return (my_slot << 1) | (gen & 1);
+}
+
+void epoch_exit(struct epoch *e, unsigned int ticket)
+{
+	struct epoch_slot *s = e->slot + (ticket >> 1);
+
+	__atomic_fetch_sub(&s->n[ticket & 1], 1, __ATOMIC_RELEASE);
+}
+
+void epoch_sync(struct epoch *e)
+{
+	unsigned long gen;
+	unsigned int i;
+
+	gen = __atomic_fetch_add(&e->gen, 1, __ATOMIC_SEQ_CST);
+	for(i = 0; i < EPOCH_SLOTS; i++) {
+		while ( __atomic_load_n(&e->slot[i].n[gen & 1],
+					__ATOMIC_ACQUIRE) )
+			sched_yield();
+	}
+}
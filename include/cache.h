@@ -0,0 +1,33 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#ifndef _CACHE_H
+#define _CACHE_H
+
+/* A cache of the file's blocks, for a file descriptor which may be opened
+ * with O_DIRECT since every read is of whole, aligned blocks. Replacement is
+ * 2Q: new blocks go in to a FIFO and are only promoted to the LRU if they're
+ * asked for again once they've fallen out, so a run of one-off reads can't
+ * push out the blocks which are used over and over. Safe for many threads.
+*/
+#define CACHE_BLOCK 4096U
+
+struct cache;
+
+struct cache *cache_new(int fd, size_t size);
+void cache_free(struct cache *m);
+
+/* errno is 0 if the read was short */
+int cache_read(struct cache *m, uint64_t ofs, void *buf, size_t len)
+		_check_result;
+
+/* drop any blocks overlapping a range which has been written, after it's
+ * been written, so that no read which started before it can be cached
+*/
+void cache_invalidate(struct cache *m, uint64_t ofs, uint64_t len);
+
+void cache_stats(struct cache *m, uint64_t *hits, uint64_t *misses);
+
+#endif /* _CACHE_H */
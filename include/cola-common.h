@@ -14,6 +14,9 @@
 typedef uint64_t cola_key_t;
 typedef uint64_t cola_val_t;
 
+/* the value stored for a deleted key, it can't be put */
+#define COLA_TOMBSTONE ((cola_val_t)~0ULL)
+
 static inline int cola_parse_key(const char *str, cola_key_t *val)
 {
 	char *end;
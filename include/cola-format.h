@@ -10,15 +10,37 @@
 
 #define COLA_MAGIC (0xc0U | (0x00U << 8) | ('L' << 16) | (('A') << 24))
 
-#define COLA_CURRENT_VER 2
+#define COLA_CURRENT_VER 8
 /* version 0: basic COLA
  * version 1: fractional cascading
  * version 2: page aligned basic cola
+ * version 3: page sized header, each level followed by lookahead array
+ * version 4: bloom filter after each lookahead array
+ * version 5: two copies of a checksummed header, plus a write-ahead log
+ * version 6: variable length keys and values, see struct cola_kv_hdr
+ * version 7: levels from h_packlvl up are packed, see struct cola_pidx
+ * version 8: levels from h_collvl up hold all their keys, then all their values
+*/
+#define COLA_KV_VER 6
+#define COLA_HDR_SIZE 4096U
+
+/* The header is written alternately to the two halves of the header page,
+ * the valid copy with the highest sequence number is current. h_nelem only
+ * counts the levels made durable by the commit which wrote it, everything
+ * from log record h_lsn on is replayed from the log.
 */
 struct cola_hdr {
 	cola_key_t h_nelem; /* number of keys */
 	uint32_t h_magic;
 	uint32_t h_vers;
+	uint64_t h_seq;
+	uint64_t h_lsn;
+	cola_key_t h_short; /* survivors of a merge yet to be spilled */
+	uint32_t h_shortlvl; /* ... out of this level */
+	uint32_t h_clean; /* lookahead arrays are all valid */
+	uint32_t h_packlvl; /* zero if no levels are packed */
+	uint32_t h_collvl; /* ... or split in to columns, below h_packlvl */
+	uint64_t h_sum;
 } _packed;
 
 struct cola_elem {
@@ -26,4 +48,96 @@ struct cola_elem {
 	cola_val_t val;
 } _packed;
 
+/* lookahead entry: a key sampled from the level above merged with its own
+ * lookahead array, and the count of real elements which precede it there
+*/
+struct cola_la {
+	cola_key_t key;
+	cola_key_t real;
+} _packed;
+
+/* A packed level is a series of blocks of COLA_PACK_ELEM entries, the last
+ * one maybe short, each either as it is or a struct cola_pblk and then the
+ * differences between successive keys followed by each value less the
+ * smallest, bit-packed at the widths given. The first key is in the index:
+ * one struct cola_pidx per block, and one more for the end of the last, at the
+ * end of the space reserved for the level's lookahead array.
+*/
+#define COLA_PACK_ELEM 256U
+#define COLA_PACK_RAW (1ULL << 63) /* in p_pos, the block isn't packed */
+
+struct cola_pidx {
+	cola_key_t p_key; /* first key */
+	uint64_t p_pos; /* from the start of the level */
+} _packed;
+
+struct cola_pblk {
+	uint16_t b_nelem;
+	uint8_t b_kbits;
+	uint8_t b_vbits;
+	cola_val_t b_vbase;
+} _packed;
+
+/* The log, in <fn>.wal, is a header then one record per item inserted since
+ * the oldest that isn't yet in a durable level. Each record carries the low
+ * bits of its sequence number and a checksum so a torn tail is spotted.
+*/
+#define COLA_WAL_MAGIC (0xc0U | ('W' << 8) | ('A' << 16) | (('L') << 24))
+#define COLA_WAL_VER 1
+struct cola_wal_hdr {
+	uint32_t w_magic;
+	uint32_t w_vers;
+	uint64_t w_lsn; /* sequence number of the first record */
+} _packed;
+
+struct cola_wal_rec {
+	cola_key_t key;
+	cola_val_t val;
+	uint32_t seq;
+	uint32_t sum;
+} _packed;
+
+/* Version 6 files hold byte string keys and values, ordered by a user
+ * comparator. The header has the same two slots as version 5, and a table of
+ * levels instead of the implicit layout. Level i holds the merge of up to 2^i
+ * write buffers' worth, anywhere in the file past the header page.
+ *
+ * A level is a run of data blocks then the block index. Each block is a
+ * series of entries followed by the uint32_t offsets of its restart points
+ * and their count. An entry is three varints, the number of bytes shared
+ * with the previous key, the number which follow, and the value length times
+ * two plus one for a tombstone, then the rest of the key and the value. The
+ * first entry of a block, and every COLA_KV_RESTART'th after, shares nothing
+ * so that blocks may be binary searched. The index has one struct cola_kv_idx
+ * per block, then the first key of each.
+*/
+#define COLA_KV_LEVELS 32U
+#define COLA_KV_RESTART 16U
+
+struct cola_kv_level {
+	uint64_t l_off; /* in the file */
+	uint64_t l_len; /* blocks and index */
+	uint64_t l_idx; /* index offset from l_off */
+	uint64_t l_nblk;
+	uint64_t l_nelem; /* zero if the level is empty */
+	uint64_t l_raw; /* size of the entries sharing nothing, see kv_flush() */
+	uint64_t l_maxkey; /* longest key */
+} _packed;
+
+struct cola_kv_hdr {
+	cola_key_t h_nelem; /* entries in all levels, older copies included */
+	uint32_t h_magic;
+	uint32_t h_vers;
+	uint64_t h_seq;
+	struct cola_kv_level h_lvl[COLA_KV_LEVELS];
+	uint64_t h_sum;
+} _packed;
+
+struct cola_kv_idx {
+	uint64_t b_off; /* from the start of the level */
+	uint32_t b_len;
+	uint32_t b_klen;
+	uint64_t b_key; /* first key, from the start of the level */
+} _packed;
+
 #endif /* _COLA_FORMAT_H */
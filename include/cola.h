@@ -6,16 +6,181 @@
 #ifndef _COLA_H
 #define _COLA_H
 
+#include <stddef.h>
+
 #include "cola-common.h"
 
 typedef struct _cola *cola_t;
+typedef struct _cola_iter *cola_iter_t;
 extern const char *cmd;
 
 cola_t cola_open(const char *fn, int rw);
 cola_t cola_creat(const char *fn, int overwrite); /* always rw */
 int cola_insert(cola_t c, cola_key_t key);
+int cola_insert_batch(cola_t c, const cola_key_t *keys, size_t n);
 int cola_query(cola_t c, cola_key_t key, int *result);
+int cola_query_batch(cola_t c, const cola_key_t *keys, size_t n,
+			int *results);
+int cola_put(cola_t c, cola_key_t key, cola_val_t val);
+int cola_get(cola_t c, cola_key_t key, cola_val_t *val, int *result);
+int cola_delete(cola_t c, cola_key_t key);
 int cola_dump(cola_t c);
+
+/* scan keys in [lo, hi], newest value of each, in order. The cola must not
+ * be modified while an iterator is open, or in thread-safe mode, not by the
+ * thread which holds it.
+*/
+cola_iter_t cola_iter_open(cola_t c, cola_key_t lo, cola_key_t hi);
+int cola_iter_next(cola_iter_t it, cola_key_t *key, cola_val_t *val,
+			int *result);
+void cola_iter_close(cola_iter_t it);
+
+/* Combines two copies of a key, the newer one first. Copies are folded newest
+ * first, up to any tombstone, by merges and lookups alike, so the operator
+ * ought to be associative. It isn't stored in the file and must be set the
+ * same every time the cola is opened, before it's used, since the log is
+ * replayed then. The default, NULL, is for the newest copy to win.
+*/
+typedef cola_val_t (*cola_merge_fn)(cola_val_t newer, cola_val_t older);
+cola_val_t cola_merge_replace(cola_val_t newer, cola_val_t older);
+cola_val_t cola_merge_sum(cola_val_t newer, cola_val_t older);
+cola_val_t cola_merge_max(cola_val_t newer, cola_val_t older);
+int cola_merge_op(cola_t c, cola_merge_fn fn);
+
+/* Inserts are buffered in memory, 1MB by default, and flushed in to the
+ * levels as one sorted run when it fills up. The size is rounded down to a
+ * power of two items, 0 disables the buffer.
+*/
+int cola_memtable(cola_t c, size_t size);
+
+/* Items are logged as they're inserted and the log is synced every thousand
+ * or so, they're only sure to survive a crash once this returns.
+*/
+int cola_sync(cola_t c);
+
+/* From then on any number of threads may look things up, query or scan
+ * while one at a time inserts. Readers see the levels as they were when they
+ * started and never wait for a merge. Not with background merges, which
+ * aren't allowed once this is set.
+*/
+int cola_threadsafe(cola_t c);
+
+/* Any number of processes may open the cola read-only while one writes to
+ * it. Readers see it as of the writer's last commit, which leaves out the
+ * smaller levels and the write buffer. Every read checks for a newer commit
+ * and picks it up, as does this. In thread-safe mode it waits for other
+ * threads' iterators, as the writer does.
+*/
+int cola_refresh(cola_t c);
+
+/* Levels from lvl up are packed: each block of 256 entries is stored as the
+ * differences between its keys and its values less the smallest, bit-packed,
+ * with an index of the first keys. That suits keys which are close together.
+ * It's recorded in the file, and may only be changed, or set to 0 to stop,
+ * while every level it affects is empty. lvl must be 12 or more.
+*/
+int cola_pack(cola_t c, unsigned int lvl);
+
+/* Levels from lvl up, other than packed ones, hold all of their keys then all
+ * of their values, so that searches only touch keys. Set and recorded like
+ * cola_pack(), lvl must be 8 or more.
+*/
+int cola_columns(cola_t c, unsigned int lvl);
+
+/* Fill an empty cola from items in any order, later copies of a key being
+ * the newer. They're sorted in runs of up to mem bytes' worth, or 256MB if
+ * it's 0, which are kept in an unnamed file in tmpdir if there's more than
+ * one, then merged straight in to the levels: everything is written once.
+ * feed returns 1 for each item, 0 at the end or -1 on error.
+*/
+typedef int (*cola_feed_fn)(void *priv, cola_key_t *key, cola_val_t *val);
+int cola_bulk_load(cola_t c, cola_feed_fn feed, void *priv, size_t mem,
+			const char *tmpdir);
+
+/* Levels are mapped from the smallest up to map bytes of the file, or all of
+ * them if it's 0 (8MB on 32 bit hosts), and the rest are read and written
+ * through the page cache. Levels which end more than rss bytes in to the file
+ * are cold: merges drop their pages once they're done with them, so that
+ * streaming through them doesn't push out the hotter levels below. 0 for no
+ * limit. Either way merges ask for read-ahead and lookups for none.
+*/
+int cola_map_budget(cola_t c, size_t map, size_t rss);
+
+/* Lookups' reads of levels which aren't mapped go through a cache of size
+ * bytes of 4KB blocks, read with O_DIRECT where the filesystem allows it, or
+ * not if it's 0. It's 2Q so that scans don't flush it, and merges don't go
+ * through it at all, so the blocks which lookups keep coming back to stay put
+ * while a big merge streams past. Use it with cola_map_budget(), which says
+ * which levels aren't mapped, and keep rss small. It has to be set before
+ * cola_threadsafe() and is shared by every thread.
+*/
+int cola_cache(cola_t c, size_t size);
+
+/* Counters for the handle, kept in memory from when cola_stats_enable() is
+ * first called, which also zeroes them, until it's closed. Until then the
+ * hot paths only test a pointer. Views share them in thread-safe mode.
+ * Probes are counted for cola_query() and cola_get(), not batches.
+*/
+#define COLA_STATS_LEVELS 64
+struct cola_level_stats {
+	uint64_t nelem; /* entries in the level now */
+	uint64_t merges; /* merges in to the level */
+	uint64_t merged; /* entries that they wrote */
+	uint64_t spills; /* times it was filled by a short merge above */
+	uint64_t spilled;
+	uint64_t bytes; /* written by both, as 16 byte entries */
+	uint64_t nsec; /* spent merging in to it */
+	uint64_t probes; /* lookups which searched it */
+};
+struct cola_stats {
+	uint64_t lookups;
+	uint64_t flushes; /* of the write buffer */
+	uint64_t remaps;
+	uint64_t cache_hits; /* reads wholly from cola_cache(), and the rest */
+	uint64_t cache_misses;
+	uint64_t depth[COLA_STATS_LEVELS + 1]; /* lookups by levels searched */
+	unsigned int nlevels;
+	struct cola_level_stats level[COLA_STATS_LEVELS];
+};
+int cola_stats_enable(cola_t c);
+int cola_stats(cola_t c, struct cola_stats *st);
+
+int cola_bgmerge(cola_t c, unsigned int lvl); /* 0 to disable */
+int cola_merge_threads(cola_t c, unsigned int nr);
 int cola_close(cola_t c);
 
+/* Byte string keys and values, in a file format of their own. Keys are
+ * ordered by cmp, or by memcmp() then length if it's NULL. Like the merge
+ * operator it isn't stored and must be the same every time the file is
+ * opened. Items are buffered in memory and only reach the file once the
+ * buffer fills, on cola_kv_sync() and on close. Not thread-safe.
+*/
+typedef struct _cola_kv *cola_kv_t;
+typedef struct _cola_kv_iter *cola_kv_iter_t;
+typedef int (*cola_cmp_fn)(const void *a, size_t alen,
+				const void *b, size_t blen);
+
+cola_kv_t cola_kv_open(const char *fn, int rw, cola_cmp_fn cmp);
+cola_kv_t cola_kv_creat(const char *fn, int overwrite, cola_cmp_fn cmp);
+int cola_kv_put(cola_kv_t c, const void *key, size_t klen,
+			const void *val, size_t vlen);
+int cola_kv_delete(cola_kv_t c, const void *key, size_t klen);
+
+/* *val points in to the cola, it's good until the cola is next modified */
+int cola_kv_get(cola_kv_t c, const void *key, size_t klen,
+			const void **val, size_t *vlen, int *result);
+
+/* scan keys in [lo, hi], or to the end if hi is NULL, in order. The cola
+ * must not be modified while it's open, what's returned is good until the
+ * next call.
+*/
+cola_kv_iter_t cola_kv_iter_open(cola_kv_t c, const void *lo, size_t lolen,
+				const void *hi, size_t hilen);
+int cola_kv_iter_next(cola_kv_iter_t it, const void **key, size_t *klen,
+			const void **val, size_t *vlen, int *result);
+void cola_kv_iter_close(cola_kv_iter_t it);
+
+int cola_kv_sync(cola_kv_t c);
+int cola_kv_close(cola_kv_t c);
+
 #endif /* _COLA_H */
@@ -0,0 +1,23 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+/* Epoch based reclamation for many readers and one writer. Readers bracket
+ * their use of shared data with epoch_enter() and epoch_exit(), and once the
+ * writer has swapped something out, epoch_sync() waits for every reader which
+ * might still see the old copy to finish with it.
+*/
+struct epoch;
+
+struct epoch *epoch_new(void);
+void epoch_free(struct epoch *e);
+
+unsigned int epoch_enter(struct epoch *e);
+void epoch_exit(struct epoch *e, unsigned int ticket);
+void epoch_sync(struct epoch *e);
+
+#endif /* _EPOCH_H */
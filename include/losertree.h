@@ -0,0 +1,27 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 3
+*/
+#ifndef _LOSERTREE_H
+#define _LOSERTREE_H
+
+#include "cola-common.h"
+
+struct tourn_node {
+	cola_key_t key;
+	unsigned int leaf;
+	int done;
+};
+
+/* tree[0] is the winner, tree[1..nr_leaves - 1] hold the loser of each match.
+ * Initialise from one node per leaf, then to advance the winning input set
+ * the new key (or done) in tree[0] and replay it.
+*/
+void losertree_init(unsigned long nr_leaves,
+			struct tourn_node tree[static nr_leaves],
+			const struct tourn_node leaf[static nr_leaves]);
+void losertree_replay(unsigned long nr_leaves,
+			struct tourn_node tree[static nr_leaves]);
+
+#endif /* _LOSERTREE_H */
@@ -0,0 +1,34 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#ifndef _MEMTABLE_H
+#define _MEMTABLE_H
+
+/* In-memory write buffer holding one entry per key, the fold of every copy
+ * added so far, found through a hash table. It's sorted once to be flushed.
+*/
+struct memtable;
+
+struct memtable *memtable_new(cola_key_t size); /* size is a power of two */
+void memtable_free(struct memtable *m);
+cola_key_t memtable_size(struct memtable *m);
+cola_key_t memtable_nelem(struct memtable *m);
+
+/* fold in a newer copy of a key, returns true once the table is full */
+int memtable_add(struct memtable *m, const struct cola_elem *e,
+			cola_merge_fn fn);
+
+/* *cut is set if a tombstone has to follow the entry, see merge_fold() */
+const struct cola_elem *memtable_get(struct memtable *m, cola_key_t key,
+					int *cut);
+
+/* The entries as a sorted run, each followed by its tombstone if it has one.
+ * The table is unsearchable from then until it's cleared.
+*/
+const struct cola_elem *memtable_sort(struct memtable *m, cola_key_t *n)
+					_check_result;
+void memtable_clear(struct memtable *m);
+
+#endif /* _MEMTABLE_H */
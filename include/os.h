@@ -17,6 +17,24 @@ int fd_pread(int fd, off_t off, void *buf, size_t *sz, int *eof) _check_result;
 int fd_write(int fd, const void *buf, size_t len) _check_result;
 int fd_pwrite(int fd, off_t off, const void *buf, size_t len) _check_result;
 
+/* asynchronous I/O through io_uring, ioring_new() returns NULL if the kernel
+ * doesn't support it and callers should fall back to fd_pread/fd_pwrite
+*/
+struct ioring;
+struct ioreq {
+	size_t len;
+	int res;
+	int busy;
+};
+
+struct ioring *ioring_new(unsigned int entries);
+void ioring_free(struct ioring *r);
+int ioring_pread(struct ioring *r, int fd, off_t off, void *buf, size_t len,
+			struct ioreq *req) _check_result;
+int ioring_pwrite(struct ioring *r, int fd, off_t off, const void *buf,
+			size_t len, struct ioreq *req) _check_result;
+int ioring_wait(struct ioring *r, struct ioreq *req) _check_result;
+
 int fd_block(int fd, int b);
 int fd_coe(int fd, int coe);
 
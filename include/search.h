@@ -0,0 +1,21 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+/* Index of the first of n sorted entries not less than key. Long runs are
+ * halved without branches until what's left spans a few cache lines, which
+ * are then counted with AVX-512 or AVX2 compares if the CPU has them.
+*/
+cola_key_t search_lower_bound(const struct cola_elem *e, cola_key_t n,
+				cola_key_t key);
+cola_key_t search_lower_keys(const cola_key_t *k, cola_key_t n,
+				cola_key_t key);
+
+/* which kernel counts the tail: "avx512", "avx2" or "scalar" */
+const char *search_kernel(void);
+
+#endif /* _SEARCH_H */
@@ -0,0 +1,32 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#ifndef _WAL_H
+#define _WAL_H
+
+/* Append-only log of inserted items. Appends are buffered and a whole group
+ * of them is written out with a single fdatasync once WAL_GROUP have built
+ * up, or by wal_sync(). Items are numbered from the sequence number given
+ * when the log is created.
+*/
+#define WAL_GROUP	1024U
+
+struct wal;
+
+struct wal *wal_open(const char *fn, int create, uint64_t lsn);
+int wal_close(struct wal *w); /* syncs anything still buffered */
+uint64_t wal_lsn(struct wal *w); /* sequence number of the next append */
+int wal_append(struct wal *w, const struct cola_elem *e, size_t n)
+			_check_result;
+int wal_sync(struct wal *w) _check_result;
+
+/* malloc'd copy of every record from lsn on */
+int wal_read(struct wal *w, uint64_t lsn, struct cola_elem **e, size_t *n)
+			_check_result;
+
+/* drop every record before lsn, which may be past the end */
+int wal_truncate(struct wal *w, uint64_t lsn) _check_result;
+
+#endif /* _WAL_H */
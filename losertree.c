@@ -0,0 +1,204 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 3
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <losertree.h>
+
+/* Leaf i sits at node (nr_leaves + i) of an implicit binary tree, so every
+ * internal node has two children for any number of leaves. Exhausted leaves
+ * lose to everything and ties are broken on the leaf index, like the heap.
+ * Nodes carry their keys so a replay never leaves the tree array.
+*/
+static int beats(const struct tourn_node *a, const struct tourn_node *b)
+{
+	if ( a->done != b->done )
+		return b->done;
+	if ( a->key != b->key )
+		return a->key < b->key;
+	return a->leaf < b->leaf;
+}
+
+static void play(unsigned long node, unsigned long nr_leaves,
+			struct tourn_node tree[static nr_leaves],
+			const struct tourn_node leaf[static nr_leaves],
+			struct tourn_node *winner)
+{
+	struct tourn_node l, r;
+
+	if ( node >= nr_leaves ) {
+		*winner = leaf[node - nr_leaves];
+		return;
+	}
+
+	play(node << 1, nr_leaves, tree, leaf, &l);
+	play((node << 1) + 1, nr_leaves, tree, leaf, &r);
+	if ( beats(&r, &l) ) {
+		tree[node] = l;
+		*winner = r;
+	}else{
+		tree[node] = r;
+		*winner = l;
+	}
+}
+
+void losertree_init(unsigned long nr_leaves,
+			struct tourn_node tree[static nr_leaves],
+			const struct tourn_node leaf[static nr_leaves])
+{
+	play(1, nr_leaves, tree, leaf, &tree[0]);
+}
+
+/* one pass from the winner's leaf to the root */
+void losertree_replay(unsigned long nr_leaves,
+			struct tourn_node tree[static nr_leaves])
+{
+	struct tourn_node winner, tmp;
+	unsigned long node;
+
+	winner = tree[0];
+	for(node = (nr_leaves + winner.leaf) >> 1; node; node >>= 1) {
+		if ( beats(&tree[node], &winner) ) {
+			tmp = tree[node];
+			tree[node] = winner;
+			winner = tmp;
+		}
+	}
+
+	tree[0] = winner;
+}
+
+#if MAIN
+#include <time.h>
+#include <minheap.h>
+
+/* benchmark merging k sorted runs with the loser tree against the heap */
+
+static cola_key_t **make_runs(unsigned long k, unsigned long n)
+{
+	cola_key_t **run;
+	unsigned long i, j;
+
+	run = calloc(k, sizeof(*run));
+	for(i = 0; i < k; i++) {
+		cola_key_t key = 0;
+
+		run[i] = malloc(n * sizeof(**run));
+		for(j = 0; j < n; j++) {
+			key += rand() % 64;
+			run[i][j] = key;
+		}
+	}
+
+	return run;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static cola_key_t merge_heap(cola_key_t **run, unsigned long k,
+				unsigned long n)
+{
+	struct heap_item *h;
+	unsigned long *pos;
+	cola_key_t sum = 0;
+	unsigned long i;
+
+	h = calloc(k + 1, sizeof(*h));
+	pos = calloc(k, sizeof(*pos));
+	for(i = 0; i < k; i++) {
+		h[i + 1].key = run[i][0];
+		h[i + 1].val = i;
+	}
+	minheap_init(k, h);
+
+	while(k) {
+		unsigned long next_in = h[1].val;
+
+		sum += h[1].key;
+		h[1] = h[k];
+		minheap_sift_down(k - 1, h);
+
+		if ( ++pos[next_in] < n ) {
+			h[k].key = run[next_in][pos[next_in]];
+			h[k].val = next_in;
+			minheap_sift_up(k, h);
+		}else{
+			k--;
+		}
+	}
+
+	free(pos);
+	free(h);
+	return sum;
+}
+
+static cola_key_t merge_tree(cola_key_t **run, unsigned long k,
+				unsigned long n)
+{
+	struct tourn_node *leaf, *tree;
+	unsigned long *pos;
+	cola_key_t sum = 0;
+	unsigned long i;
+
+	leaf = calloc(k, sizeof(*leaf));
+	tree = calloc(k, sizeof(*tree));
+	pos = calloc(k, sizeof(*pos));
+	for(i = 0; i < k; i++) {
+		leaf[i].key = run[i][0];
+		leaf[i].leaf = i;
+	}
+	losertree_init(k, tree, leaf);
+
+	while(!tree[0].done) {
+		unsigned long next_in = tree[0].leaf;
+
+		sum += tree[0].key;
+		if ( ++pos[next_in] < n )
+			tree[0].key = run[next_in][pos[next_in]];
+		else
+			tree[0].done = 1;
+		losertree_replay(k, tree);
+	}
+
+	free(pos);
+	free(tree);
+	free(leaf);
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long k, n = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1 << 20;
+
+	for(k = 2; k <= 64; k <<= 1) {
+		cola_key_t **run, s1, s2;
+		double t0, t1, t2;
+		unsigned long i;
+
+		run = make_runs(k, n / k);
+		t0 = now();
+		s1 = merge_heap(run, k, n / k);
+		t1 = now();
+		s2 = merge_tree(run, k, n / k);
+		t2 = now();
+
+		printf("k=%2lu heap %.3fs losertree %.3fs%s\n", k,
+			t1 - t0, t2 - t1, (s1 == s2) ? "" : " MISMATCH");
+
+		for(i = 0; i < k; i++)
+			free(run[i]);
+		free(run);
+	}
+
+	return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,196 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <cola.h>
+#include <cola-format.h>
+#include <memtable.h>
+#include <cmath.h>
+
+/* Entries are kept in the order they arrive and the hash table, open
+ * addressed with linear probing, is twice the size so it's never more than
+ * half full. Slots hold the entry number plus one, zero is empty.
+*/
+struct memtable {
+	cola_key_t size;
+	cola_key_t nelem;
+	unsigned int shift;
+	uint32_t *slot;
+	uint64_t *cut;
+	struct cola_elem *e;
+	struct cola_elem *run; /* e with the tombstones, while flushing */
+};
+
+struct memtable *memtable_new(cola_key_t size)
+{
+	struct memtable *m;
+
+	m = calloc(1, sizeof(*m));
+	if ( NULL == m )
+		return NULL;
+
+	m->size = size;
+	m->shift = 64 - (log2_floor64(size) + 1);
+	m->slot = calloc(size * 2, sizeof(*m->slot));
+	m->cut = calloc((size + 63) / 64, sizeof(*m->cut));
+	m->e = malloc(size * sizeof(*m->e));
+	if ( NULL == m->slot || NULL == m->cut || NULL == m->e ) {
+		memtable_free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void memtable_free(struct memtable *m)
+{
+	if ( m ) {
+		free(m->slot);
+		free(m->cut);
+		free(m->e);
+		free(m->run);
+		free(m);
+	}
+}
+
+cola_key_t memtable_size(struct memtable *m)
+{
+	return m->size;
+}
+
+cola_key_t memtable_nelem(struct memtable *m)
+{
+	return m->nelem;
+}
+
+/* the slot which holds key, or the empty one where it would go */
+static uint32_t *find(struct memtable *m, cola_key_t key)
+{
+	cola_key_t mask = m->size * 2 - 1;
+	cola_key_t i;
+
+	for(i = (key * 0x9e3779b97f4a7c15ULL) >> m->shift; ;
+			i = (i + 1) & mask) {
+		uint32_t *s = m->slot + i;
+
+		if ( !*s || m->e[*s - 1].key == key )
+			return s;
+	}
+}
+
+static int test_cut(struct memtable *m, cola_key_t i)
+{
+	return !!(m->cut[i / 64] & (1ULL << (i % 64)));
+}
+
+static void set_cut(struct memtable *m, cola_key_t i, int cut)
+{
+	if ( cut )
+		m->cut[i / 64] |= 1ULL << (i % 64);
+	else
+		m->cut[i / 64] &= ~(1ULL << (i % 64));
+}
+
+/* As for a lookup, a tombstone ends the fold. A value put over a tombstone
+ * has to keep it, to cut off older copies, unless the newest copy wins
+ * anyway.
+*/
+int memtable_add(struct memtable *m, const struct cola_elem *e,
+			cola_merge_fn fn)
+{
+	uint32_t *s;
+	cola_key_t i;
+
+	s = find(m, e->key);
+	if ( !*s ) {
+		i = m->nelem++;
+		*s = i + 1;
+		m->e[i] = *e;
+		set_cut(m, i, 0);
+		return m->nelem == m->size;
+	}
+
+	i = *s - 1;
+	if ( NULL == fn || e->val == COLA_TOMBSTONE ) {
+		m->e[i].val = e->val;
+		set_cut(m, i, 0);
+	}else if ( m->e[i].val == COLA_TOMBSTONE ) {
+		m->e[i].val = e->val;
+		set_cut(m, i, 1);
+	}else{
+		m->e[i].val = (*fn)(e->val, m->e[i].val);
+	}
+
+	return 0;
+}
+
+const struct cola_elem *memtable_get(struct memtable *m, cola_key_t key,
+					int *cut)
+{
+	uint32_t *s;
+
+	if ( !m->nelem )
+		return NULL;
+
+	s = find(m, key);
+	if ( !*s )
+		return NULL;
+
+	*cut = test_cut(m, *s - 1);
+	return m->e + (*s - 1);
+}
+
+/* a key's tombstone goes after its value, keys are otherwise unique */
+static int elem_cmp(const void *A, const void *B)
+{
+	const struct cola_elem *a = A, *b = B;
+
+	if ( a->key < b->key )
+		return -1;
+	if ( a->key > b->key )
+		return 1;
+	return (a->val == COLA_TOMBSTONE) - (b->val == COLA_TOMBSTONE);
+}
+
+const struct cola_elem *memtable_sort(struct memtable *m, cola_key_t *n)
+{
+	cola_key_t i, ncut;
+
+	for(i = ncut = 0; i < m->nelem; i++)
+		ncut += test_cut(m, i);
+
+	if ( !ncut ) {
+		qsort(m->e, m->nelem, sizeof(*m->e), elem_cmp);
+		*n = m->nelem;
+		return m->e;
+	}
+
+	m->run = malloc((m->nelem + ncut) * sizeof(*m->run));
+	if ( NULL == m->run )
+		return NULL;
+
+	for(i = *n = 0; i < m->nelem; i++) {
+		m->run[(*n)++] = m->e[i];
+		if ( test_cut(m, i) ) {
+			m->run[*n].key = m->e[i].key;
+			m->run[*n].val = COLA_TOMBSTONE;
+			(*n)++;
+		}
+	}
+
+	qsort(m->run, *n, sizeof(*m->run), elem_cmp);
+	return m->run;
+}
+
+void memtable_clear(struct memtable *m)
+{
+	memset(m->slot, 0, m->size * 2 * sizeof(*m->slot));
+	m->nelem = 0;
+	free(m->run);
+	m->run = NULL;
+}
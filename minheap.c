@@ -26,22 +26,27 @@ static unsigned long right(unsigned long idx)
 	return (idx << 1) + 1;
 }
 
+/* ties are broken on val so callers can give equal keys a stable order */
+static int item_lt(const struct heap_item *a, const struct heap_item *b)
+{
+	if ( a->key != b->key )
+		return a->key < b->key;
+	return a->val < b->val;
+}
+
 static void do_sift_up(unsigned long idx, unsigned long nr_items,
 				struct heap_item h[static nr_items + 1])
 {
 	struct heap_item tmp;
 	unsigned long pidx;
-	cola_key_t pv, v;
 
 	assert(idx > 0);
 
 	if ( idx == 1 )
 		return;
 
-	v = h[idx].key;
 	pidx = parent(idx);
-	pv = h[pidx].key;
-	if ( pv < v )
+	if ( !item_lt(&h[idx], &h[pidx]) )
 		return;
 
 	tmp = h[pidx];
@@ -65,10 +70,10 @@ static void do_sift_down(unsigned long idx, unsigned long nr_items,
 	if ( r > nr_items ) {
 		smallest = l;
 	}else{
-		smallest = (h[l].key < h[r].key) ? l : r;
+		smallest = item_lt(&h[r], &h[l]) ? r : l;
 	}
 
-	if ( h[idx].key < h[smallest].key )
+	if ( !item_lt(&h[smallest], &h[idx]) )
 		return;
 
 	tmp = h[smallest];
@@ -80,10 +85,10 @@ static void do_sift_down(unsigned long idx, unsigned long nr_items,
 void minheap_init(unsigned long nr_items,
 			struct heap_item h[static nr_items + 1])
 {
-	unsigned int i, n = (nr_items + 1) >> 1;
+	unsigned long i;
 
-	for(i = nr_items; i > nr_items - n; i--) {
-		do_sift_up(i, nr_items, h);
+	for(i = parent(nr_items); i > 0; i--) {
+		do_sift_down(i, nr_items, h);
 	}
 }
 
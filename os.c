@@ -16,7 +16,12 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
 #include <stdio.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
 
 #include <compiler.h>
 #include <os.h>
@@ -369,3 +374,274 @@ int os_sigpipe_ignore(void)
 
 	return 1;
 }
+
+#ifdef __NR_io_uring_setup
+struct ioring {
+	int fd;
+	unsigned int entries;
+	unsigned int pending;
+	unsigned int inflight;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_sz;
+	size_t cq_sz;
+	struct io_uring_sqe *sqes;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/** Create an io_uring.
+ * \ingroup g_fdctl
+ * @param entries number of submission queue entries
+ *
+ * Sets up a ring by hand, there's no dependency on liburing.
+ *
+ * @return NULL if io_uring is unavailable or on error.
+ */
+struct ioring *ioring_new(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct ioring *r;
+	uint8_t *sq, *cq;
+
+	r = calloc(1, sizeof(*r));
+	if ( NULL == r )
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if ( r->fd < 0 ) {
+		free(r);
+		return NULL;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( r->cq_sz > r->sq_sz )
+			r->sq_sz = r->cq_sz;
+		r->cq_sz = 0;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_sz, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if ( r->sq_map == MAP_FAILED )
+		goto err_close;
+
+	if ( r->cq_sz ) {
+		r->cq_map = mmap(NULL, r->cq_sz, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, r->fd,
+				IORING_OFF_CQ_RING);
+		if ( r->cq_map == MAP_FAILED )
+			goto err_unmap_sq;
+	}else{
+		r->cq_map = r->sq_map;
+	}
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if ( r->sqes == MAP_FAILED )
+		goto err_unmap_cq;
+
+	sq = r->sq_map;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	cq = r->cq_map;
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return r;
+
+err_unmap_cq:
+	if ( r->cq_sz )
+		munmap(r->cq_map, r->cq_sz);
+err_unmap_sq:
+	munmap(r->sq_map, r->sq_sz);
+err_close:
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+static int ioring_enter(struct ioring *r, unsigned int submit,
+			unsigned int min_complete)
+{
+	unsigned int flags = (min_complete) ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+again:
+	ret = syscall(__NR_io_uring_enter, r->fd, submit, min_complete,
+			flags, NULL, 0);
+	if ( ret < 0 ) {
+		if ( errno == EINTR || errno == EAGAIN )
+			goto again;
+		return 0;
+	}
+
+	r->pending -= ret;
+	return 1;
+}
+
+/* mark every completed request */
+static unsigned int ioring_reap(struct ioring *r)
+{
+	unsigned int head, tail, nr = 0;
+
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for(; head != tail; head++, nr++) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		struct ioreq *req = (struct ioreq *)(uintptr_t)cqe->user_data;
+
+		req->res = cqe->res;
+		req->busy = 0;
+		r->inflight--;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return nr;
+}
+
+static int ioring_queue(struct ioring *r, int op, int fd, off_t off,
+			void *buf, size_t len, struct ioreq *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	/* submission queue is full: wait for something to finish */
+	while ( *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+			>= r->entries ) {
+		if ( !ioring_enter(r, 0, 1) )
+			return 0;
+		ioring_reap(r);
+	}
+
+	tail = *r->sq_tail;
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->user_data = (uintptr_t)req;
+	r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	req->len = len;
+	req->res = 0;
+	req->busy = 1;
+	r->pending++;
+	r->inflight++;
+
+	/* start it straight away, without waiting */
+	return ioring_enter(r, r->pending, 0);
+}
+
+/** Queue a read at an offset.
+ * \ingroup g_fdctl
+ *
+ * @return 0 on error, 1 on success. The read is complete once the request
+ * has been waited for, after which res holds the result of the read.
+ */
+int ioring_pread(struct ioring *r, int fd, off_t off, void *buf, size_t len,
+			struct ioreq *req)
+{
+	return ioring_queue(r, IORING_OP_READ, fd, off, buf, len, req);
+}
+
+/** Queue a write at an offset.
+ * \ingroup g_fdctl
+ *
+ * @return 0 on error, 1 on success. As for ioring_pread().
+ */
+int ioring_pwrite(struct ioring *r, int fd, off_t off, const void *buf,
+			size_t len, struct ioreq *req)
+{
+	return ioring_queue(r, IORING_OP_WRITE, fd, off, (void *)buf,
+				len, req);
+}
+
+/** Wait for a request to complete.
+ * \ingroup g_fdctl
+ *
+ * Waiting for a request which was never queued, or already completed,
+ * returns at once.
+ *
+ * @return 0 on error, 1 on success.
+ */
+int ioring_wait(struct ioring *r, struct ioreq *req)
+{
+	ioring_reap(r);
+	while ( req->busy ) {
+		if ( !ioring_enter(r, r->pending, 1) )
+			return 0;
+		ioring_reap(r);
+	}
+	return 1;
+}
+
+/** Destroy an io_uring.
+ * \ingroup g_fdctl
+ * @param r ring
+ *
+ * Any requests still in flight are waited for first, since they may target
+ * buffers which are about to be freed.
+ */
+void ioring_free(struct ioring *r)
+{
+	if ( NULL == r )
+		return;
+
+	for(ioring_reap(r); r->inflight; ioring_reap(r)) {
+		if ( !ioring_enter(r, r->pending, 1) )
+			break;
+	}
+
+	munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+	if ( r->cq_sz )
+		munmap(r->cq_map, r->cq_sz);
+	munmap(r->sq_map, r->sq_sz);
+	close(r->fd);
+	free(r);
+}
+#else
+struct ioring *ioring_new(unsigned int entries)
+{
+	return NULL;
+}
+
+void ioring_free(struct ioring *r)
+{
+}
+
+int ioring_pread(struct ioring *r, int fd, off_t off, void *buf, size_t len,
+			struct ioreq *req)
+{
+	return 0;
+}
+
+int ioring_pwrite(struct ioring *r, int fd, off_t off, const void *buf,
+			size_t len, struct ioreq *req)
+{
+	return 0;
+}
+
+int ioring_wait(struct ioring *r, struct ioreq *req)
+{
+	return 0;
+}
+#endif
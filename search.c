@@ -0,0 +1,195 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <cola.h>
+#include <cola-format.h>
+#include <search.h>
+
+/* Below this many entries, 8 cache lines, it's quicker to count the keys
+ * less than the one wanted than to keep halving and mispredicting.
+*/
+#define SEARCH_LINEAR		32U
+
+typedef cola_key_t (*count_fn)(const struct cola_elem *e, cola_key_t n,
+				cola_key_t key);
+typedef cola_key_t (*count_keys_fn)(const cola_key_t *k, cola_key_t n,
+					cola_key_t key);
+
+static cola_key_t count_scalar(const struct cola_elem *e, cola_key_t n,
+				cola_key_t key)
+{
+	cola_key_t i, ret = 0;
+
+	for(i = 0; i < n; i++)
+		ret += (e[i].key < key);
+
+	return ret;
+}
+
+static cola_key_t count_keys_scalar(const cola_key_t *k, cola_key_t n,
+					cola_key_t key)
+{
+	cola_key_t i, ret = 0;
+
+	for(i = 0; i < n; i++)
+		ret += (k[i] < key);
+
+	return ret;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+/* AVX2 only has a signed 64 bit compare, so flip the top bits. The keys of
+ * two pairs of entries are gathered in to one register, out of order, which
+ * doesn't matter for a count.
+*/
+__attribute__((target("avx2,popcnt")))
+static cola_key_t count_avx2(const struct cola_elem *e, cola_key_t n,
+				cola_key_t key)
+{
+	const __m256i bias = _mm256_set1_epi64x((long long)(1ULL << 63));
+	const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((long long)key),
+						bias);
+	cola_key_t i, ret = 0;
+
+	for(i = 0; i + 4 <= n; i += 4) {
+		__m256i a, b, x;
+
+		a = _mm256_loadu_si256((const __m256i *)(e + i));
+		b = _mm256_loadu_si256((const __m256i *)(e + i + 2));
+		x = _mm256_xor_si256(_mm256_unpacklo_epi64(a, b), bias);
+		x = _mm256_cmpgt_epi64(k, x);
+		ret += __builtin_popcount(
+				_mm256_movemask_pd(_mm256_castsi256_pd(x)));
+	}
+
+	return ret + count_scalar(e + i, n - i, key);
+}
+
+__attribute__((target("avx2,popcnt")))
+static cola_key_t count_keys_avx2(const cola_key_t *k, cola_key_t n,
+					cola_key_t key)
+{
+	const __m256i bias = _mm256_set1_epi64x((long long)(1ULL << 63));
+	const __m256i v = _mm256_xor_si256(_mm256_set1_epi64x((long long)key),
+						bias);
+	cola_key_t i, ret = 0;
+
+	for(i = 0; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(k + i));
+
+		x = _mm256_cmpgt_epi64(v, _mm256_xor_si256(x, bias));
+		ret += __builtin_popcount(
+				_mm256_movemask_pd(_mm256_castsi256_pd(x)));
+	}
+
+	return ret + count_keys_scalar(k + i, n - i, key);
+}
+
+/* four entries to a register, the keys are the even lanes */
+__attribute__((target("avx512f,popcnt")))
+static cola_key_t count_avx512(const struct cola_elem *e, cola_key_t n,
+				cola_key_t key)
+{
+	const __m512i k = _mm512_set1_epi64((long long)key);
+	cola_key_t i, ret = 0;
+
+	for(i = 0; i + 4 <= n; i += 4) {
+		__m512i a = _mm512_loadu_si512((const void *)(e + i));
+		ret += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(0x55,
+								a, k));
+	}
+
+	return ret + count_scalar(e + i, n - i, key);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static cola_key_t count_keys_avx512(const cola_key_t *k, cola_key_t n,
+					cola_key_t key)
+{
+	const __m512i v = _mm512_set1_epi64((long long)key);
+	cola_key_t i, ret = 0;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		__m512i x = _mm512_loadu_si512((const void *)(k + i));
+		ret += __builtin_popcount(_mm512_cmplt_epu64_mask(x, v));
+	}
+
+	return ret + count_keys_scalar(k + i, n - i, key);
+}
+#endif
+
+static count_fn count_lt = count_scalar;
+static count_keys_fn count_keys_lt = count_keys_scalar;
+static const char *kernel = "scalar";
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void pick(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx512f") ) {
+		count_lt = count_avx512;
+		count_keys_lt = count_keys_avx512;
+		kernel = "avx512";
+	}else if ( __builtin_cpu_supports("avx2") ) {
+		count_lt = count_avx2;
+		count_keys_lt = count_keys_avx2;
+		kernel = "avx2";
+	}
+#endif
+}
+
+const char *search_kernel(void)
+{
+	pthread_once(&once, pick);
+	return kernel;
+}
+
+/* Each step keeps whichever half holds the lower bound with a conditional
+ * move, and fetches the midpoints of both halves ahead since the next one
+ * is in one of them.
+*/
+cola_key_t search_lower_bound(const struct cola_elem *e, cola_key_t n,
+				cola_key_t key)
+{
+	const struct cola_elem *p = e;
+
+	while ( n > SEARCH_LINEAR ) {
+		cola_key_t half = n / 2;
+
+		__builtin_prefetch(p + half / 2);
+		__builtin_prefetch(p + half + half / 2);
+		p = (p[half].key < key) ? p + half : p;
+		n -= half;
+	}
+
+	pthread_once(&once, pick);
+	return (p - e) + count_lt(p, n, key);
+}
+
+/* the same over an array of keys, where the tail is twice as many keys */
+cola_key_t search_lower_keys(const cola_key_t *k, cola_key_t n,
+				cola_key_t key)
+{
+	const cola_key_t *p = k;
+
+	while ( n > 2 * SEARCH_LINEAR ) {
+		cola_key_t half = n / 2;
+
+		__builtin_prefetch(p + half / 2);
+		__builtin_prefetch(p + half + half / 2);
+		p = (p[half] < key) ? p + half : p;
+		n -= half;
+	}
+
+	pthread_once(&once, pick);
+	return (p - k) + count_keys_lt(p, n, key);
+}
@@ -0,0 +1,395 @@
+/*
+* This file is part of cola
+* Copyright (c) 2013 Gianni Tedesco
+* This program is released under the terms of the GNU GPL version 2
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cola.h>
+#include <cola-format.h>
+#include <wal.h>
+#include <os.h>
+
+#define SCAN_RECS	4096U
+
+struct wal {
+	char *fn;
+	int fd;
+	uint64_t base; /* sequence number of the first record in the file */
+	uint64_t nrec; /* records in the file */
+	unsigned int nbuf;
+	int dirty; /* written since the last fdatasync */
+	struct cola_wal_rec buf[WAL_GROUP];
+};
+
+/* 64bit finaliser from murmurhash3 */
+static uint64_t fmix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint32_t rec_sum(const struct cola_wal_rec *r)
+{
+	return fmix(fmix(fmix(r->seq) ^ r->key) ^ r->val);
+}
+
+static off_t rec_ofs(uint64_t i)
+{
+	return sizeof(struct cola_wal_hdr) + i * sizeof(struct cola_wal_rec);
+}
+
+/* a new file, or a rename over the old one, is only durable once the
+ * directory is synced too
+*/
+static int sync_dir(const char *fn)
+{
+	const char *slash;
+	char *dir;
+	int fd, ret;
+
+	slash = strrchr(fn, '/');
+	if ( NULL == slash )
+		dir = strdup(".");
+	else if ( slash == fn )
+		dir = strdup("/");
+	else
+		dir = strndup(fn, slash - fn);
+	if ( NULL == dir )
+		return 0;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(dir);
+	if ( fd < 0 )
+		return 0;
+
+	ret = !fsync(fd);
+	close(fd);
+	return ret;
+}
+
+static int write_hdr(int fd, uint64_t lsn)
+{
+	struct cola_wal_hdr hdr;
+
+	hdr.w_magic = COLA_WAL_MAGIC;
+	hdr.w_vers = COLA_WAL_VER;
+	hdr.w_lsn = lsn;
+	return fd_pwrite(fd, 0, &hdr, sizeof(hdr));
+}
+
+/* start again from lsn with no records, the header goes first so that any
+ * old records left by a crash have the wrong sequence numbers
+*/
+static int reset(struct wal *w, uint64_t lsn)
+{
+	if ( !write_hdr(w->fd, lsn) || ftruncate(w->fd, rec_ofs(0)) ||
+			fdatasync(w->fd) ) {
+		fprintf(stderr, "%s: %s: %s\n", cmd, w->fn, os_err());
+		return 0;
+	}
+
+	w->base = lsn;
+	w->nrec = 0;
+	w->nbuf = 0;
+	w->dirty = 0;
+	return 1;
+}
+
+/* count the records up to the first one which is torn or stale, and cut
+ * the file off there
+*/
+static int scan(struct wal *w)
+{
+	struct cola_wal_rec *r;
+	struct stat st;
+	int ret = 0;
+
+	r = malloc(SCAN_RECS * sizeof(*r));
+	if ( NULL == r )
+		return 0;
+
+	for(w->nrec = 0; ; ) {
+		size_t sz = SCAN_RECS * sizeof(*r), i;
+		int eof = 0;
+
+		if ( !fd_pread(w->fd, rec_ofs(w->nrec), r, &sz, &eof) ) {
+			fprintf(stderr, "%s: read: %s: %s\n",
+				cmd, w->fn, os_err());
+			goto out;
+		}
+
+		for(i = 0; i < sz / sizeof(*r); i++, w->nrec++) {
+			if ( r[i].seq != (uint32_t)(w->base + w->nrec) ||
+					r[i].sum != rec_sum(r + i) )
+				goto done;
+		}
+
+		if ( sz < SCAN_RECS * sizeof(*r) )
+			break;
+	}
+done:
+	if ( fstat(w->fd, &st) )
+		goto out;
+	if ( st.st_size > rec_ofs(w->nrec) ) {
+		fprintf(stderr, "%s: %s: dropping torn tail after %"PRIu64
+			" records\n", cmd, w->fn, w->nrec);
+		if ( ftruncate(w->fd, rec_ofs(w->nrec)) ||
+				fdatasync(w->fd) )
+			goto out;
+	}
+
+	ret = 1;
+out:
+	free(r);
+	return ret;
+}
+
+struct wal *wal_open(const char *fn, int create, uint64_t lsn)
+{
+	struct cola_wal_hdr hdr;
+	struct wal *w;
+	size_t sz;
+	int eof = 0;
+
+	w = calloc(1, sizeof(*w));
+	if ( NULL == w )
+		return NULL;
+
+	w->fn = strdup(fn);
+	if ( NULL == w->fn )
+		goto out_free;
+
+	w->fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC |
+			((create) ? O_TRUNC : 0), 0644);
+	if ( w->fd < 0 ) {
+		fprintf(stderr, "%s: open: %s: %s\n", cmd, fn, os_err());
+		goto out_free;
+	}
+
+	sz = sizeof(hdr);
+	if ( !fd_pread(w->fd, 0, &hdr, &sz, &eof) ) {
+		fprintf(stderr, "%s: read: %s: %s\n", cmd, fn, os_err());
+		goto out_close;
+	}
+
+	if ( sz < sizeof(hdr) ) {
+		/* new, or lost before its header was ever synced */
+		if ( !reset(w, lsn) || !sync_dir(fn) )
+			goto out_close;
+		return w;
+	}
+
+	if ( hdr.w_magic != COLA_WAL_MAGIC ) {
+		fprintf(stderr, "%s: %s: Bad magic\n", cmd, fn);
+		goto out_close;
+	}
+
+	if ( hdr.w_vers != COLA_WAL_VER ) {
+		fprintf(stderr, "%s: %s: Unsupported vers\n", cmd, fn);
+		goto out_close;
+	}
+
+	w->base = hdr.w_lsn;
+	if ( !scan(w) )
+		goto out_close;
+
+	return w;
+
+out_close:
+	close(w->fd);
+out_free:
+	free(w->fn);
+	free(w);
+	return NULL;
+}
+
+/* write out the buffered group, it's only durable once synced */
+static int flush(struct wal *w)
+{
+	if ( !w->nbuf )
+		return 1;
+
+	if ( !fd_pwrite(w->fd, rec_ofs(w->nrec), w->buf,
+			w->nbuf * sizeof(*w->buf)) ) {
+		fprintf(stderr, "%s: write: %s: %s\n", cmd, w->fn, os_err());
+		return 0;
+	}
+
+	w->nrec += w->nbuf;
+	w->nbuf = 0;
+	w->dirty = 1;
+	return 1;
+}
+
+int wal_sync(struct wal *w)
+{
+	if ( !flush(w) )
+		return 0;
+
+	if ( w->dirty && fdatasync(w->fd) ) {
+		fprintf(stderr, "%s: fdatasync: %s: %s\n",
+			cmd, w->fn, os_err());
+		return 0;
+	}
+
+	w->dirty = 0;
+	return 1;
+}
+
+uint64_t wal_lsn(struct wal *w)
+{
+	return w->base + w->nrec + w->nbuf;
+}
+
+int wal_append(struct wal *w, const struct cola_elem *e, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i < n; i++) {
+		struct cola_wal_rec *r = w->buf + w->nbuf;
+
+		r->key = e[i].key;
+		r->val = e[i].val;
+		r->seq = wal_lsn(w);
+		r->sum = rec_sum(r);
+
+		if ( ++w->nbuf == WAL_GROUP && !wal_sync(w) )
+			return 0;
+	}
+
+	return 1;
+}
+
+int wal_read(struct wal *w, uint64_t lsn, struct cola_elem **e, size_t *n)
+{
+	struct cola_wal_rec *r;
+	size_t i, sz;
+	int eof = 0;
+
+	*e = NULL;
+	*n = 0;
+
+	if ( !flush(w) )
+		return 0;
+
+	if ( lsn < w->base )
+		lsn = w->base;
+	if ( lsn >= w->base + w->nrec )
+		return 1;
+
+	*n = w->base + w->nrec - lsn;
+	r = malloc(*n * sizeof(*r));
+	*e = malloc(*n * sizeof(**e));
+	if ( NULL == r || NULL == *e )
+		goto err;
+
+	sz = *n * sizeof(*r);
+	if ( !fd_pread(w->fd, rec_ofs(lsn - w->base), r, &sz, &eof) ||
+			sz != *n * sizeof(*r) ) {
+		fprintf(stderr, "%s: read: %s: %s\n",
+			cmd, w->fn, os_err2("File truncated"));
+		goto err;
+	}
+
+	for(i = 0; i < *n; i++) {
+		(*e)[i].key = r[i].key;
+		(*e)[i].val = r[i].val;
+	}
+
+	free(r);
+	return 1;
+err:
+	free(r);
+	free(*e);
+	*e = NULL;
+	*n = 0;
+	return 0;
+}
+
+/* Records keep their sequence numbers, so those still wanted are copied to
+ * the start of a new file which is then renamed over the old one.
+*/
+int wal_truncate(struct wal *w, uint64_t lsn)
+{
+	struct cola_wal_rec *r;
+	char *tmp;
+	size_t sz;
+	int eof = 0, fd;
+
+	if ( lsn <= w->base )
+		return 1;
+	if ( lsn >= wal_lsn(w) )
+		return reset(w, lsn);
+
+	if ( !flush(w) )
+		return 0;
+
+	sz = (w->base + w->nrec - lsn) * sizeof(*r);
+	r = malloc(sz);
+	if ( NULL == r )
+		return 0;
+
+	if ( asprintf(&tmp, "%s.tmp", w->fn) < 0 ) {
+		free(r);
+		return 0;
+	}
+
+	if ( !fd_pread(w->fd, rec_ofs(lsn - w->base), r, &sz, &eof) ) {
+		fprintf(stderr, "%s: read: %s: %s\n", cmd, w->fn, os_err());
+		goto err;
+	}
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: open: %s: %s\n", cmd, tmp, os_err());
+		goto err;
+	}
+
+	if ( !write_hdr(fd, lsn) || !fd_pwrite(fd, rec_ofs(0), r, sz) ||
+			fdatasync(fd) || rename(tmp, w->fn) ||
+			!sync_dir(w->fn) ) {
+		fprintf(stderr, "%s: %s: %s\n", cmd, tmp, os_err());
+		close(fd);
+		unlink(tmp);
+		goto err;
+	}
+
+	close(w->fd);
+	w->fd = fd;
+	w->nrec -= lsn - w->base;
+	w->base = lsn;
+	w->dirty = 0;
+	free(tmp);
+	free(r);
+	return 1;
+err:
+	free(tmp);
+	free(r);
+	return 0;
+}
+
+int wal_close(struct wal *w)
+{
+	int ret = 1;
+
+	if ( w ) {
+		ret = wal_sync(w);
+		close(w->fd);
+		free(w->fn);
+		free(w);
+	}
+
+	return ret;
+}